@@ -21,7 +21,7 @@ input_putc (uint8_t key)
   ASSERT (intr_get_level () == INTR_OFF);
   ASSERT (!intq_full (&buffer));
 
-  intq_putc (&buffer, key);
+  intq_put (&buffer, &key, 1);
   serial_notify ();
 }
 
@@ -33,8 +33,8 @@ input_getc (void)
   enum intr_level old_level;
   uint8_t key;
 
-  old_level = intr_disable ();
   key = intq_getc (&buffer);
+  old_level = intr_disable ();
   serial_notify ();
   intr_set_level (old_level);
   
@@ -42,11 +42,9 @@ input_getc (void)
 }
 
 /* Returns true if the input buffer is full,
-   false otherwise.
-   Interrupts must be off. */
+   false otherwise. */
 bool
 input_full (void) 
 {
-  ASSERT (intr_get_level () == INTR_OFF);
   return intq_full (&buffer);
 }
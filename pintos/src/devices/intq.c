@@ -2,7 +2,6 @@
 #include <debug.h>
 #include "threads/thread.h"
 
-static int next (int pos);
 static void wait (struct intq *q, struct thread **waiter);
 static void signal (struct intq *q, struct thread **waiter);
 
@@ -10,105 +9,130 @@ static void signal (struct intq *q, struct thread **waiter);
 void
 intq_init (struct intq *q) 
 {
-  lock_init (&q->lock);
+  lock_init (&q->put_lock);
+  lock_init (&q->get_lock);
+  spinlock_init (&q->wait_lock, "intq");
   q->not_full = q->not_empty = NULL;
-  q->head = q->tail = 0;
+  ring_init (&q->ring, q->buf, sizeof q->buf);
 }
 
 /* Returns true if Q is empty, false otherwise. */
 bool
 intq_empty (const struct intq *q) 
 {
-  ASSERT (intr_get_level () == INTR_OFF);
-  return q->head == q->tail;
+  return ring_empty (&q->ring);
 }
 
 /* Returns true if Q is full, false otherwise. */
 bool
 intq_full (const struct intq *q) 
 {
-  ASSERT (intr_get_level () == INTR_OFF);
-  return next (q->head) == q->tail;
+  return ring_full (&q->ring);
+}
+
+/* Adds up to SIZE bytes from DATA to the end of Q, as many as
+   fit, and returns the number added.  Never sleeps. */
+size_t
+intq_put (struct intq *q, const void *data, size_t size) 
+{
+  size_t cnt = ring_put (&q->ring, data, size);
+  if (cnt > 0)
+    signal (q, &q->not_empty);
+  return cnt;
+}
+
+/* Removes up to SIZE bytes from the front of Q, as many as it
+   holds, into DATA and returns the number removed.  Never
+   sleeps. */
+size_t
+intq_get (struct intq *q, void *data, size_t size) 
+{
+  size_t cnt = ring_get (&q->ring, data, size);
+  if (cnt > 0)
+    signal (q, &q->not_full);
+  return cnt;
 }
 
 /* Removes a byte from Q and returns it.
-   If Q is empty, sleeps until a byte is added.
-   When called from an interrupt handler, Q must not be empty. */
+   If Q is empty, sleeps until a byte is added. */
 uint8_t
 intq_getc (struct intq *q) 
 {
   uint8_t byte;
-  
-  ASSERT (intr_get_level () == INTR_OFF);
-  while (intq_empty (q)) 
-    {
-      ASSERT (!intr_context ());
-      lock_acquire (&q->lock);
-      wait (q, &q->not_empty);
-      lock_release (&q->lock);
-    }
-  
-  byte = q->buf[q->tail];
-  q->tail = next (q->tail);
-  signal (q, &q->not_full);
+
+  ASSERT (!intr_context ());
+
+  lock_acquire (&q->get_lock);
+  while (intq_get (q, &byte, 1) == 0)
+    wait (q, &q->not_empty);
+  lock_release (&q->get_lock);
   return byte;
 }
 
 /* Adds BYTE to the end of Q.
-   If Q is full, sleeps until a byte is removed.
-   When called from an interrupt handler, Q must not be full. */
+   If Q is full, sleeps until a byte is removed. */
 void
 intq_putc (struct intq *q, uint8_t byte) 
 {
-  ASSERT (intr_get_level () == INTR_OFF);
-  while (intq_full (q))
-    {
-      ASSERT (!intr_context ());
-      lock_acquire (&q->lock);
-      wait (q, &q->not_full);
-      lock_release (&q->lock);
-    }
+  ASSERT (!intr_context ());
 
-  q->buf[q->head] = byte;
-  q->head = next (q->head);
-  signal (q, &q->not_empty);
-}
-
-/* Returns the position after POS within an intq. */
-static int
-next (int pos) 
-{
-  return (pos + 1) % INTQ_BUFSIZE;
+  lock_acquire (&q->put_lock);
+  while (intq_put (q, &byte, 1) == 0)
+    wait (q, &q->not_full);
+  lock_release (&q->put_lock);
 }
 
 /* WAITER must be the address of Q's not_empty or not_full
-   member.  Waits until the given condition is true. */
+   member.  Waits until the given condition is true, or at least
+   until the other side of Q makes progress. */
 static void
-wait (struct intq *q UNUSED, struct thread **waiter) 
+wait (struct intq *q, struct thread **waiter) 
 {
+  enum intr_level old_level;
+
   ASSERT (!intr_context ());
-  ASSERT (intr_get_level () == INTR_OFF);
-  ASSERT ((waiter == &q->not_empty && intq_empty (q))
-          || (waiter == &q->not_full && intq_full (q)));
+  ASSERT (waiter == &q->not_empty || waiter == &q->not_full);
 
+  old_level = spinlock_acquire_irqsave (&q->wait_lock);
   *waiter = thread_current ();
-  thread_block ();
+
+  /* Recheck the condition only after announcing ourselves, so
+     that the other side either sees us in *WAITER or makes the
+     condition true before we look.  That takes a full barrier,
+     since x86 may otherwise satisfy the load below before the
+     store above is visible.  See signal(). */
+  asm volatile ("mfence" : : : "memory");
+  if (waiter == &q->not_empty ? intq_empty (q) : intq_full (q))
+    thread_block_and_release (&q->wait_lock);
+  else
+    {
+      *waiter = NULL;
+      spinlock_release (&q->wait_lock);
+    }
+  intr_set_level (old_level);
 }
 
 /* WAITER must be the address of Q's not_empty or not_full
-   member, and the associated condition must be true.  If a
-   thread is waiting for the condition, wakes it up and resets
-   the waiting thread. */
+   member, and the associated condition must have just become
+   true.  If a thread is waiting for the condition, wakes it up
+   and resets the waiting thread.  Pairs with the barrier in
+   wait(). */
 static void
-signal (struct intq *q UNUSED, struct thread **waiter) 
+signal (struct intq *q, struct thread **waiter) 
 {
-  ASSERT (intr_get_level () == INTR_OFF);
-  ASSERT ((waiter == &q->not_empty && !intq_empty (q))
-          || (waiter == &q->not_full && !intq_full (q)));
+  enum intr_level old_level;
+  struct thread *t;
 
-  if (*waiter != NULL) 
-    {
-      thread_unblock (*waiter);
-      *waiter = NULL;
-    }
+  ASSERT (waiter == &q->not_empty || waiter == &q->not_full);
+
+  asm volatile ("mfence" : : : "memory");
+  if (*(struct thread *volatile *) waiter == NULL)
+    return;
+
+  old_level = spinlock_acquire_irqsave (&q->wait_lock);
+  t = *waiter;
+  *waiter = NULL;
+  if (t != NULL)
+    thread_unblock (t);
+  spinlock_release_irqrestore (&q->wait_lock, old_level);
 }
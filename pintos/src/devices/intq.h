@@ -1,42 +1,52 @@
 #ifndef DEVICES_INTQ_H
 #define DEVICES_INTQ_H
 
+#include <ring.h>
 #include "threads/interrupt.h"
+#include "threads/spinlock.h"
 #include "threads/synch.h"
 
 /* An "interrupt queue", a circular buffer shared between
    kernel threads and external interrupt handlers.
 
-   Interrupt queue functions can be called from kernel threads or
-   from external interrupt handlers.  Except for intq_init(),
-   interrupts must be off in either case.
+   The bytes live in a lock-free ring buffer (see
+   lib/kernel/ring.h), so an interrupt queue may be used with
+   interrupts on or off and from any CPU, as long as at most one
+   caller adds bytes and at most one caller removes bytes at any
+   given time.
 
-   The interrupt queue has the structure of a "monitor".  Locks
-   and condition variables from threads/synch.h cannot be used in
-   this case, as they normally would, because they can only
-   protect kernel threads from one another, not from interrupt
-   handlers. */
+   intq_put() and intq_get() never sleep and move as many bytes
+   as they can in one go, so they suit interrupt handlers and
+   callers that hold a spinlock.  intq_putc() and intq_getc()
+   sleep until there is room or a byte, so they may only be
+   called by kernel threads.  They serialize their callers with
+   a lock, so any number of threads may use them, but a side of
+   the queue used by them must not also be used by intq_put() or
+   intq_get(). */
 
-/* Queue buffer size, in bytes. */
-#define INTQ_BUFSIZE 64
+/* Queue buffer size, in bytes.  Must be a power of 2. */
+#define INTQ_BUFSIZE 256
 
 /* A circular queue of bytes. */
 struct intq
   {
     /* Waiting threads. */
-    struct lock lock;           /* Only one thread may wait at once. */
+    struct lock put_lock;       /* Serializes intq_putc() callers. */
+    struct lock get_lock;       /* Serializes intq_getc() callers. */
+    struct spinlock wait_lock;  /* Protects the members below. */
     struct thread *not_full;    /* Thread waiting for not-full condition. */
     struct thread *not_empty;   /* Thread waiting for not-empty condition. */
 
     /* Queue. */
+    struct ring ring;           /* Ring buffer over buf. */
     uint8_t buf[INTQ_BUFSIZE];  /* Buffer. */
-    int head;                   /* New data is written here. */
-    int tail;                   /* Old data is read here. */
   };
 
 void intq_init (struct intq *);
 bool intq_empty (const struct intq *);
 bool intq_full (const struct intq *);
+size_t intq_put (struct intq *, const void *, size_t);
+size_t intq_get (struct intq *, void *, size_t);
 uint8_t intq_getc (struct intq *);
 void intq_putc (struct intq *, uint8_t);
 
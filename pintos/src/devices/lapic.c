@@ -0,0 +1,273 @@
+#include "devices/lapic.h"
+#include <debug.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "threads/init.h"
+#include "threads/palloc.h"
+#include "threads/pte.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Interface to the local APIC built into every x86 CPU since the
+   Pentium.  Each CPU has its own local APIC, which we use to
+   start the other CPUs, to send interprocessor interrupts, and
+   as a per-CPU timer.  External devices still interrupt through
+   the 8259A PICs, which only the bootstrap processor listens to.
+   Refer to [IA32-v3a] chapter 10 "Advanced Programmable
+   Interrupt Controller (APIC)" for details. */
+
+/* Kernel virtual address at which the local APIC registers are
+   mapped.  This is the APIC's usual physical address, which is
+   well above the end of the mapping of RAM at PHYS_BASE.  Every
+   CPU sees its own local APIC at the same address. */
+#define LAPIC_VADDR 0xfee00000
+
+/* Local APIC register offsets, in bytes. */
+#define LAPIC_ID         0x020  /* Local APIC ID. */
+#define LAPIC_TPR        0x080  /* Task priority. */
+#define LAPIC_EOI        0x0b0  /* End of interrupt. */
+#define LAPIC_SVR        0x0f0  /* Spurious interrupt vector. */
+#define LAPIC_ESR        0x280  /* Error status. */
+#define LAPIC_ICR_LO     0x300  /* Interrupt command, low half. */
+#define LAPIC_ICR_HI     0x310  /* Interrupt command, high half. */
+#define LAPIC_LVT_TIMER  0x320  /* Local vector table: timer. */
+#define LAPIC_LVT_LINT0  0x350  /* Local vector table: LINT0 pin. */
+#define LAPIC_LVT_LINT1  0x360  /* Local vector table: LINT1 pin. */
+#define LAPIC_LVT_ERROR  0x370  /* Local vector table: errors. */
+#define LAPIC_TIMER_INIT 0x380  /* Timer initial count. */
+#define LAPIC_TIMER_CUR  0x390  /* Timer current count. */
+#define LAPIC_TIMER_DIV  0x3e0  /* Timer divide configuration. */
+
+/* Register bits. */
+#define SVR_ENABLE       0x100          /* APIC software enable. */
+#define LVT_MASKED       0x10000        /* Interrupt masked. */
+#define LVT_PERIODIC     0x20000        /* Timer periodic mode. */
+#define ICR_FIXED        0x00000        /* Fixed delivery mode. */
+#define ICR_INIT         0x00500        /* INIT delivery mode. */
+#define ICR_STARTUP      0x00600        /* Start-up delivery mode. */
+#define ICR_PENDING      0x01000        /* Delivery status: pending. */
+#define ICR_ASSERT       0x04000        /* Level: assert. */
+#define ICR_LEVEL        0x08000        /* Trigger mode: level. */
+#define TIMER_DIV_16     0x3            /* Divide bus clock by 16. */
+
+/* Timer ticks to count local APIC timer cycles over. */
+#define CALIBRATE_TICKS 10
+
+/* Mapped local APIC registers, or a null pointer if the local
+   APIC is not in use. */
+static volatile uint32_t *lapic;
+
+/* Local APIC timer counts per timer tick.
+   Initialized by lapic_timer_calibrate(). */
+static uint32_t timer_count;
+
+static void setup_local (void);
+
+static inline uint32_t
+lapic_read (unsigned reg)
+{
+  return lapic[reg / sizeof *lapic];
+}
+
+static inline void
+lapic_write (unsigned reg, uint32_t value)
+{
+  lapic[reg / sizeof *lapic] = value;
+
+  /* Reading back any register waits for the write to complete. */
+  lapic_read (LAPIC_ID);
+}
+
+/* Maps the local APIC registers, found at physical address
+   PHYS_BASE, into the kernel page table and enables the
+   bootstrap processor's local APIC.  The LINT0 and LINT1 pins
+   are left as the BIOS programmed them, so that PIC interrupts
+   keep arriving through "virtual wire" mode. */
+void
+lapic_init (uintptr_t phys_base)
+{
+  void *vaddr = (void *) LAPIC_VADDR;
+  uint32_t *pde = &init_page_dir[pd_no (vaddr)];
+  uint32_t *pt;
+
+  ASSERT (pg_ofs ((void *) phys_base) == 0);
+
+  if (*pde == 0)
+    {
+      pt = palloc_get_page (PAL_ASSERT | PAL_ZERO);
+      *pde = pde_create (pt);
+    }
+  else
+    pt = pde_get_pt (*pde);
+  pt[pt_no (vaddr)] = phys_base | PTE_PCD | PTE_PWT | PTE_W | PTE_P;
+  asm volatile ("invlpg (%0)" : : "r" (vaddr) : "memory");
+
+  lapic = vaddr;
+  setup_local ();
+}
+
+/* Enables the local APIC of an application processor.  Unlike
+   the bootstrap processor, it does not take PIC interrupts. */
+void
+lapic_init_ap (void)
+{
+  ASSERT (lapic != NULL);
+
+  lapic_write (LAPIC_LVT_LINT0, LVT_MASKED);
+  lapic_write (LAPIC_LVT_LINT1, LVT_MASKED);
+  setup_local ();
+}
+
+/* Returns true if lapic_init() has been called. */
+bool
+lapic_present (void)
+{
+  return lapic != NULL;
+}
+
+/* Returns the running CPU's local APIC ID. */
+uint8_t
+lapic_id (void)
+{
+  ASSERT (lapic != NULL);
+  return lapic_read (LAPIC_ID) >> 24;
+}
+
+/* Acknowledges the interrupt being serviced by the running CPU's
+   local APIC. */
+void
+lapic_eoi (void)
+{
+  lapic_write (LAPIC_EOI, 0);
+}
+
+/* Sends an interprocessor interrupt with command LOW to the CPU
+   whose local APIC ID is APIC_ID and waits for it to be
+   accepted. */
+static void
+send_icr (uint8_t apic_id, uint32_t low)
+{
+  ASSERT (lapic != NULL);
+
+  lapic_write (LAPIC_ICR_HI, (uint32_t) apic_id << 24);
+  lapic_write (LAPIC_ICR_LO, low);
+  while (lapic_read (LAPIC_ICR_LO) & ICR_PENDING)
+    barrier ();
+}
+
+/* Sends an INIT IPI to APIC_ID, resetting that CPU into its
+   wait-for-startup state.  See [IA32-v3a] 8.4.4 "MP
+   Initialization Example". */
+void
+lapic_send_init (uint8_t apic_id)
+{
+  send_icr (apic_id, ICR_INIT | ICR_LEVEL | ICR_ASSERT);
+  timer_mdelay (10);
+  send_icr (apic_id, ICR_INIT | ICR_LEVEL);
+}
+
+/* Sends a start-up IPI to APIC_ID, which makes that CPU begin
+   executing in real mode at physical address START_PADDR.
+   START_PADDR must be page-aligned and below 1 MB. */
+void
+lapic_send_startup (uint8_t apic_id, uintptr_t start_paddr)
+{
+  ASSERT (pg_ofs ((void *) start_paddr) == 0 && start_paddr < 0x100000);
+
+  send_icr (apic_id, ICR_STARTUP | (start_paddr >> PGBITS));
+  timer_udelay (200);
+}
+
+/* Sends an interrupt with vector VEC to the CPU whose local APIC
+   ID is APIC_ID. */
+void
+lapic_send_ipi (uint8_t apic_id, uint8_t vec)
+{
+  send_icr (apic_id, ICR_FIXED | vec);
+}
+
+/* Measures how fast the local APIC timer counts, in terms of
+   timer ticks.  Interrupts must be on and the timer running. */
+void
+lapic_timer_calibrate (void)
+{
+  int64_t start;
+
+  ASSERT (lapic != NULL);
+
+  lapic_write (LAPIC_TIMER_DIV, TIMER_DIV_16);
+  lapic_write (LAPIC_LVT_TIMER, LVT_MASKED | LAPIC_VEC_TIMER);
+
+  /* Wait for a timer tick, then let the APIC timer count down
+     from its maximum for CALIBRATE_TICKS ticks. */
+  start = timer_ticks ();
+  while (timer_ticks () == start)
+    barrier ();
+  lapic_write (LAPIC_TIMER_INIT, UINT32_MAX);
+  start = timer_ticks ();
+  while (timer_elapsed (start) < CALIBRATE_TICKS)
+    barrier ();
+  timer_count = (UINT32_MAX - lapic_read (LAPIC_TIMER_CUR)) / CALIBRATE_TICKS;
+  lapic_write (LAPIC_TIMER_INIT, 0);
+
+  printf ("Local APIC timer: %'"PRIu32" counts/tick.\n", timer_count);
+}
+
+/* Starts the running CPU's local APIC timer interrupting
+   TIMER_FREQ times per second on LAPIC_VEC_TIMER. */
+void
+lapic_timer_start (void)
+{
+  ASSERT (timer_count != 0);
+
+  lapic_write (LAPIC_TIMER_DIV, TIMER_DIV_16);
+  lapic_write (LAPIC_LVT_TIMER, LVT_PERIODIC | LAPIC_VEC_TIMER);
+  lapic_write (LAPIC_TIMER_INIT, timer_count);
+}
+
+/* Arms the running CPU's local APIC timer to interrupt just once,
+   after TICKS timer ticks, instead of periodically.
+   lapic_timer_start() returns it to periodic mode. */
+void
+lapic_timer_oneshot (unsigned ticks)
+{
+  uint64_t count = (uint64_t) timer_count * ticks;
+
+  ASSERT (timer_count != 0);
+  ASSERT (ticks > 0);
+
+  lapic_write (LAPIC_TIMER_DIV, TIMER_DIV_16);
+  lapic_write (LAPIC_LVT_TIMER, LAPIC_VEC_TIMER);
+  lapic_write (LAPIC_TIMER_INIT, count < UINT32_MAX ? count : UINT32_MAX);
+}
+
+/* Returns the number of whole timer ticks that the running CPU's
+   local APIC timer has counted since it was last armed. */
+unsigned
+lapic_timer_elapsed (void)
+{
+  ASSERT (timer_count != 0);
+
+  return ((lapic_read (LAPIC_TIMER_INIT) - lapic_read (LAPIC_TIMER_CUR))
+          / timer_count);
+}
+
+/* Enables the running CPU's local APIC, with all interrupts
+   except IPIs masked until they are configured. */
+static void
+setup_local (void)
+{
+  lapic_write (LAPIC_SVR, SVR_ENABLE | LAPIC_VEC_SPURIOUS);
+  lapic_write (LAPIC_LVT_TIMER, LVT_MASKED | LAPIC_VEC_TIMER);
+  lapic_write (LAPIC_LVT_ERROR, LVT_MASKED);
+
+  /* Clear errors; the ESR must be written twice. */
+  lapic_write (LAPIC_ESR, 0);
+  lapic_write (LAPIC_ESR, 0);
+
+  /* Accept interrupts of every priority, and acknowledge anything
+     left over. */
+  lapic_write (LAPIC_TPR, 0);
+  lapic_eoi ();
+}
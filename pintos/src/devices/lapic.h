@@ -0,0 +1,30 @@
+#ifndef DEVICES_LAPIC_H
+#define DEVICES_LAPIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Interrupt vectors delivered by the local APIC.  They sit at the
+   top of the vector space, well clear of the PIC's 0x20...0x2f
+   and the system call vector 0x30. */
+#define LAPIC_VEC_BASE     0xf0    /* First local APIC vector. */
+#define LAPIC_VEC_TIMER    0xf0    /* Local APIC timer. */
+#define LAPIC_VEC_RESCHED  0xf1    /* Reschedule IPI. */
+#define LAPIC_VEC_SPURIOUS 0xff    /* Spurious interrupt. */
+
+void lapic_init (uintptr_t phys_base);
+void lapic_init_ap (void);
+bool lapic_present (void);
+uint8_t lapic_id (void);
+void lapic_eoi (void);
+
+void lapic_send_init (uint8_t apic_id);
+void lapic_send_startup (uint8_t apic_id, uintptr_t start_paddr);
+void lapic_send_ipi (uint8_t apic_id, uint8_t vec);
+
+void lapic_timer_calibrate (void);
+void lapic_timer_start (void);
+void lapic_timer_oneshot (unsigned ticks);
+unsigned lapic_timer_elapsed (void);
+
+#endif /* devices/lapic.h */
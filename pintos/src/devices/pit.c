@@ -1,5 +1,6 @@
 #include "devices/pit.h"
 #include <debug.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include "threads/interrupt.h"
 #include "threads/io.h"
@@ -11,9 +12,6 @@
 #define PIT_PORT_CONTROL          0x43                /* Control port. */
 #define PIT_PORT_COUNTER(CHANNEL) (0x40 + (CHANNEL))  /* Counter port. */
 
-/* PIT cycles per second. */
-#define PIT_HZ 1193180
-
 /* Configure the given CHANNEL in the PIT.  In a PC, the PIT's
    three output channels are hooked up like this:
 
@@ -39,21 +37,35 @@
        it is 1, for the second half it is 0.  This is useful for
        generating a tone on a speaker.
 
-     - Other modes are less useful.
+     - Other modes are less useful here, but see
+       pit_start_oneshot().
 
    FREQUENCY is the number of periods per second, in Hz. */
 void
 pit_configure_channel (int channel, int mode, int frequency)
 {
-  uint16_t count;
+  uint16_t count = pit_period_count (frequency);
   enum intr_level old_level;
 
   ASSERT (channel == 0 || channel == 2);
   ASSERT (mode == 2 || mode == 3);
 
-  /* Convert FREQUENCY to a PIT counter value.  The PIT has a
-     clock that runs at PIT_HZ cycles per second.  We must
-     translate FREQUENCY into a number of these cycles. */
+  /* Configure the PIT mode and load its counters. */
+  old_level = intr_disable ();
+  outb (PIT_PORT_CONTROL, (channel << 6) | 0x30 | (mode << 1));
+  outb (PIT_PORT_COUNTER (channel), count);
+  outb (PIT_PORT_COUNTER (channel), count >> 8);
+  intr_set_level (old_level);
+}
+
+/* Returns the PIT counter value for a period of FREQUENCY Hz.
+   The PIT has a clock that runs at PIT_HZ cycles per second, so
+   this is FREQUENCY translated into a number of those cycles. */
+uint16_t
+pit_period_count (int frequency)
+{
+  uint16_t count;
+
   if (frequency < 19)
     {
       /* Frequency is too low: the quotient would overflow the
@@ -73,11 +85,41 @@ pit_configure_channel (int channel, int mode, int frequency)
     }
   else
     count = (PIT_HZ + frequency / 2) / frequency;
+  return count;
+}
 
-  /* Configure the PIT mode and load its counters. */
-  old_level = intr_disable ();
-  outb (PIT_PORT_CONTROL, (channel << 6) | 0x30 | (mode << 1));
-  outb (PIT_PORT_COUNTER (channel), count);
-  outb (PIT_PORT_COUNTER (channel), count >> 8);
-  intr_set_level (old_level);
+/* Starts channel 0 counting down once from COUNT, which must be
+   nonzero, in mode 0 ("interrupt on terminal count").  Its
+   output, and so interrupt line 0, goes high when the count
+   reaches zero and stays high until the channel is reconfigured.
+   Interrupts must be off. */
+void
+pit_start_oneshot (uint16_t count)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (count != 0);
+
+  outb (PIT_PORT_CONTROL, 0x30);
+  outb (PIT_PORT_COUNTER (0), count);
+  outb (PIT_PORT_COUNTER (0), count >> 8);
+}
+
+/* Returns channel 0's current count.  If OUTPUT is nonnull, also
+   stores the state of channel 0's output in *OUTPUT.  Interrupts
+   must be off.  See [8254] "Read-Back Command". */
+uint16_t
+pit_read_count (bool *output)
+{
+  uint8_t status, lo, hi;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  /* Latch both the status and the count of channel 0. */
+  outb (PIT_PORT_CONTROL, 0xc2);
+  status = inb (PIT_PORT_COUNTER (0));
+  lo = inb (PIT_PORT_COUNTER (0));
+  hi = inb (PIT_PORT_COUNTER (0));
+  if (output != NULL)
+    *output = (status & 0x80) != 0;
+  return lo | (hi << 8);
 }
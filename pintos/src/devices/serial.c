@@ -5,8 +5,10 @@
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/spinlock.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
+#include "threads/trace.h"
 
 /* Register definitions for the 16550A UART used in PCs.
    The 16550A has a lot more going on than shown here, but this
@@ -37,6 +39,16 @@
 #define IER_RECV 0x01           /* Interrupt when data received. */
 #define IER_XMIT 0x02           /* Interrupt when transmit finishes. */
 
+/* FIFO Control Register bits. */
+#define FCR_ENABLE 0x01         /* Enable receive and transmit FIFOs. */
+#define FCR_CLEAR 0x06          /* Clear receive and transmit FIFOs. */
+
+/* Interrupt Identification Register bits. */
+#define IIR_FIFO 0xc0           /* FIFOs enabled. */
+
+/* Transmit FIFO size of the 16550A, in bytes. */
+#define XMIT_FIFO_SIZE 16
+
 /* Line Control Register bits. */
 #define LCR_N81 0x03            /* No parity, 8 data bits, 1 stop bit. */
 #define LCR_DLAB 0x80           /* Divisor Latch Access Bit (DLAB). */
@@ -47,12 +59,23 @@
 /* Line Status Register. */
 #define LSR_DR 0x01             /* Data Ready: received data byte is in RBR. */
 #define LSR_THRE 0x20           /* THR Empty. */
+
+/* Received byte that dumps the scheduler trace. */
+#define CTRL_T 0x14
 
 /* Transmission mode. */
 static enum { UNINIT, POLL, QUEUE } mode;
 
-/* Data to be transmitted. */
+/* Number of bytes that may be written to THR each time it
+   becomes empty: the transmit FIFO size, or 1 if the UART turned
+   out to have no working FIFO. */
+static size_t xmit_burst;
+
+/* Data to be transmitted.  Any CPU may queue data, but only the
+   bootstrap processor takes serial interrupts, so TXQ_LOCK keeps
+   them apart. */
 static struct intq txq;
+static struct spinlock txq_lock = { .name = "serial" };
 
 static void set_serial (int bps);
 static void putc_poll (uint8_t);
@@ -68,9 +91,10 @@ init_poll (void)
 {
   ASSERT (mode == UNINIT);
   outb (IER_REG, 0);                    /* Turn off all interrupts. */
-  outb (FCR_REG, 0);                    /* Disable FIFO. */
+  outb (FCR_REG, FCR_ENABLE | FCR_CLEAR); /* Enable FIFOs. */
   set_serial (9600);                    /* 9.6 kbps, N-8-1. */
   outb (MCR_REG, MCR_OUT2);             /* Required to enable interrupts. */
+  xmit_burst = (inb (IIR_REG) & IIR_FIFO) == IIR_FIFO ? XMIT_FIFO_SIZE : 1;
   intq_init (&txq);
   mode = POLL;
 } 
@@ -98,7 +122,7 @@ serial_init_queue (void)
 void
 serial_putc (uint8_t byte) 
 {
-  enum intr_level old_level = intr_disable ();
+  enum intr_level old_level = spinlock_acquire_irqsave (&txq_lock);
 
   if (mode != QUEUE)
     {
@@ -112,21 +136,21 @@ serial_putc (uint8_t byte)
     {
       /* Otherwise, queue a byte and update the interrupt enable
          register. */
-      if (old_level == INTR_OFF && intq_full (&txq)) 
+      if (intq_full (&txq)) 
         {
-          /* Interrupts are off and the transmit queue is full.
-             If we wanted to wait for the queue to empty,
-             we'd have to reenable interrupts.
-             That's impolite, so we'll send a character via
-             polling instead. */
-          putc_poll (intq_getc (&txq)); 
+          /* The transmit queue is full.  We can't wait for it to
+             empty while holding txq_lock, so we'll send a
+             character via polling instead. */
+          uint8_t old;
+          intq_get (&txq, &old, 1);
+          putc_poll (old); 
         }
 
-      intq_putc (&txq, byte); 
+      intq_put (&txq, &byte, 1); 
       write_ier ();
     }
   
-  intr_set_level (old_level);
+  spinlock_release_irqrestore (&txq_lock, old_level);
 }
 
 /* Flushes anything in the serial buffer out the port in polling
@@ -134,10 +158,12 @@ serial_putc (uint8_t byte)
 void
 serial_flush (void) 
 {
-  enum intr_level old_level = intr_disable ();
-  while (!intq_empty (&txq))
-    putc_poll (intq_getc (&txq));
-  intr_set_level (old_level);
+  enum intr_level old_level = spinlock_acquire_irqsave (&txq_lock);
+  uint8_t byte;
+
+  while (intq_get (&txq, &byte, 1) > 0)
+    putc_poll (byte);
+  spinlock_release_irqrestore (&txq_lock, old_level);
 }
 
 /* The fullness of the input buffer may have changed.  Reassess
@@ -214,15 +240,32 @@ serial_interrupt (struct intr_frame *f UNUSED)
   inb (IIR_REG);
 
   /* As long as we have room to receive a byte, and the hardware
-     has a byte for us, receive a byte.  */
+     has a byte for us, receive a byte.  Ctrl+T, as on BSD
+     terminals, asks for status instead: it dumps the scheduler
+     trace. */
   while (!input_full () && (inb (LSR_REG) & LSR_DR) != 0)
-    input_putc (inb (RBR_REG));
+    {
+      uint8_t byte = inb (RBR_REG);
+      if (byte == CTRL_T)
+        trace_request_dump ();
+      else
+        input_putc (byte);
+    }
 
-  /* As long as we have a byte to transmit, and the hardware is
-     ready to accept a byte for transmission, transmit a byte. */
+  /* As long as we have bytes to transmit, and the hardware is
+     ready to accept them, transmit a FIFO's worth at a time. */
+  spinlock_acquire (&txq_lock);
   while (!intq_empty (&txq) && (inb (LSR_REG) & LSR_THRE) != 0) 
-    outb (THR_REG, intq_getc (&txq));
+    {
+      uint8_t buf[XMIT_FIFO_SIZE];
+      size_t cnt = intq_get (&txq, buf, xmit_burst);
+      size_t i;
+
+      for (i = 0; i < cnt; i++)
+        outb (THR_REG, buf[i]);
+    }
 
   /* Update interrupt enable register based on queue status. */
   write_ier ();
+  spinlock_release (&txq_lock);
 }
@@ -3,11 +3,15 @@
 #include <inttypes.h>
 #include <round.h>
 #include <stdio.h>
+#include "devices/lapic.h"
 #include "devices/pit.h"
 #include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/smp.h"
+#include "threads/spinlock.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
+#include "threads/tsc.h"
   
 /* See [8254] for hardware details of the 8254 timer chip. */
 
@@ -25,24 +29,107 @@ static int64_t ticks;
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
+/* Nanoseconds per second. */
+#define NS_PER_SEC 1000000000
+
+/* Ticks to measure the TSC over in timer_calibrate(). */
+#define TSC_CALIBRATE_TICKS (TIMER_FREQ / 10)
+
+/* Time-stamp counter calibration.  Initialized by
+   timer_calibrate().  Timer tick N begins at TSC value
+   tsc_base + N * tsc_per_tick. */
+static uint64_t tsc_hz;         /* TSC cycles per second. */
+static uint64_t tsc_per_tick;   /* TSC cycles per timer tick. */
+static uint64_t tsc_base;       /* TSC value at tick 0. */
+
+/* Event-driven timer.
+
+   Until the TSC is calibrated, the 8254 interrupts the bootstrap
+   processor periodically, TIMER_FREQ times per second, and each
+   interrupt is one tick.  After that, the 8254 runs in one-shot
+   mode ("event mode") and `ticks' follows the TSC.  Each timer
+   interrupt brings `ticks' up to date and arms the 8254 for the
+   next event, which is normally the start of the next tick, but
+   may be earlier, to wake a thread in timer_sleep_ns(), or
+   later:
+
+   Taking a timer interrupt every tick while a CPU has nothing to
+   do wastes power and, under a virtual machine, host CPU time.
+   So when the bootstrap processor goes idle, timer_idle() arms
+   the 8254 for the next tick on which something is due.  If some
+   other interrupt ends the idle period early, timer_intr_enter()
+   catches up first, so that `ticks' is never stale while a
+   thread other than the idle thread runs.  The 8254 counts at
+   1.19 MHz into a 16-bit counter, so a single one-shot lasts at
+   most about 55 ms, after which the timer interrupt just rearms
+   it.
+
+   The application processors have no global time to keep, so an
+   idle AP simply stretches its local APIC timer to
+   IDLE_BALANCE_TICKS ticks.  It still wakes up that often to
+   look for work to steal, in case it missed a reschedule IPI. */
+#define IDLE_BALANCE_TICKS (TIMER_FREQ / 10)
+
+/* Event mode state, only touched by the bootstrap processor with
+   interrupts off, and with timer_lock held while arming. */
+static bool event_mode;         /* 8254 in one-shot mode? */
+static uint64_t event_tsc;      /* TSC value when the one-shot ends. */
+static uint64_t max_event_tsc;  /* Longest one-shot, in TSC cycles. */
+static volatile bool rearm;     /* Another CPU wants an earlier event. */
+
 static intr_handler_func timer_interrupt;
+static uint64_t ns_to_tsc (int64_t ns);
+static void advance_ticks (bool idle);
+static void arm_event (bool idle);
+static void program_event (bool idle);
+static void hr_wake (uint64_t now);
+static void run_timers (int64_t now);
+static void wheel_insert (struct timer *);
+static int64_t wheel_next_expiry (void);
+static void ap_catch_up (void);
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
 static void real_time_delay (int64_t num, int32_t denom);
 
-/* Heap storing sleeping threads. */
-static struct heap sleep_thread_heap;
-
-static heap_less_func cmp_awake_time;
+/* Timer wheel.
+
+   Pending kernel timers live in a hashed hierarchical timing
+   wheel: WHEEL_LEVELS arrays of WHEEL_SLOTS lists each.  Level 0
+   has a slot for each of the next WHEEL_SLOTS ticks, level 1 a
+   slot for each run of WHEEL_SLOTS ticks after that, and so on,
+   each level WHEEL_SLOTS times coarser than the one below.
+   Adding or cancelling a timer takes constant time.  Each tick
+   runs the timers in its level 0 slot.  Every WHEEL_SLOTS ticks,
+   the next slot of level 1 is "cascaded": its timers move down
+   into level 0, and likewise up the levels.  A timer cascades at
+   most WHEEL_LEVELS - 1 times, so the work per tick is amortized
+   constant however many timers are pending.  Timers due beyond
+   the wheel's span wait in the top level and cascade around it
+   again. */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN ((int64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+static struct list wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static int64_t wheel_ticks;     /* Next tick whose timers to run. */
+
+/* Heap of threads in timer_sleep_ns(), ordered by wake time. */
+static struct heap hr_sleep_heap;
+
+/* Protects the timer wheel and hr_sleep_heap. */
+static struct spinlock timer_lock;
+
+static heap_less_func cmp_wake_tsc;
 
 static bool
-cmp_awake_time (const heap_elem a,
-                const heap_elem b)
+cmp_wake_tsc (const struct heap_elem *a, const struct heap_elem *b)
 {
-  struct thread *elem_a = (struct thread *)a;
-  struct thread *elem_b = (struct thread *)b;
-  return elem_a->wake_time > elem_b->wake_time;
+  const struct thread *elem_a = heap_entry (a, struct thread, sleep_elem);
+  const struct thread *elem_b = heap_entry (b, struct thread, sleep_elem);
+  return elem_a->wake_tsc > elem_b->wake_tsc;
 }
 
 /* Sets up the timer to interrupt TIMER_FREQ times per second,
@@ -50,16 +137,25 @@ cmp_awake_time (const heap_elem a,
 void
 timer_init (void) 
 {
+  int level, slot;
+
   pit_configure_channel (0, 2, TIMER_FREQ);
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
-  heap_init (&sleep_thread_heap, cmp_awake_time);
+  for (level = 0; level < WHEEL_LEVELS; level++)
+    for (slot = 0; slot < WHEEL_SLOTS; slot++)
+      list_init (&wheel[level][slot]);
+  heap_init (&hr_sleep_heap, cmp_wake_tsc);
+  spinlock_init (&timer_lock, "timer");
 }
 
-/* Calibrates loops_per_tick, used to implement brief delays. */
+/* Calibrates loops_per_tick, used to implement brief delays, and
+   the TSC, then switches the timer to event mode. */
 void
 timer_calibrate (void) 
 {
   unsigned high_bit, test_bit;
+  int64_t start;
+  uint64_t tsc;
 
   ASSERT (intr_get_level () == INTR_ON);
   printf ("Calibrating timer...  ");
@@ -80,15 +176,42 @@ timer_calibrate (void)
       loops_per_tick |= test_bit;
 
   printf ("%'"PRIu64" loops/s.\n", (uint64_t) loops_per_tick * TIMER_FREQ);
+
+  /* Count TSC cycles from the start of one tick to the start of
+     another TSC_CALIBRATE_TICKS ticks later. */
+  start = ticks;
+  while (ticks == start)
+    barrier ();
+  tsc = tsc_read ();
+  start = ticks;
+  while (ticks - start < TSC_CALIBRATE_TICKS)
+    barrier ();
+  tsc_per_tick = (tsc_read () - tsc) / TSC_CALIBRATE_TICKS;
+  tsc_hz = tsc_per_tick * TIMER_FREQ;
+  tsc_base = tsc - start * tsc_per_tick;
+  max_event_tsc = UINT16_MAX * tsc_hz / PIT_HZ;
+  printf ("TSC: %'"PRIu64" cycles/s.\n", tsc_hz);
+
+  intr_disable ();
+  event_mode = true;
+  arm_event (false);
+  intr_enable ();
 }
 
 /* Returns the number of timer ticks since the OS booted. */
 int64_t
 timer_ticks (void) 
 {
-  enum intr_level old_level = intr_disable ();
-  int64_t t = ticks;
-  intr_set_level (old_level);
+  /* Only the bootstrap processor's timer interrupt updates TICKS,
+     so disabling interrupts here would not keep another CPU from
+     seeing it half-updated.  Read it until two reads agree. */
+  int64_t t;
+  do
+    {
+      t = ticks;
+      barrier ();
+    }
+  while (t != ticks);
   return t;
 }
 
@@ -100,38 +223,228 @@ timer_elapsed (int64_t then)
   return timer_ticks () - then;
 }
 
+/* Returns the number of nanoseconds since the OS booted, from
+   the TSC.  Unlike timer_ticks(), this never stands still
+   between ticks.  Before timer_calibrate(), returns the start of
+   the current tick. */
+int64_t
+timer_ns (void)
+{
+  if (tsc_hz == 0)
+    return timer_ticks () * (NS_PER_SEC / TIMER_FREQ);
+  return timer_tsc_to_ns (tsc_read ());
+}
+
+/* Returns TSC value TSC as nanoseconds since the OS booted.
+   Returns 0 before timer_calibrate(). */
+int64_t
+timer_tsc_to_ns (uint64_t tsc)
+{
+  return tsc > tsc_base ? timer_cycles_to_ns (tsc - tsc_base) : 0;
+}
+
+/* Returns CYCLES TSC cycles in nanoseconds.  Returns 0 before
+   timer_calibrate(). */
+int64_t
+timer_cycles_to_ns (uint64_t cycles)
+{
+  if (tsc_hz == 0)
+    return 0;
+
+  /* Split CYCLES to keep the multiplication from overflowing. */
+  return (cycles / tsc_hz * NS_PER_SEC
+          + cycles % tsc_hz * NS_PER_SEC / tsc_hz);
+}
+
+/* Initializes TIMER to call FUNC, which may use AUX, once it is
+   added and becomes due. */
+void
+timer_setup (struct timer *timer, timer_func *func, void *aux)
+{
+  ASSERT (timer != NULL);
+  ASSERT (func != NULL);
+
+  timer->func = func;
+  timer->aux = aux;
+  timer->pending = false;
+}
+
+/* Adds TIMER, which must have been initialized with
+   timer_setup() and must not be pending, so that its function
+   runs from the timer interrupt at tick EXPIRES, or at the next
+   tick if EXPIRES has passed.  Interrupts may be on or off. */
+void
+timer_add (struct timer *timer, int64_t expires)
+{
+  enum intr_level old_level = spinlock_acquire_irqsave (&timer_lock);
+
+  ASSERT (!timer->pending);
+
+  timer->expires = expires;
+  wheel_insert (timer);
+  spinlock_release_irqrestore (&timer_lock, old_level);
+}
+
+/* Cancels TIMER.  Returns true if it was pending, false if it
+   was never added, has already run, or is running now on
+   another CPU; the caller must take care of the latter case
+   itself if it matters. */
+bool
+timer_cancel (struct timer *timer)
+{
+  enum intr_level old_level = spinlock_acquire_irqsave (&timer_lock);
+  bool pending = timer->pending;
+
+  if (pending)
+    {
+      list_remove (&timer->elem);
+      timer->pending = false;
+    }
+  spinlock_release_irqrestore (&timer_lock, old_level);
+  return pending;
+}
+
+/* Timer function for timer_sleep(): wakes up the thread in
+   TIMER's auxiliary data. */
+static void
+wake_sleeper (struct timer *timer)
+{
+  struct thread *t = timer->aux;
+
+  thread_unblock (t);
+  thread_preempt ();
+}
+
 /* Sleeps for approximately TICKS timer ticks.  Interrupts must
    be turned on. */
 void
 timer_sleep (int64_t ticks) 
 {
+  enum intr_level old_level;
+  struct thread *t = thread_current ();
+
   if (ticks < 0)
     return;
 
-  enum intr_level old_level = intr_disable ();
-  struct thread *t = thread_current ();
-  t->wake_time = timer_ticks () + ticks;
-  heap_push (&sleep_thread_heap, t);
-  thread_block ();
+  /* The timer can't run until we release timer_lock, by which
+     time we are blocked. */
+  timer_setup (&t->sleep_timer, wake_sleeper, t);
+  old_level = spinlock_acquire_irqsave (&timer_lock);
+  t->sleep_timer.expires = timer_ticks () + ticks;
+  wheel_insert (&t->sleep_timer);
+  thread_block_and_release (&timer_lock);
   intr_set_level (old_level);
 }
 
-/* Put threads that have waited for enough amount of time
-   to ready list. */
+/* Sleeps for approximately NS nanoseconds, blocking rather than
+   spinning however short NS is, and waking up at the requested
+   time rather than at a timer tick.  Interrupts must be turned
+   on. */
 void
-timer_wake (int64_t cur_time)
+timer_sleep_ns (int64_t ns)
 {
-  while (!heap_empty (&sleep_thread_heap))
-  {
-    struct thread *top = (struct thread *)
-                          heap_top (&sleep_thread_heap);
-    if (top->wake_time > cur_time)
-      break;
-    heap_pop (&sleep_thread_heap);
-    thread_unblock (top);
-    if (top->priority > thread_current()->priority)
-      intr_yield_on_return ();
-  }
+  enum intr_level old_level;
+  struct thread *t;
+
+  ASSERT (intr_get_level () == INTR_ON);
+
+  if (ns <= 0)
+    return;
+  if (!event_mode)
+    {
+      timer_sleep (DIV_ROUND_UP (ns, NS_PER_SEC / TIMER_FREQ));
+      return;
+    }
+
+  old_level = spinlock_acquire_irqsave (&timer_lock);
+  t = thread_current ();
+  t->wake_tsc = tsc_read () + ns_to_tsc (ns);
+  if (!heap_push (&hr_sleep_heap, &t->sleep_elem))
+    PANIC ("timer_sleep_ns: out of memory for sleep queue");
+
+  /* If the timer is armed for later than we are due, rearm it
+     ourselves on the bootstrap processor, or ask that CPU to. */
+  if (heap_top (&hr_sleep_heap) == &t->sleep_elem && t->wake_tsc < event_tsc)
+    {
+      if (cpu_current () == cpu_bsp ())
+        program_event (false);
+      else
+        {
+          rearm = true;
+          lapic_send_ipi (cpu_bsp ()->lapic_id, LAPIC_VEC_RESCHED);
+        }
+    }
+
+  thread_block_and_release (&timer_lock);
+  intr_set_level (old_level);
+}
+
+/* Waits for an interrupt on behalf of the running CPU's idle
+   thread.  Must be called with interrupts off; returns with
+   interrupts on, after an interrupt has been handled.  Stops the
+   running CPU's periodic timer interrupt in the meantime, as far
+   as it can.  See "Event-driven timer" above. */
+void
+timer_idle (void)
+{
+  struct cpu *c = cpu_current ();
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (c == cpu_bsp ())
+    {
+      if (event_mode)
+        {
+          arm_event (true);
+          c->tickless = true;
+        }
+    }
+  else if (!c->tickless)
+    {
+      lapic_timer_oneshot (IDLE_BALANCE_TICKS);
+      c->tickless = true;
+    }
+
+  /* Re-enable interrupts and wait for the next one.
+
+     The `sti' instruction disables interrupts until the
+     completion of the next instruction, so these two
+     instructions are executed atomically.  This atomicity is
+     important; otherwise, an interrupt could be handled
+     between re-enabling interrupts and waiting for the next
+     one to occur, wasting as much as one clock tick worth of
+     time.
+
+     See [IA32-v2a] "HLT", [IA32-v2b] "STI", and [IA32-v3a]
+     7.11.1 "HLT Instruction". */
+  asm volatile ("sti; hlt" : : : "memory");
+}
+
+/* Called at the start of every external interrupt, before its
+   handler runs.  If the running CPU stopped its periodic timer
+   in timer_idle(), accounts for the ticks it slept through and
+   restarts the timer.  On the bootstrap processor, also rearms
+   the timer if another CPU asked. */
+void
+timer_intr_enter (void)
+{
+  struct cpu *c = cpu_current ();
+  bool idle = c->tickless;
+
+  if (c == cpu_bsp ())
+    {
+      if (idle || rearm)
+        {
+          c->tickless = rearm = false;
+          advance_ticks (idle);
+          arm_event (false);
+        }
+    }
+  else if (idle)
+    {
+      c->tickless = false;
+      ap_catch_up ();
+    }
 }
 
 /* Sleeps for approximately MS milliseconds.  Interrupts must be
@@ -208,9 +521,247 @@ timer_print_stats (void)
 static void
 timer_interrupt (struct intr_frame *args UNUSED)
 {
-  ticks++;
-  timer_wake (ticks);
-  thread_tick ();
+  if (!event_mode)
+    {
+      ticks++;
+      run_timers (ticks);
+      thread_tick ();
+      return;
+    }
+
+  advance_ticks (false);
+  arm_event (false);
+}
+
+/* Returns NS nanoseconds in TSC cycles. */
+static uint64_t
+ns_to_tsc (int64_t ns)
+{
+  return ns / NS_PER_SEC * tsc_hz + ns % NS_PER_SEC * tsc_hz / NS_PER_SEC;
+}
+
+/* Wakes the threads in timer_sleep_ns() that are due, then
+   brings `ticks' up to date from the TSC.  If a new tick has
+   begun, runs the per-tick work for it.  Any ticks in between
+   were slept through: if IDLE, the idle thread gets the credit,
+   otherwise they were lost to interrupts being off too long.
+   thread_tick() still begins an MLFQS epoch for each second
+   that they crossed.  Runs on the bootstrap processor, in event
+   mode, with interrupts off. */
+static void
+advance_ticks (bool idle)
+{
+  uint64_t now = tsc_read ();
+  int64_t now_ticks = (now - tsc_base) / tsc_per_tick;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  hr_wake (now);
+  if (now_ticks > ticks)
+    {
+      if (idle)
+        thread_tick_idle (now_ticks - ticks - 1);
+      ticks = now_ticks;
+      run_timers (ticks);
+      thread_tick ();
+    }
+}
+
+/* Arms the 8254 to interrupt at the next event: the start of the
+   next tick or, if IDLE, of the next tick on which something is
+   due; or the earliest wake time in timer_sleep_ns(), if that
+   comes first.  Runs on the bootstrap processor, in event mode,
+   with interrupts off. */
+static void
+arm_event (bool idle)
+{
+  spinlock_acquire (&timer_lock);
+  program_event (idle);
+  spinlock_release (&timer_lock);
+}
+
+/* Does the work of arm_event(), with timer_lock already held. */
+static void
+program_event (bool idle)
+{
+  int64_t deadline = ticks + 1;
+  uint64_t now, when, count;
+
+  ASSERT (event_mode);
+  ASSERT (spinlock_held_by_current_cpu (&timer_lock));
+
+  if (idle)
+    {
+      deadline = wheel_next_expiry ();
+
+      /* The MLFQS updates the load average on tick numbers that
+         are multiples of TIMER_FREQ. */
+      if (thread_mlfqs)
+        {
+          int64_t second = ROUND_UP (ticks + 1, TIMER_FREQ);
+          if (second < deadline)
+            deadline = second;
+        }
+      if (deadline <= ticks)
+        deadline = ticks + 1;
+    }
+
+  /* Work out the end time, limited by the 16-bit counter.  A
+     DEADLINE beyond that limit might overflow when converted. */
+  now = tsc_read ();
+  when = now + max_event_tsc;
+  if (deadline - ticks <= (int64_t) (max_event_tsc / tsc_per_tick) + 1)
+    {
+      uint64_t tick_start = tsc_base + deadline * tsc_per_tick;
+      if (tick_start < when)
+        when = tick_start;
+    }
+  if (!heap_empty (&hr_sleep_heap))
+    {
+      uint64_t hr = heap_entry (heap_top (&hr_sleep_heap),
+                                struct thread, sleep_elem)->wake_tsc;
+      if (hr < when)
+        when = hr;
+    }
+
+  /* Round up, so that we don't wake up just short of WHEN. */
+  count = when > now ? DIV_ROUND_UP ((when - now) * PIT_HZ, tsc_hz) : 1;
+  if (count > UINT16_MAX)
+    count = UINT16_MAX;
+  pit_start_oneshot (count);
+  event_tsc = when;
+}
+
+/* Wakes the threads in timer_sleep_ns() whose wake time is at or
+   before NOW. */
+static void
+hr_wake (uint64_t now)
+{
+  spinlock_acquire (&timer_lock);
+  while (!heap_empty (&hr_sleep_heap))
+    {
+      struct thread *top = heap_entry (heap_top (&hr_sleep_heap),
+                                       struct thread, sleep_elem);
+      if (top->wake_tsc > now)
+        break;
+      heap_pop (&hr_sleep_heap);
+      thread_unblock (top);
+      thread_preempt ();
+    }
+  spinlock_release (&timer_lock);
+}
+
+/* Runs the kernel timers due up to tick NOW, in order.  Runs on
+   the bootstrap processor with interrupts off. */
+static void
+run_timers (int64_t now)
+{
+  spinlock_acquire (&timer_lock);
+  while (wheel_ticks <= now)
+    {
+      struct list due;
+      int level;
+
+      /* Cascade each level whose lower levels wrapped around. */
+      for (level = 1; level < WHEEL_LEVELS; level++)
+        {
+          struct list *slot;
+
+          if ((wheel_ticks & (((int64_t) 1 << (WHEEL_BITS * level)) - 1)) != 0)
+            break;
+          slot = &wheel[level][(wheel_ticks >> (WHEEL_BITS * level))
+                               & WHEEL_MASK];
+          while (!list_empty (slot))
+            wheel_insert (list_entry (list_pop_front (slot),
+                                      struct timer, elem));
+        }
+
+      /* Take this tick's timers, so that timers added from here
+         on go into later slots. */
+      list_init (&due);
+      list_splice (list_end (&due),
+                   list_begin (&wheel[0][wheel_ticks & WHEEL_MASK]),
+                   list_end (&wheel[0][wheel_ticks & WHEEL_MASK]));
+      wheel_ticks++;
+
+      /* Run them without timer_lock, so that they may add or
+         cancel timers. */
+      while (!list_empty (&due))
+        {
+          struct timer *timer = list_entry (list_pop_front (&due),
+                                            struct timer, elem);
+          timer->pending = false;
+          spinlock_release (&timer_lock);
+          timer->func (timer);
+          spinlock_acquire (&timer_lock);
+        }
+    }
+  spinlock_release (&timer_lock);
+}
+
+/* Puts TIMER into the wheel slot for its expiry time and marks it
+   pending.  If the bootstrap processor sleeps through that tick,
+   wakes it up.  timer_lock must be held. */
+static void
+wheel_insert (struct timer *timer)
+{
+  int64_t expires = timer->expires;
+  int64_t delta = expires - wheel_ticks;
+  int level;
+
+  ASSERT (spinlock_held_by_current_cpu (&timer_lock));
+
+  if (delta < 0)
+    {
+      expires = wheel_ticks;
+      delta = 0;
+    }
+  else if (delta >= WHEEL_SPAN)
+    {
+      expires = wheel_ticks + WHEEL_SPAN - 1;
+      delta = WHEEL_SPAN - 1;
+    }
+  for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    if (delta < (int64_t) 1 << (WHEEL_BITS * (level + 1)))
+      break;
+  list_push_back (&wheel[level][(expires >> (WHEEL_BITS * level))
+                                & WHEEL_MASK],
+                  &timer->elem);
+  timer->pending = true;
+
+  /* The bootstrap processor arms its timer while holding
+     timer_lock, so it either saw TIMER or has already armed it. */
+  if (cpu_bsp ()->tickless && cpu_current () != cpu_bsp ()
+      && expires < (int64_t) ((event_tsc - tsc_base) / tsc_per_tick))
+    lapic_send_ipi (cpu_bsp ()->lapic_id, LAPIC_VEC_RESCHED);
+}
+
+/* Returns the next tick on which a kernel timer may be due.  This
+   is exact for the timers in level 0, but the next cascade is
+   also counted, because it may move timers into level 0.
+   timer_lock must be held. */
+static int64_t
+wheel_next_expiry (void)
+{
+  int64_t t;
+
+  for (t = wheel_ticks; ; t++)
+    if (!list_empty (&wheel[0][t & WHEEL_MASK]) || (t & WHEEL_MASK) == 0)
+      return t;
+}
+
+/* Accounts for the ticks that an application processor's idle
+   thread slept through and restarts its periodic timer. */
+static void
+ap_catch_up (void)
+{
+  /* If the one-shot expired, its last tick is the one being
+     delivered now, which thread_tick() will count. */
+  unsigned elapsed = lapic_timer_elapsed ();
+  if (elapsed >= IDLE_BALANCE_TICKS)
+    elapsed = IDLE_BALANCE_TICKS - 1;
+  thread_tick_idle (elapsed);
+  lapic_timer_start ();
 }
 
 /* Returns true if LOOPS iterations waits for more than one timer
@@ -266,10 +817,16 @@ real_time_sleep (int64_t num, int32_t denom)
          processes. */                
       timer_sleep (ticks); 
     }
+  else if (event_mode)
+    {
+      /* Otherwise, block until the exact time.  The timer
+         interrupts when we are due, not just at the next tick. */
+      timer_sleep_ns (num * (NS_PER_SEC / denom));
+    }
   else 
     {
-      /* Otherwise, use a busy-wait loop for more accurate
-         sub-tick timing. */
+      /* Before the TSC is calibrated, use a busy-wait loop for
+         more accurate sub-tick timing. */
       real_time_delay (num, denom); 
     }
 }
@@ -1,25 +1,53 @@
 #ifndef DEVICES_TIMER_H
 #define DEVICES_TIMER_H
 
-#include <heap.h>
+#include <list.h>
 #include <round.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 /* Number of timer interrupts per second. */
 #define TIMER_FREQ 100
 
+/* A kernel timer, which calls a function from the timer
+   interrupt once timer_ticks() reaches a given tick.  The
+   function must not sleep.  See "Timer wheel" in timer.c. */
+struct timer;
+typedef void timer_func (struct timer *);
+
+struct timer
+  {
+    struct list_elem elem;      /* Element in a timer wheel slot. */
+    int64_t expires;            /* Tick to run at. */
+    timer_func *func;           /* Function to call. */
+    void *aux;                  /* Auxiliary data for FUNC. */
+    bool pending;               /* Added and not yet run or cancelled? */
+  };
+
 void timer_init (void);
 void timer_calibrate (void);
 
 int64_t timer_ticks (void);
 int64_t timer_elapsed (int64_t);
+int64_t timer_ns (void);
+int64_t timer_tsc_to_ns (uint64_t tsc);
+int64_t timer_cycles_to_ns (uint64_t cycles);
+
+/* Kernel timers. */
+void timer_setup (struct timer *, timer_func *, void *aux);
+void timer_add (struct timer *, int64_t expires);
+bool timer_cancel (struct timer *);
 
 /* Sleep and yield the CPU to other threads. */
 void timer_sleep (int64_t ticks);
-void timer_wake (int64_t cur_time);
 void timer_msleep (int64_t milliseconds);
 void timer_usleep (int64_t microseconds);
 void timer_nsleep (int64_t nanoseconds);
+void timer_sleep_ns (int64_t nanoseconds);
+
+/* Tickless idle. */
+void timer_idle (void);
+void timer_intr_enter (void);
 
 /* Busy waits. */
 void timer_mdelay (int64_t milliseconds);
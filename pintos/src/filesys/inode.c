@@ -6,6 +6,8 @@
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/slab.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
@@ -33,7 +35,7 @@ struct inode
   {
     struct list_elem elem;              /* Element in inode list. */
     block_sector_t sector;              /* Sector number of disk location. */
-    int open_cnt;                       /* Number of openers. */
+    int open_cnt;                       /* Number of openers (atomic). */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct inode_disk data;             /* Inode content. */
@@ -57,11 +59,44 @@ byte_to_sector (const struct inode *inode, off_t pos)
    returns the same `struct inode'. */
 static struct list open_inodes;
 
+/* Protects open_inodes.  Looking up an inode that is already
+   open, the common case, only reads the list, so any number of
+   threads can do it at once.  Adding or removing an inode takes
+   the lock for writing. */
+static struct rwlock open_inodes_lock;
+
+/* Cache of `struct inode's, which are too big for malloc() to
+   hold without wasting almost half of each block. */
+static struct kmem_cache *inode_cache;
+
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
+  inode_cache = kmem_cache_create ("inode", sizeof (struct inode), 0, NULL);
+  if (inode_cache == NULL)
+    PANIC ("inode cache creation failed");
   list_init (&open_inodes);
+  rwlock_init (&open_inodes_lock);
+  lock_profile (&open_inodes_lock.lock, "open_inodes");
+}
+
+/* Returns the inode for SECTOR in open_inodes, reopened, or a
+   null pointer if SECTOR is not open.  The caller must hold
+   open_inodes_lock. */
+static struct inode *
+lookup_open_inode (block_sector_t sector)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
+       e = list_next (e)) 
+    {
+      struct inode *inode = list_entry (e, struct inode, elem);
+      if (inode->sector == sector) 
+        return inode_reopen (inode);
+    }
+  return NULL;
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -111,42 +146,55 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
   struct inode *inode;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  rwlock_acquire_read (&open_inodes_lock);
+  inode = lookup_open_inode (sector);
+  rwlock_release_read (&open_inodes_lock);
+  if (inode != NULL)
+    return inode;
+
+  /* Check again, since another thread may have opened it
+     between our releasing the read lock and taking the write
+     lock. */
+  rwlock_acquire_write (&open_inodes_lock);
+  inode = lookup_open_inode (sector);
+  if (inode != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
+      rwlock_release_write (&open_inodes_lock);
+      return inode;
     }
 
   /* Allocate memory. */
-  inode = malloc (sizeof *inode);
+  inode = kmem_cache_alloc (inode_cache);
   if (inode == NULL)
-    return NULL;
+    {
+      rwlock_release_write (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize.  The inode is read before it is made visible to
+     other openers. */
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
   block_read (fs_device, inode->sector, &inode->data);
+  list_push_front (&open_inodes, &inode->elem);
+  rwlock_release_write (&open_inodes_lock);
   return inode;
 }
 
-/* Reopens and returns INODE. */
+/* Reopens and returns INODE.
+
+   Readers of open_inodes reopen inodes concurrently, so the
+   count is incremented atomically. */
 struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    asm volatile ("lock incl %0" : "+m" (inode->open_cnt) : : "memory");
   return inode;
 }
 
@@ -163,16 +211,41 @@ inode_get_inumber (const struct inode *inode)
 void
 inode_close (struct inode *inode) 
 {
+  int cnt;
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
+  /* Drop a reference that is not the last without taking
+     open_inodes_lock. */
+  for (cnt = inode->open_cnt; cnt > 1; )
+    {
+      int prev;
+      asm volatile ("lock cmpxchgl %2, %1"
+                    : "=a" (prev), "+m" (inode->open_cnt)
+                    : "r" (cnt - 1), "0" (cnt)
+                    : "memory");
+      if (prev == cnt)
+        return;
+      cnt = prev;
+    }
+
+  /* This may be the last reference.  Holding open_inodes_lock for
+     writing keeps inode_open() from finding INODE once its count
+     drops to zero, but other holders may still reopen or close it,
+     so the count is checked again as it is decremented. */
+  rwlock_acquire_write (&open_inodes_lock);
+  asm volatile ("lock decl %0; setz %1"
+                : "+m" (inode->open_cnt), "=q" (last) : : "memory");
+  if (last)
+    list_remove (&inode->elem);
+  rwlock_release_write (&open_inodes_lock);
+
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
       /* Deallocate blocks if removed. */
       if (inode->removed) 
         {
@@ -181,7 +254,7 @@ inode_close (struct inode *inode)
                             bytes_to_sectors (inode->data.length)); 
         }
 
-      free (inode); 
+      kmem_cache_free (inode_cache, inode);
     }
 }
 
@@ -231,7 +304,7 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
              into caller's buffer. */
           if (bounce == NULL) 
             {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
+              bounce = malloc_tagged (BLOCK_SECTOR_SIZE, "bounce buffers");
               if (bounce == NULL)
                 break;
             }
@@ -291,7 +364,7 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
           /* We need a bounce buffer. */
           if (bounce == NULL) 
             {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
+              bounce = malloc_tagged (BLOCK_SECTOR_SIZE, "bounce buffers");
               if (bounce == NULL)
                 break;
             }
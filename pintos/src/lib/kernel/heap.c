@@ -1,23 +1,52 @@
 #include "heap.h"
 #include "../debug.h"
 #include <stdio.h>
+#include <string.h>
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+static bool grow (struct heap *);
+static void up_heap (struct heap *, size_t);
+static void down_heap (struct heap *, size_t);
+
+/* Stores ELEM at position INDEX of HEAP and records the
+   position in ELEM. */
+static inline void
+place (struct heap *heap, size_t index, struct heap_elem *elem)
+{
+  heap->elems[index] = elem;
+  elem->index = index;
+}
 
 static void
-swap (heap_elem *a, heap_elem *b)
+swap (struct heap *heap, size_t a, size_t b)
 {
-  heap_elem t = *a;
-  *a = *b;
-  *b = t;
+  struct heap_elem *t = heap->elems[a];
+  place (heap, a, heap->elems[b]);
+  place (heap, b, t);
 }
 
-/* Initializes HEAP as an empty heap. */
-void 
+/* Initializes HEAP as an empty heap.  No memory is allocated
+   until the first element is pushed. */
+void
 heap_init (struct heap *heap, heap_less_func *less)
 {
   ASSERT (heap != NULL);
   heap->size = 0;
+  heap->capacity = 0;
+  heap->page_cnt = 0;
+  heap->elems = NULL;
   heap->less = less;
-  heap->push_cnt = 0;
+}
+
+/* Frees the memory backing HEAP.  The elements themselves are
+   not touched, since the heap does not own them. */
+void
+heap_destroy (struct heap *heap)
+{
+  ASSERT (heap != NULL);
+  palloc_free_multiple (heap->elems, heap->page_cnt);
+  heap_init (heap, heap->less);
 }
 
 /* Rebuild heap */
@@ -29,32 +58,70 @@ heap_rebuild (struct heap *heap)
     down_heap (heap, i);
 }
 
-heap_elem
+struct heap_elem *
 heap_top (struct heap *heap)
 {
   ASSERT (heap != NULL && !heap_empty(heap));
   return heap->elems[1];
 }
 
-/* Push elem into heap. */
-void heap_push (struct heap *heap, heap_elem elem)
+/* Returns true if ELEM is currently in a heap.  ELEM must have
+   been zero-initialized before its first use. */
+bool
+heap_contains (const struct heap_elem *elem)
 {
-  ASSERT (heap->size + 1 <= MAX_HEAP_SIZE);
-  heap->elems[++heap->size] = elem;
+  return elem->index != 0;
+}
+
+/* Push elem into heap.  Returns false, leaving HEAP unchanged,
+   if HEAP is full and no memory is available to grow it. */
+bool
+heap_push (struct heap *heap, struct heap_elem *elem)
+{
+  ASSERT (!heap_contains (elem));
+  if (heap->size == heap->capacity && !grow (heap))
+    return false;
+  place (heap, ++heap->size, elem);
   up_heap (heap, heap->size);
+  return true;
 }
 
 /* Pop top element from heap. */
-heap_elem
-heap_pop (struct heap* heap) {
-  ASSERT (!heap_empty(heap));
-  heap_elem top = heap_top (heap);
+struct heap_elem *
+heap_pop (struct heap *heap)
+{
+  ASSERT (!heap_empty (heap));
+  struct heap_elem *top = heap_top (heap);
+  heap_remove (heap, top);
+  return top;
+}
 
-  swap (&heap->elems[1], &heap->elems[heap->size]);
+/* Removes ELEM, which must be in HEAP. */
+void
+heap_remove (struct heap *heap, struct heap_elem *elem)
+{
+  size_t index = elem->index;
+
+  ASSERT (index >= 1 && index <= heap->size);
+  ASSERT (heap->elems[index] == elem);
+
+  swap (heap, index, heap->size);
   heap->size--;
-  down_heap (heap, (size_t)1);
+  elem->index = 0;
+  if (index <= heap->size)
+    heap_update (heap, heap->elems[index]);
+}
 
-  return top;
+/* Restores the heap property after the key of ELEM, which must
+   be in HEAP, was increased or decreased. */
+void
+heap_update (struct heap *heap, struct heap_elem *elem)
+{
+  ASSERT (elem->index >= 1 && elem->index <= heap->size);
+  ASSERT (heap->elems[elem->index] == elem);
+
+  up_heap (heap, elem->index);
+  down_heap (heap, elem->index);
 }
 
 size_t
@@ -69,37 +136,54 @@ heap_empty (struct heap *heap)
   return heap->size == 0;
 }
 
-int64_t
-heap_entry_count (struct heap *heap)
+/* Doubles the number of pages backing HEAP, copying over the
+   current elements.  Returns false if out of memory. */
+static bool
+grow (struct heap *heap)
 {
-  return heap->push_cnt++;
+  size_t page_cnt = heap->page_cnt == 0 ? 1 : heap->page_cnt * 2;
+  struct heap_elem **elems = palloc_get_multiple (0, page_cnt);
+  if (elems == NULL)
+    return false;
+
+  if (heap->elems != NULL)
+    {
+      memcpy (elems, heap->elems, (heap->size + 1) * sizeof *elems);
+      palloc_free_multiple (heap->elems, heap->page_cnt);
+    }
+  heap->elems = elems;
+  heap->page_cnt = page_cnt;
+
+  /* Slot 0 is unused so that the children of I are 2I and 2I+1. */
+  heap->capacity = page_cnt * PGSIZE / sizeof *elems - 1;
+  return true;
 }
 
 /* up_heap, down_heap
    Auxiliary functions restoring the heap property
 */
-void
+static void
 up_heap (struct heap *heap, size_t index)
 {
   for (; index > 1; index >>= 1)
     {
       if (heap->less(heap->elems[index >> 1], heap->elems[index]))
-        swap (&heap->elems[index >> 1], &heap->elems[index]);
+        swap (heap, index >> 1, index);
       else
         break;
     }
 }
 
-void
+static void
 down_heap (struct heap *heap, size_t index)
 {
   for (size_t ch; (index << 1) <= heap->size; index = ch)
     {
       ch = index << 1;
-      ch += (ch < heap->size && heap->less(heap->elems[ch], 
+      ch += (ch < heap->size && heap->less(heap->elems[ch],
                                            heap->elems[ch | 1]));
       if (heap->less(heap->elems[index], heap->elems[ch]))
-        swap (&heap->elems[index], &heap->elems[ch]);
+        swap (heap, index, ch);
       else
         break;
     }
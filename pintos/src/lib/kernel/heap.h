@@ -5,55 +5,73 @@
    Max heap implemented as binary heap.
    Used in alarm clock and priority scheduling.
    Basically imitating struct list.
+
+   Like struct list, the heap does not own its elements: each
+   structure that can be in a heap embeds a struct heap_elem,
+   and heap_entry() converts back to the enclosing structure.
+   The heap_elem remembers its position in the heap, so an
+   element whose key changed can be moved with heap_update(),
+   and an arbitrary element can be taken out with heap_remove(),
+   both in O(log n).
+
+   The array of element pointers lives in pages obtained from
+   the page allocator and doubles in size when it fills up, so
+   there is no fixed limit on the number of elements.  Because
+   growing may allocate, heap_push() must not be called from an
+   interrupt handler.
 */
 
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-/* Maximum heap size 
-   The document does not mention whether there is an upper 
-   limit on the total number of threads. So maybe 2048 is
-   too much.
-*/
-#define MAX_HEAP_SIZE 2048
+/* Heap element. */
+struct heap_elem
+  {
+    size_t index;               /* Position in heap, 0 if not in a heap. */
+  };
 
-typedef void *heap_elem;
+/* Converts pointer to heap element HEAP_ELEM into a pointer to
+   the structure that HEAP_ELEM is embedded inside.  Supply the
+   name of the outer structure STRUCT and the member name MEMBER
+   of the heap element. */
+#define heap_entry(HEAP_ELEM, STRUCT, MEMBER)           \
+        ((STRUCT *) ((uint8_t *) &(HEAP_ELEM)->index    \
+                     - offsetof (STRUCT, MEMBER.index)))
 
 /* Compares the value of two heap elements A and B
    Returns true if A is less than B, or
    false if A is greater than or equal to B. */
-typedef bool heap_less_func (const heap_elem a,
-                             const heap_elem b);
+typedef bool heap_less_func (const struct heap_elem *a,
+                             const struct heap_elem *b);
 
 /* Heap. */
-
 struct heap
   {
     size_t size;                     /* Heap size. */
-    heap_elem elems[MAX_HEAP_SIZE];  /* Heap elements. */
+    size_t capacity;                 /* Usable slots in `elems'. */
+    size_t page_cnt;                 /* Pages backing `elems'. */
+    struct heap_elem **elems;        /* Heap elements, 1-based. */
     heap_less_func *less;            /* Heap compare function. */
-    int64_t push_cnt;                /* counter of element pushed. */
   };
 
 /* Heap initialization. */
 void heap_init (struct heap *, heap_less_func *);
+void heap_destroy (struct heap *);
 void heap_rebuild (struct heap *);
 
 /* Heap elements. */
-heap_elem heap_top (struct heap *);
+struct heap_elem *heap_top (struct heap *);
+bool heap_contains (const struct heap_elem *);
 
 /* Heap push & pop. */
-void heap_push (struct heap *, heap_elem);
-heap_elem heap_pop (struct heap *);
+bool heap_push (struct heap *, struct heap_elem *);
+struct heap_elem *heap_pop (struct heap *);
+void heap_remove (struct heap *, struct heap_elem *);
+void heap_update (struct heap *, struct heap_elem *);
 
 /* Heap properties. */
 size_t heap_size (struct heap *);
 bool heap_empty (struct heap *);
-int64_t heap_entry_count (struct heap *);
-
-/* Auxiliary functions */
-void up_heap (struct heap *, size_t);
-void down_heap (struct heap *, size_t);
 
 #endif
@@ -0,0 +1,166 @@
+#include "pheap.h"
+#include "../debug.h"
+
+static struct pheap_elem *meld (struct pheap *,
+                                struct pheap_elem *, struct pheap_elem *);
+static struct pheap_elem *merge_pairs (struct pheap *, struct pheap_elem *);
+
+/* Initializes HEAP as an empty pairing heap ordered by LESS. */
+void
+pheap_init (struct pheap *heap, pheap_less_func *less)
+{
+  ASSERT (heap != NULL);
+  ASSERT (less != NULL);
+
+  heap->root = NULL;
+  heap->size = 0;
+  heap->less = less;
+}
+
+/* Returns the greatest element in HEAP, which must not be
+   empty. */
+struct pheap_elem *
+pheap_top (struct pheap *heap)
+{
+  ASSERT (!pheap_empty (heap));
+  return heap->root;
+}
+
+/* Inserts ELEM, which must not be in any heap, into HEAP. */
+void
+pheap_push (struct pheap *heap, struct pheap_elem *elem)
+{
+  ASSERT (heap != NULL);
+  ASSERT (elem != NULL);
+
+  elem->child = elem->next = elem->prev = NULL;
+  heap->root = meld (heap, heap->root, elem);
+  heap->size++;
+}
+
+/* Removes and returns the greatest element in HEAP, which must
+   not be empty. */
+struct pheap_elem *
+pheap_pop (struct pheap *heap)
+{
+  struct pheap_elem *top = pheap_top (heap);
+
+  heap->root = merge_pairs (heap, top->child);
+  heap->size--;
+  return top;
+}
+
+/* Removes ELEM, which must be in HEAP. */
+void
+pheap_remove (struct pheap *heap, struct pheap_elem *elem)
+{
+  ASSERT (heap != NULL);
+  ASSERT (elem != NULL);
+
+  if (elem == heap->root)
+    {
+      pheap_pop (heap);
+      return;
+    }
+
+  /* Unlink ELEM and its subtree from its siblings, then meld
+     its children back in. */
+  ASSERT (elem->prev != NULL);
+  if (elem->prev->child == elem)
+    elem->prev->child = elem->next;
+  else
+    elem->prev->next = elem->next;
+  if (elem->next != NULL)
+    elem->next->prev = elem->prev;
+  heap->root = meld (heap, heap->root, merge_pairs (heap, elem->child));
+  heap->size--;
+}
+
+/* Restores the heap property after the key of ELEM, which must
+   be in HEAP, was increased or decreased. */
+void
+pheap_update (struct pheap *heap, struct pheap_elem *elem)
+{
+  pheap_remove (heap, elem);
+  pheap_push (heap, elem);
+}
+
+/* Returns the number of elements in HEAP. */
+size_t
+pheap_size (struct pheap *heap)
+{
+  return heap->size;
+}
+
+/* Returns true if HEAP is empty, false otherwise. */
+bool
+pheap_empty (struct pheap *heap)
+{
+  return heap->root == NULL;
+}
+
+/* Melds A and B, each the root of a heap or null, into a single
+   heap and returns its root.  The lesser root becomes the first
+   child of the other. */
+static struct pheap_elem *
+meld (struct pheap *heap, struct pheap_elem *a, struct pheap_elem *b)
+{
+  struct pheap_elem *t;
+
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+
+  if (heap->less (a, b))
+    {
+      t = a;
+      a = b;
+      b = t;
+    }
+  b->prev = a;
+  b->next = a->child;
+  if (a->child != NULL)
+    a->child->prev = b;
+  a->child = b;
+  a->next = a->prev = NULL;
+  return a;
+}
+
+/* Melds the list of sibling heaps starting at FIRST into a
+   single heap and returns its root, using the standard two-pass
+   method: meld adjacent pairs from left to right, then meld the
+   results from right to left. */
+static struct pheap_elem *
+merge_pairs (struct pheap *heap, struct pheap_elem *first)
+{
+  struct pheap_elem *pairs = NULL;
+  struct pheap_elem *root = NULL;
+
+  /* First pass.  PAIRS collects the melded pairs in reverse
+     order, linked through their `next' members. */
+  while (first != NULL)
+    {
+      struct pheap_elem *a = first;
+      struct pheap_elem *b = a->next;
+
+      first = b != NULL ? b->next : NULL;
+      a->next = a->prev = NULL;
+      if (b != NULL)
+        b->next = b->prev = NULL;
+      a = meld (heap, a, b);
+      a->next = pairs;
+      pairs = a;
+    }
+
+  /* Second pass. */
+  while (pairs != NULL)
+    {
+      struct pheap_elem *next = pairs->next;
+
+      pairs->next = NULL;
+      root = meld (heap, root, pairs);
+      pairs = next;
+    }
+  return root;
+}
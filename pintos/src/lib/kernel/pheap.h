@@ -0,0 +1,71 @@
+#ifndef __LIB_KERNEL_PHEAP_H
+#define __LIB_KERNEL_PHEAP_H
+
+/* Pairing heap.
+
+   A max heap whose elements are linked together through the
+   struct pheap_elem embedded in each of them, like struct list,
+   rather than kept in an array like struct heap.  It therefore
+   never allocates memory, so an empty pairing heap costs only a
+   few words and pushing can never fail, which suits structures
+   such as semaphores that exist in large numbers and have no
+   destructor.
+
+   Finding the top element is O(1), pushing is O(1), and
+   popping, removing an arbitrary element, or repositioning an
+   element whose key changed are O(log n) amortized.  See
+   Fredman, Sedgewick, Sleator, and Tarjan, "The Pairing Heap: A
+   New Form of Self-Adjusting Heap", Algorithmica 1(1), 1986.
+
+   Elements that compare equal come out in no particular order,
+   so users that want FIFO order among equals must break ties
+   themselves, e.g. with a sequence number. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pairing heap element. */
+struct pheap_elem
+  {
+    struct pheap_elem *child;   /* First child. */
+    struct pheap_elem *next;    /* Next sibling. */
+    struct pheap_elem *prev;    /* Previous sibling, or parent if the
+                                   first child, or null if the root. */
+  };
+
+/* Converts pointer to pairing heap element PHEAP_ELEM into a
+   pointer to the structure that PHEAP_ELEM is embedded inside.
+   Supply the name of the outer structure STRUCT and the member
+   name MEMBER of the pairing heap element. */
+#define pheap_entry(PHEAP_ELEM, STRUCT, MEMBER)         \
+        ((STRUCT *) ((uint8_t *) &(PHEAP_ELEM)->child   \
+                     - offsetof (STRUCT, MEMBER.child)))
+
+/* Compares the value of two pairing heap elements A and B.
+   Returns true if A is less than B, or
+   false if A is greater than or equal to B. */
+typedef bool pheap_less_func (const struct pheap_elem *a,
+                              const struct pheap_elem *b);
+
+/* Pairing heap. */
+struct pheap
+  {
+    struct pheap_elem *root;    /* Greatest element, or null. */
+    size_t size;                /* Number of elements. */
+    pheap_less_func *less;      /* Compare function. */
+  };
+
+void pheap_init (struct pheap *, pheap_less_func *);
+
+struct pheap_elem *pheap_top (struct pheap *);
+
+void pheap_push (struct pheap *, struct pheap_elem *);
+struct pheap_elem *pheap_pop (struct pheap *);
+void pheap_remove (struct pheap *, struct pheap_elem *);
+void pheap_update (struct pheap *, struct pheap_elem *);
+
+size_t pheap_size (struct pheap *);
+bool pheap_empty (struct pheap *);
+
+#endif /* lib/kernel/pheap.h */
@@ -0,0 +1,109 @@
+#include "ring.h"
+#include <string.h>
+#include "../debug.h"
+
+/* Compiler optimization barrier. */
+#define barrier() asm volatile ("" : : : "memory")
+
+/* Initializes RING as an empty ring buffer in the SIZE bytes at
+   BUF.  SIZE must be a power of 2. */
+void
+ring_init (struct ring *ring, void *buf, size_t size)
+{
+  ASSERT (ring != NULL);
+  ASSERT (buf != NULL);
+  ASSERT (size > 0 && (size & (size - 1)) == 0);
+
+  ring->buf = buf;
+  ring->size = size;
+  ring->head = ring->tail = 0;
+}
+
+/* Returns the number of bytes in RING.  If called by neither
+   the producer nor the consumer, the answer may be stale. */
+size_t
+ring_count (const struct ring *ring)
+{
+  return ring->head - ring->tail;
+}
+
+/* Returns the number of bytes that may be added to RING. */
+size_t
+ring_space (const struct ring *ring)
+{
+  return ring->size - ring_count (ring);
+}
+
+/* Returns true if RING is empty, false otherwise. */
+bool
+ring_empty (const struct ring *ring)
+{
+  return ring_count (ring) == 0;
+}
+
+/* Returns true if RING is full, false otherwise. */
+bool
+ring_full (const struct ring *ring)
+{
+  return ring_count (ring) == ring->size;
+}
+
+/* Adds up to SIZE bytes from DATA to RING, as many as fit, and
+   returns the number added.  May only be called by RING's
+   producer. */
+size_t
+ring_put (struct ring *ring, const void *data, size_t size)
+{
+  size_t head = ring->head;
+  size_t ofs = head & (ring->size - 1);
+  size_t space = ring->size - (head - ring->tail);
+  size_t chunk;
+
+  if (size > space)
+    size = space;
+
+  /* Don't overwrite the data until we have seen `tail'. */
+  barrier ();
+
+  /* Copy up to the end of the buffer, then wrap around. */
+  chunk = ring->size - ofs;
+  if (chunk > size)
+    chunk = size;
+  memcpy (ring->buf + ofs, data, chunk);
+  memcpy (ring->buf, (const uint8_t *) data + chunk, size - chunk);
+
+  /* Publish the data only after it is written. */
+  barrier ();
+  ring->head = head + size;
+  return size;
+}
+
+/* Removes up to SIZE bytes from RING, as many as it holds, into
+   DATA and returns the number removed.  May only be called by
+   RING's consumer. */
+size_t
+ring_get (struct ring *ring, void *data, size_t size)
+{
+  size_t tail = ring->tail;
+  size_t ofs = tail & (ring->size - 1);
+  size_t count = ring->head - tail;
+  size_t chunk;
+
+  if (size > count)
+    size = count;
+
+  /* Don't read the data until we have seen `head'. */
+  barrier ();
+
+  /* Copy up to the end of the buffer, then wrap around. */
+  chunk = ring->size - ofs;
+  if (chunk > size)
+    chunk = size;
+  memcpy (data, ring->buf + ofs, chunk);
+  memcpy ((uint8_t *) data + chunk, ring->buf, size - chunk);
+
+  /* Free the space only after the data is read. */
+  barrier ();
+  ring->tail = tail + size;
+  return size;
+}
@@ -0,0 +1,49 @@
+#ifndef __LIB_KERNEL_RING_H
+#define __LIB_KERNEL_RING_H
+
+/* Ring buffer.
+
+   A circular buffer of bytes for passing data from one producer
+   to one consumer, which may run concurrently on different CPUs
+   or one of which may be an interrupt handler, without any lock.
+   The producer only ever writes `head', the consumer only ever
+   writes `tail', and each one writes the data before (producer)
+   or reads it before (consumer) publishing its new position.
+   x86 does not reorder a store with older loads or stores (see
+   [IA32-v3a] 8.2 "Memory Ordering"), so a compiler barrier is
+   all the ordering that is needed.
+
+   If there may be more than one producer or more than one
+   consumer, they must be serialized among themselves by some
+   other means, such as a lock.
+
+   The buffer, supplied by the caller, must be a power of two in
+   size.  Positions are kept as free-running counters that are
+   reduced modulo the size only to index the buffer, so all of
+   its bytes are usable and a full ring is distinguishable from
+   an empty one. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Ring buffer. */
+struct ring
+  {
+    uint8_t *buf;               /* Buffer. */
+    size_t size;                /* Buffer size, a power of 2. */
+    volatile size_t head;       /* Bytes ever added; written by producer. */
+    volatile size_t tail;       /* Bytes ever removed; written by consumer. */
+  };
+
+void ring_init (struct ring *, void *buf, size_t size);
+
+size_t ring_count (const struct ring *);
+size_t ring_space (const struct ring *);
+bool ring_empty (const struct ring *);
+bool ring_full (const struct ring *);
+
+size_t ring_put (struct ring *, const void *, size_t);
+size_t ring_get (struct ring *, void *, size_t);
+
+#endif /* lib/kernel/ring.h */
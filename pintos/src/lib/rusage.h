@@ -0,0 +1,17 @@
+#ifndef __LIB_RUSAGE_H
+#define __LIB_RUSAGE_H
+
+/* Resource usage of a thread or process, as returned by the
+   getrusage system call.  Times are in timer ticks. */
+struct rusage
+  {
+    long long ru_utime;         /* Ticks spent in user mode. */
+    long long ru_stime;         /* Ticks spent in kernel mode. */
+    long long ru_nvcsw;         /* Voluntary context switches. */
+    long long ru_nivcsw;        /* Involuntary context switches. */
+    long long ru_faults;        /* Page faults. */
+    long long ru_inblock;       /* Block device sectors read. */
+    long long ru_oublock;       /* Block device sectors written. */
+  };
+
+#endif /* lib/rusage.h */
@@ -28,7 +28,14 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Synchronization. */
+    SYS_FUTEX_WAIT,             /* Sleep if a futex has a given value. */
+    SYS_FUTEX_WAKE,             /* Wake threads sleeping on a futex. */
+
+    /* Accounting. */
+    SYS_GETRUSAGE               /* Obtain resource usage. */
   };
 
 #endif /* lib/syscall-nr.h */
@@ -0,0 +1,70 @@
+#include <mutex.h>
+#include <syscall.h>
+
+/* Atomically sets *P to NEW if it equals OLD, and returns the
+   value that *P had. */
+static inline int
+cmpxchg (int *p, int old, int new)
+{
+  int prev;
+  asm volatile ("lock cmpxchgl %2, %1"
+                : "=a" (prev), "+m" (*p)
+                : "r" (new), "0" (old)
+                : "memory");
+  return prev;
+}
+
+/* Atomically sets *P to NEW and returns the value that *P
+   had. */
+static inline int
+xchg (int *p, int new)
+{
+  asm volatile ("xchgl %0, %1" : "+r" (new), "+m" (*p) : : "memory");
+  return new;
+}
+
+/* Initializes MUTEX as unlocked. */
+void
+mutex_init (struct mutex *mutex)
+{
+  mutex->state = 0;
+}
+
+/* Locks MUTEX, sleeping until it is unlocked if necessary. */
+void
+mutex_lock (struct mutex *mutex)
+{
+  int state = cmpxchg (&mutex->state, 0, 1);
+  if (state == 0)
+    return;
+
+  /* Mark the mutex contended, so that whoever unlocks it wakes us
+     up, then sleep until we are the one that finds it unlocked.
+     A mutex locked this way stays marked contended even if there
+     are no more waiters, which at worst costs its unlocker one
+     needless futex_wake(). */
+  if (state != 2)
+    state = xchg (&mutex->state, 2);
+  while (state != 0)
+    {
+      futex_wait (&mutex->state, 2);
+      state = xchg (&mutex->state, 2);
+    }
+}
+
+/* Tries to lock MUTEX without sleeping.  Returns true if
+   successful, false if it is already locked. */
+bool
+mutex_trylock (struct mutex *mutex)
+{
+  return cmpxchg (&mutex->state, 0, 1) == 0;
+}
+
+/* Unlocks MUTEX, which the caller must have locked, and wakes up
+   one of its waiters, if any. */
+void
+mutex_unlock (struct mutex *mutex)
+{
+  if (xchg (&mutex->state, 0) == 2)
+    futex_wake (&mutex->state, 1);
+}
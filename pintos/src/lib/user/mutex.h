@@ -0,0 +1,29 @@
+#ifndef __LIB_USER_MUTEX_H
+#define __LIB_USER_MUTEX_H
+
+#include <stdbool.h>
+
+/* A mutex built on a futex.
+
+   Locking and unlocking a mutex that no one else wants takes a
+   single atomic instruction and no system call.  Only a thread
+   that finds the mutex locked calls futex_wait() to sleep, and
+   only an unlocker that knows of sleepers calls futex_wake().
+   This is "Mutex, Take 2" from Ulrich Drepper, "Futexes Are
+   Tricky". */
+struct mutex
+  {
+    int state;          /* 0: unlocked, 1: locked,
+                           2: locked, maybe with waiters. */
+  };
+
+/* Initializer for a struct mutex, as an alternative to
+   mutex_init(). */
+#define MUTEX_INITIALIZER { 0 }
+
+void mutex_init (struct mutex *);
+void mutex_lock (struct mutex *);
+bool mutex_trylock (struct mutex *);
+void mutex_unlock (struct mutex *);
+
+#endif /* lib/user/mutex.h */
@@ -0,0 +1,78 @@
+/* Checks that a periodic deadline thread gets the CPU in every
+   period while several CPU-bound threads of the same priority
+   are ready on every CPU, and that admission control refuses a
+   thread that wants a whole CPU.
+
+   Without deadline scheduling, the periodic thread would wait
+   its turn behind the CPU-bound threads, one time slice each,
+   and miss its deadlines. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/smp.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+#define RUNTIME 2               /* Ticks of CPU time per period. */
+#define PERIOD 10               /* Ticks per period. */
+#define PERIODS 20              /* Periods to check. */
+#define HOGS_PER_CPU 4          /* CPU-bound threads per CPU. */
+
+static thread_func hog_thread;
+static volatile bool done;
+static struct semaphore hogs_done;
+
+void
+test_deadline_periodic (void) 
+{
+  int64_t release;
+  unsigned hog_cnt = HOGS_PER_CPU * cpu_cnt;
+  unsigned i;
+  int missed = 0;
+
+  /* This test does not work with the MLFQS. */
+  ASSERT (!thread_mlfqs);
+
+  if (thread_set_deadline (PERIOD, PERIOD))
+    fail ("thread_set_deadline() admitted a whole CPU's bandwidth");
+  msg ("Whole CPU refused.");
+  if (!thread_set_deadline (RUNTIME, PERIOD))
+    fail ("thread_set_deadline() refused %d ticks every %d",
+          RUNTIME, PERIOD);
+  msg ("%d ticks every %d admitted.", RUNTIME, PERIOD);
+
+  done = false;
+  sema_init (&hogs_done, 0);
+  for (i = 0; i < hog_cnt; i++)
+    thread_create ("hog", PRI_DEFAULT, hog_thread, NULL);
+
+  /* Wake up at the start of each period and check that we got
+     the CPU before its end. */
+  release = timer_ticks () + PERIOD;
+  for (i = 0; i < PERIODS; i++)
+    {
+      timer_sleep (release - timer_ticks ());
+      if (timer_ticks () >= release + PERIOD)
+        missed++;
+      release += PERIOD;
+    }
+
+  done = true;
+  thread_set_deadline (0, 0);
+  for (i = 0; i < hog_cnt; i++)
+    sema_down (&hogs_done);
+
+  if (missed > 0)
+    fail ("missed %d of %d deadlines", missed, PERIODS);
+  msg ("Met %d deadlines.", PERIODS);
+}
+
+static void
+hog_thread (void *aux UNUSED) 
+{
+  while (!done)
+    continue;
+  sema_up (&hogs_done);
+}
@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(deadline-periodic) begin
+(deadline-periodic) Whole CPU refused.
+(deadline-periodic) 2 ticks every 10 admitted.
+(deadline-periodic) Met 20 deadlines.
+(deadline-periodic) end
+EOF
+pass;
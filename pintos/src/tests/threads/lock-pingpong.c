@@ -0,0 +1,82 @@
+/* Counts how often the scheduler runs when a lock is taken and
+   released without contention, and when two threads of
+   different priority hand control back and forth through a pair
+   of semaphores.
+
+   Releasing a lock or upping a semaphore should only enter the
+   scheduler if it wakes up a thread that outranks the running
+   thread.  Then the uncontended lock should hardly schedule at
+   all, instead of once per release, and each ping-pong round
+   trip should take two trips through the scheduler, one when
+   the main thread blocks and one when it is woken up, instead
+   of three.  The ping-pong bound only holds on a single CPU,
+   since on more the other thread may run elsewhere. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/smp.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+#define LOCK_ITERS 1000
+#define PINGPONG_ROUNDS 1000
+
+static thread_func pong_thread;
+static struct semaphore ping, pong;
+
+void
+test_lock_pingpong (void) 
+{
+  struct lock lock;
+  long long schedules, switches;
+  int i;
+
+  /* This test does not work with the MLFQS. */
+  ASSERT (!thread_mlfqs);
+
+  lock_init (&lock);
+  schedules = thread_schedule_count ();
+  for (i = 0; i < LOCK_ITERS; i++)
+    {
+      lock_acquire (&lock);
+      lock_release (&lock);
+    }
+  schedules = thread_schedule_count () - schedules;
+  msg ("%d uncontended lock round trips: %lld schedules.",
+       LOCK_ITERS, schedules);
+  if (schedules > LOCK_ITERS / 10)
+    fail ("lock_release() without waiters entered the scheduler "
+          "%lld times", schedules);
+
+  sema_init (&ping, 0);
+  sema_init (&pong, 0);
+  thread_create ("pong", PRI_DEFAULT - 1, pong_thread, NULL);
+  schedules = thread_schedule_count ();
+  switches = thread_switch_count ();
+  for (i = 0; i < PINGPONG_ROUNDS; i++)
+    {
+      sema_up (&ping);
+      sema_down (&pong);
+    }
+  schedules = thread_schedule_count () - schedules;
+  switches = thread_switch_count () - switches;
+  msg ("%d ping-pong round trips: %lld schedules, %lld switches.",
+       PINGPONG_ROUNDS, schedules, switches);
+  if (cpu_cnt == 1 && schedules > 2 * PINGPONG_ROUNDS + PINGPONG_ROUNDS / 10)
+    fail ("ping-pong entered the scheduler %lld times", schedules);
+
+  pass ();
+}
+
+static void
+pong_thread (void *aux UNUSED) 
+{
+  int i;
+
+  for (i = 0; i < PINGPONG_ROUNDS; i++)
+    {
+      sema_down (&ping);
+      sema_up (&pong);
+    }
+}
@@ -0,0 +1,82 @@
+/* Checks that condition variables work with the MLFQS.
+
+   Several threads wait on a condition variable, then the main
+   thread wakes one of them with cond_signal() and the rest with
+   cond_broadcast().  cond_wait() releases its lock while the
+   waiter is already on the condition's waiters, which must not
+   upset the MLFQS priority update that releasing a lock does. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+#define WAITER_CNT 5
+
+static thread_func waiter_thread;
+
+static struct lock lock;
+static struct condition condition;
+static int waiting, woken;
+static bool go;
+
+void
+test_mlfqs_condvar (void) 
+{
+  int i;
+
+  ASSERT (thread_mlfqs);
+
+  lock_init (&lock);
+  cond_init (&condition);
+
+  for (i = 0; i < WAITER_CNT; i++) 
+    {
+      char name[16];
+      snprintf (name, sizeof name, "waiter %d", i);
+      thread_create (name, PRI_DEFAULT, waiter_thread, NULL);
+    }
+
+  /* Wait for all the waiters to block. */
+  lock_acquire (&lock);
+  while (waiting < WAITER_CNT)
+    {
+      lock_release (&lock);
+      timer_sleep (1);
+      lock_acquire (&lock);
+    }
+  msg ("%d threads waiting.", waiting);
+
+  go = true;
+  cond_signal (&condition, &lock);
+  while (woken < 1)
+    {
+      lock_release (&lock);
+      timer_sleep (1);
+      lock_acquire (&lock);
+    }
+  msg ("Signaled one.");
+
+  cond_broadcast (&condition, &lock);
+  while (woken < WAITER_CNT)
+    {
+      lock_release (&lock);
+      timer_sleep (1);
+      lock_acquire (&lock);
+    }
+  lock_release (&lock);
+  msg ("Broadcast woke the rest.");
+}
+
+static void
+waiter_thread (void *aux UNUSED) 
+{
+  lock_acquire (&lock);
+  waiting++;
+  while (!go)
+    cond_wait (&condition, &lock);
+  woken++;
+  lock_release (&lock);
+}
@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(mlfqs-condvar) begin
+(mlfqs-condvar) 5 threads waiting.
+(mlfqs-condvar) Signaled one.
+(mlfqs-condvar) Broadcast woke the rest.
+(mlfqs-condvar) end
+EOF
+pass;
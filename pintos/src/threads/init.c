@@ -19,9 +19,14 @@
 #include "threads/io.h"
 #include "threads/loader.h"
 #include "threads/malloc.h"
+#include "threads/memtrack.h"
 #include "threads/palloc.h"
 #include "threads/pte.h"
+#include "threads/slab.h"
+#include "threads/smp.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
+#include "threads/trace.h"
 #ifdef USERPROG
 #include "userprog/process.h"
 #include "userprog/exception.h"
@@ -57,6 +62,9 @@ static const char *swap_bdev_name;
 /* -ul: Maximum number of pages to put into palloc's user pool. */
 static size_t user_page_limit = SIZE_MAX;
 
+/* -smp: Maximum number of CPUs to start. */
+static unsigned max_cpus = CPU_MAX;
+
 static void bss_init (void);
 static void paging_init (void);
 
@@ -88,6 +96,7 @@ main (void)
   /* Initialize ourselves as a thread so we can use locks,
      then enable console locking. */
   thread_init ();
+  futex_init ();
   console_init ();  
 
   /* Greet user. */
@@ -97,6 +106,7 @@ main (void)
   /* Initialize memory system. */
   palloc_init (user_page_limit);
   malloc_init ();
+  memtrack_init ();
   paging_init ();
 
   /* Segmentation. */
@@ -118,7 +128,9 @@ main (void)
   /* Start thread scheduler and enable interrupts. */
   thread_start ();
   serial_init_queue ();
+  trace_init ();
   timer_calibrate ();
+  smp_init (max_cpus);
 
 #ifdef FILESYS
   /* Initialize file system. */
@@ -256,6 +268,12 @@ parse_options (char **argv)
         random_init (atoi (value));
       else if (!strcmp (name, "-mlfqs"))
         thread_mlfqs = true;
+      else if (!strcmp (name, "-smp"))
+        max_cpus = atoi (value);
+      else if (!strcmp (name, "-stack-guard"))
+        thread_stack_guard = true;
+      else if (!strcmp (name, "-mt"))
+        memtrack_enabled = true;
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
@@ -277,6 +295,29 @@ parse_options (char **argv)
   return argv;
 }
 
+/* Prints the scheduler trace. */
+static void
+print_sched_trace (char **argv UNUSED)
+{
+  trace_dump ();
+}
+
+/* Prints each thread's resource usage. */
+static void
+print_rusage (char **argv UNUSED)
+{
+  thread_print_rusage ();
+}
+
+/* Prints how much memory is in use and by whom. */
+static void
+print_meminfo (char **argv UNUSED)
+{
+  palloc_print_stats ();
+  kmem_cache_print_stats ();
+  memtrack_print_usage ();
+}
+
 /* Runs the task specified in ARGV[1]. */
 static void
 run_task (char **argv)
@@ -309,6 +350,9 @@ run_actions (char **argv)
   static const struct action actions[] = 
     {
       {"run", 2, run_task},
+      {"sched-trace", 1, print_sched_trace},
+      {"meminfo", 1, print_meminfo},
+      {"rusage", 1, print_rusage},
 #ifdef FILESYS
       {"ls", 1, fsutil_ls},
       {"cat", 2, fsutil_cat},
@@ -357,6 +401,9 @@ usage (void)
 #else
           "  run TEST           Run TEST.\n"
 #endif
+          "  sched-trace        Print recent scheduling events.\n"
+          "  meminfo            Print memory pool and allocation usage.\n"
+          "  rusage             Print each thread's resource usage.\n"
 #ifdef FILESYS
           "  ls                 List files in the root directory.\n"
           "  cat FILE           Print FILE to the console.\n"
@@ -379,10 +426,13 @@ usage (void)
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
+          "  -smp=N             Start at most N CPUs (default and max %d).\n"
+          "  -stack-guard       Catch kernel stack overflow with guard pages.\n"
+          "  -mt                Track kernel memory by allocation site.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
 #endif
-          );
+          , CPU_MAX);
   shutdown_power_off ();
 }
 
@@ -0,0 +1,70 @@
+#ifndef THREADS_MAGAZINE_H
+#define THREADS_MAGAZINE_H
+
+#include <debug.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Per-CPU caches of free objects.
+
+   palloc, malloc and the slab allocator each put a "magazine" of
+   up to MAGAZINE_SIZE free pages, blocks or objects per CPU in
+   front of their shared free lists.  A CPU takes from and gives
+   back to its own magazine without touching shared state, and
+   only goes to the free lists, under their lock, to refill an
+   empty magazine with MAGAZINE_BATCH items at once or to give
+   back the MAGAZINE_BATCH coldest items of a full one.  That
+   makes the common case cheap and bounds how much a CPU holds
+   back.  The most recently freed item, the likeliest to still be
+   in the CPU's cache, is handed out first.
+
+   A magazine does no locking of its own.  Its owner decides how
+   it is protected, usually by touching it only from its CPU with
+   interrupts off. */
+
+#define MAGAZINE_SIZE 16        /* Max items per magazine. */
+#define MAGAZINE_BATCH 8        /* Items moved to or from a free list
+                                   at once. */
+
+/* A magazine. */
+struct magazine
+  {
+    unsigned cnt;                       /* Number of items. */
+    void *items[MAGAZINE_SIZE];         /* Items, coldest first. */
+  };
+
+/* Returns true if M can take no more items. */
+static inline bool
+magazine_full (const struct magazine *m)
+{
+  return m->cnt == MAGAZINE_SIZE;
+}
+
+/* Removes and returns the most recently pushed item in M, or a
+   null pointer if M is empty. */
+static inline void *
+magazine_pop (struct magazine *m)
+{
+  return m->cnt > 0 ? m->items[--m->cnt] : NULL;
+}
+
+/* Pushes ITEM onto M, which must not be full. */
+static inline void
+magazine_push (struct magazine *m, void *item)
+{
+  ASSERT (!magazine_full (m));
+  m->items[m->cnt++] = item;
+}
+
+/* Removes the CNT coldest items from M and stores them in
+   BATCH. */
+static inline void
+magazine_take_cold (struct magazine *m, void **batch, unsigned cnt)
+{
+  ASSERT (cnt <= m->cnt);
+  memcpy (batch, m->items, cnt * sizeof *batch);
+  m->cnt -= cnt;
+  memmove (m->items, m->items + cnt, m->cnt * sizeof *m->items);
+}
+
+#endif /* threads/magazine.h */
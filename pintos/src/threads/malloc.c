@@ -5,7 +5,11 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
+#include "threads/magazine.h"
+#include "threads/memtrack.h"
 #include "threads/palloc.h"
+#include "threads/smp.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
 
@@ -32,7 +36,19 @@
    because they're too big to fit in a single page with a
    descriptor.  We handle those by allocating contiguous pages
    with the page allocator and sticking the allocation size at
-   the beginning of the allocated block's arena header. */
+   the beginning of the allocated block's arena header.
+
+   Most blocks never reach a descriptor's free list, though:
+   each CPU keeps a magazine of free blocks for each descriptor
+   (see magazine.h), which only that CPU touches, with interrupts
+   off, so malloc() and free() usually take no lock at all.
+   Magazines are refilled and drained under the descriptor's
+   lock with interrupts on.  Blocks in magazines count as in use
+   in their arenas.
+
+   The descriptor for a request is found in size_classes[], a
+   table indexed by the request's size in SIZE_CLASS_GRAIN-byte
+   units, rather than by searching the descriptors. */
 
 /* Descriptor. */
 struct desc
@@ -41,6 +57,9 @@ struct desc
     size_t blocks_per_arena;    /* Number of blocks in an arena. */
     struct list free_list;      /* List of free blocks. */
     struct lock lock;           /* Lock. */
+    char name[16];              /* Name of lock, for profiling. */
+    struct magazine magazines[CPU_MAX]; /* Per-CPU caches, by CPU id.
+                                           Not protected by `lock'. */
   };
 
 /* Magic number for detecting arena corruption. */
@@ -64,14 +83,28 @@ struct block
 static struct desc descs[10];   /* Descriptors. */
 static size_t desc_cnt;         /* Number of descriptors. */
 
+/* Maps a request of SIZE bytes, up to the largest descriptor's
+   block size, to the index in descs[] of the smallest descriptor
+   that satisfies it, at size_classes[(SIZE - 1) /
+   SIZE_CLASS_GRAIN].  The smallest block size must be a multiple
+   of SIZE_CLASS_GRAIN. */
+#define SIZE_CLASS_GRAIN 16
+static uint8_t size_classes[PGSIZE / 2 / SIZE_CLASS_GRAIN];
+static size_t max_block_size;   /* Largest descriptor's block size. */
+
+static void *alloc_block (size_t size);
+static void *track_block (void *, size_t size, const char *tag, void *caller);
 static struct arena *block_to_arena (struct block *);
 static struct block *arena_to_block (struct arena *, size_t idx);
+static struct block *free_list_get (struct desc *);
+static void free_list_put (struct desc *, struct block *);
 
 /* Initializes the malloc() descriptors. */
 void
 malloc_init (void) 
 {
-  size_t block_size;
+  size_t block_size, i;
+  uint8_t class = 0;
 
   for (block_size = 16; block_size < PGSIZE / 2; block_size *= 2)
     {
@@ -80,34 +113,73 @@ malloc_init (void)
       d->block_size = block_size;
       d->blocks_per_arena = (PGSIZE - sizeof (struct arena)) / block_size;
       list_init (&d->free_list);
-      lock_init (&d->lock);
+      lock_init_adaptive (&d->lock);
+      snprintf (d->name, sizeof d->name, "malloc%zu", block_size);
+      lock_profile (&d->lock, d->name);
+    }
+  max_block_size = descs[desc_cnt - 1].block_size;
+
+  ASSERT (descs[0].block_size % SIZE_CLASS_GRAIN == 0);
+  ASSERT (max_block_size / SIZE_CLASS_GRAIN
+          <= sizeof size_classes / sizeof *size_classes);
+  for (i = 0; i < max_block_size / SIZE_CLASS_GRAIN; i++)
+    {
+      while (descs[class].block_size < (i + 1) * SIZE_CLASS_GRAIN)
+        class++;
+      size_classes[i] = class;
     }
 }
 
+/* Prints statistics about the malloc() descriptors' locks. */
+void
+malloc_print_stats (void) 
+{
+  size_t i;
+
+  for (i = 0; i < desc_cnt; i++)
+    lock_print_stats (&descs[i].lock, descs[i].name);
+}
+
 /* Obtains and returns a new block of at least SIZE bytes.
    Returns a null pointer if memory is not available. */
 void *
 malloc (size_t size) 
 {
+  return track_block (alloc_block (size), size, NULL,
+                      __builtin_return_address (0));
+}
+
+/* Like malloc(), but with -mt charges the block to TAG instead
+   of to the caller. */
+void *
+malloc_tagged (size_t size, const char *tag)
+{
+  return track_block (alloc_block (size), size, tag,
+                      __builtin_return_address (0));
+}
+
+/* Does the work of malloc(). */
+static void *
+alloc_block (size_t size)
+{
+  void *batch[MAGAZINE_BATCH];
+  enum intr_level old_level;
+  struct magazine *m;
   struct desc *d;
   struct block *b;
   struct arena *a;
+  size_t n;
 
   /* A null pointer satisfies a request for 0 bytes. */
   if (size == 0)
     return NULL;
 
-  /* Find the smallest descriptor that satisfies a SIZE-byte
-     request. */
-  for (d = descs; d < descs + desc_cnt; d++)
-    if (d->block_size >= size)
-      break;
-  if (d == descs + desc_cnt) 
+  if (size > max_block_size)
     {
       /* SIZE is too big for any descriptor.
          Allocate enough pages to hold SIZE plus an arena. */
       size_t page_cnt = DIV_ROUND_UP (size + sizeof *a, PGSIZE);
-      a = palloc_get_multiple (0, page_cnt);
+      a = palloc_get_tagged (0, page_cnt, "malloc");
       if (a == NULL)
         return NULL;
 
@@ -119,37 +191,45 @@ malloc (size_t size)
       return a + 1;
     }
 
+  /* Find the smallest descriptor that satisfies a SIZE-byte
+     request. */
+  d = &descs[size_classes[(size - 1) / SIZE_CLASS_GRAIN]];
+
+  /* Take a block from this CPU's magazine, if it has one. */
+  old_level = intr_disable ();
+  b = magazine_pop (&d->magazines[cpu_current ()->id]);
+  intr_set_level (old_level);
+  if (b != NULL)
+    return b;
+
+  /* Otherwise get a batch of blocks from the free list, keep one,
+     and put the rest in the magazine of the CPU we are on by
+     then.  Any that no longer fit go back. */
   lock_acquire (&d->lock);
-
-  /* If the free list is empty, create a new arena. */
-  if (list_empty (&d->free_list))
+  for (n = 0; n < MAGAZINE_BATCH; n++)
     {
-      size_t i;
+      batch[n] = free_list_get (d);
+      if (batch[n] == NULL)
+        break;
+    }
+  lock_release (&d->lock);
+  if (n == 0)
+    return NULL;
+  b = batch[--n];
 
-      /* Allocate a page. */
-      a = palloc_get_page (0);
-      if (a == NULL) 
-        {
-          lock_release (&d->lock);
-          return NULL; 
-        }
+  old_level = intr_disable ();
+  m = &d->magazines[cpu_current ()->id];
+  while (n > 0 && !magazine_full (m))
+    magazine_push (m, batch[--n]);
+  intr_set_level (old_level);
 
-      /* Initialize arena and add its blocks to the free list. */
-      a->magic = ARENA_MAGIC;
-      a->desc = d;
-      a->free_cnt = d->blocks_per_arena;
-      for (i = 0; i < d->blocks_per_arena; i++) 
-        {
-          struct block *b = arena_to_block (a, i);
-          list_push_back (&d->free_list, &b->free_elem);
-        }
+  if (n > 0)
+    {
+      lock_acquire (&d->lock);
+      while (n > 0)
+        free_list_put (d, batch[--n]);
+      lock_release (&d->lock);
     }
-
-  /* Get a block from free list and return it. */
-  b = list_entry (list_pop_front (&d->free_list), struct block, free_elem);
-  a = block_to_arena (b);
-  a->free_cnt--;
-  lock_release (&d->lock);
   return b;
 }
 
@@ -167,11 +247,11 @@ calloc (size_t a, size_t b)
     return NULL;
 
   /* Allocate and zero memory. */
-  p = malloc (size);
+  p = alloc_block (size);
   if (p != NULL)
     memset (p, 0, size);
 
-  return p;
+  return track_block (p, size, NULL, __builtin_return_address (0));
 }
 
 /* Returns the number of bytes allocated for BLOCK. */
@@ -201,7 +281,8 @@ realloc (void *old_block, size_t new_size)
     }
   else 
     {
-      void *new_block = malloc (new_size);
+      void *new_block = track_block (alloc_block (new_size), new_size,
+                                     NULL, __builtin_return_address (0));
       if (old_block != NULL && new_block != NULL)
         {
           size_t old_size = block_size (old_block);
@@ -223,36 +304,42 @@ free (void *p)
       struct block *b = p;
       struct arena *a = block_to_arena (b);
       struct desc *d = a->desc;
-      
+
+      if (memtrack_enabled)
+        memtrack_free (p);
+
       if (d != NULL) 
         {
           /* It's a normal block.  We handle it here. */
+          void *batch[MAGAZINE_BATCH];
+          enum intr_level old_level;
+          struct magazine *m;
+          size_t i;
 
 #ifndef NDEBUG
           /* Clear the block to help detect use-after-free bugs. */
           memset (b, 0xcc, d->block_size);
 #endif
-  
-          lock_acquire (&d->lock);
-
-          /* Add block to free list. */
-          list_push_front (&d->free_list, &b->free_elem);
 
-          /* If the arena is now entirely unused, free it. */
-          if (++a->free_cnt >= d->blocks_per_arena) 
+          /* Put the block in this CPU's magazine.  If that is
+             full, first take out its coldest blocks, which go
+             back to the free list. */
+          old_level = intr_disable ();
+          m = &d->magazines[cpu_current ()->id];
+          if (magazine_full (m))
+            magazine_take_cold (m, batch, MAGAZINE_BATCH);
+          else
+            batch[0] = NULL;
+          magazine_push (m, b);
+          intr_set_level (old_level);
+
+          if (batch[0] != NULL)
             {
-              size_t i;
-
-              ASSERT (a->free_cnt == d->blocks_per_arena);
-              for (i = 0; i < d->blocks_per_arena; i++) 
-                {
-                  struct block *b = arena_to_block (a, i);
-                  list_remove (&b->free_elem);
-                }
-              palloc_free_page (a);
+              lock_acquire (&d->lock);
+              for (i = 0; i < MAGAZINE_BATCH; i++)
+                free_list_put (d, batch[i]);
+              lock_release (&d->lock);
             }
-
-          lock_release (&d->lock);
         }
       else
         {
@@ -263,6 +350,80 @@ free (void *p)
     }
 }
 
+/* Charges block P, of SIZE bytes, to TAG or CALLER, if it is
+   nonnull and -mt is in effect.  Returns P. */
+static void *
+track_block (void *p, size_t size, const char *tag, void *caller)
+{
+  if (memtrack_enabled && p != NULL)
+    memtrack_alloc (MEMTRACK_MALLOC, p, size, tag, caller);
+  return p;
+}
+
+/* Removes a block from D's free list, creating a new arena if
+   the list is empty, and returns it.  Returns a null pointer if
+   memory is not available.  D's lock must be held. */
+static struct block *
+free_list_get (struct desc *d)
+{
+  struct block *b;
+  struct arena *a;
+
+  /* If the free list is empty, create a new arena. */
+  if (list_empty (&d->free_list))
+    {
+      size_t i;
+
+      /* Allocate a page. */
+      a = palloc_get_tagged (0, 1, "malloc");
+      if (a == NULL) 
+        return NULL; 
+
+      /* Initialize arena and add its blocks to the free list. */
+      a->magic = ARENA_MAGIC;
+      a->desc = d;
+      a->free_cnt = d->blocks_per_arena;
+      for (i = 0; i < d->blocks_per_arena; i++) 
+        {
+          struct block *b = arena_to_block (a, i);
+          list_push_back (&d->free_list, &b->free_elem);
+        }
+    }
+
+  /* Get a block from free list and return it. */
+  b = list_entry (list_pop_front (&d->free_list), struct block, free_elem);
+  a = block_to_arena (b);
+  a->free_cnt--;
+  return b;
+}
+
+/* Adds block B to D's free list.  If B's arena then has no
+   blocks in use, frees the arena.  D's lock must be held. */
+static void
+free_list_put (struct desc *d, struct block *b)
+{
+  struct arena *a = block_to_arena (b);
+
+  ASSERT (a->desc == d);
+
+  /* Add block to free list. */
+  list_push_front (&d->free_list, &b->free_elem);
+
+  /* If the arena is now entirely unused, free it. */
+  if (++a->free_cnt >= d->blocks_per_arena) 
+    {
+      size_t i;
+
+      ASSERT (a->free_cnt == d->blocks_per_arena);
+      for (i = 0; i < d->blocks_per_arena; i++) 
+        {
+          struct block *b = arena_to_block (a, i);
+          list_remove (&b->free_elem);
+        }
+      palloc_free_page (a);
+    }
+}
+
 /* Returns the arena that block B is inside. */
 static struct arena *
 block_to_arena (struct block *b)
@@ -5,7 +5,9 @@
 #include <stddef.h>
 
 void malloc_init (void);
+void malloc_print_stats (void);
 void *malloc (size_t) __attribute__ ((malloc));
+void *malloc_tagged (size_t, const char *tag) __attribute__ ((malloc));
 void *calloc (size_t, size_t) __attribute__ ((malloc));
 void *realloc (void *, size_t);
 void free (void *);
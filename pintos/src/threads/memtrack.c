@@ -0,0 +1,309 @@
+#include "threads/memtrack.h"
+#include <debug.h>
+#include <hash.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "threads/palloc.h"
+#include "threads/spinlock.h"
+#include "threads/vaddr.h"
+
+/* Kernel memory accounting.
+
+   With the "-mt" kernel command-line option, palloc and malloc
+   report each allocation and free here.  Every allocation is
+   charged to a "site": its tag, if it came through
+   palloc_get_tagged() or malloc_tagged(), and otherwise the
+   address of the code that called the allocator.  A site counts
+   the bytes and blocks that it has live, the most bytes it ever
+   had live at once, and the allocations it made in all.  Pages
+   that malloc() takes from palloc are charged to palloc's
+   "malloc" site as well as to malloc()'s own callers.
+
+   Sites are kept in a table of SITE_MAX entries.  Live blocks,
+   which must be found again when they are freed, are kept in a
+   table of LIVE_MAX entries taken from the kernel pool by
+   memtrack_init().  Both are hash tables with linear probing, so
+   tracking never allocates memory itself.  Allocations that do
+   not fit are counted as untracked, and freeing an untracked
+   block does nothing.
+
+   memtrack_print_usage() lists every site, for the "meminfo"
+   kernel command-line action.  memtrack_print_stats() lists the
+   sites that still have memory live at shutdown, which are the
+   places to look for leaks.  The `backtrace' utility translates
+   their caller addresses into source lines. */
+
+/* Size of the site table.  Must be a power of 2. */
+#define SITE_MAX 128
+
+/* Size of the live block table.  Must be a power of 2.  No more
+   than 3/4 of it is used, to keep probe sequences short. */
+#define LIVE_MAX 8192
+#define LIVE_LIMIT (LIVE_MAX / 4 * 3)
+#define LIVE_PAGES DIV_ROUND_UP (LIVE_MAX * sizeof (struct live), PGSIZE)
+
+/* An allocation site. */
+struct site
+  {
+    const char *tag;                    /* Tag, or null if untagged. */
+    void *caller;                       /* Caller if untagged, otherwise
+                                           the first caller. */
+    enum memtrack_source source;        /* Allocator. */
+    size_t live_bytes;                  /* Bytes allocated, not freed. */
+    size_t peak_bytes;                  /* Maximum of live_bytes. */
+    unsigned live_cnt;                  /* Blocks allocated, not freed. */
+    unsigned long long alloc_cnt;       /* Allocations, 0 if slot unused. */
+  };
+
+/* A live block. */
+struct live
+  {
+    void *ptr;                          /* Block, or null if slot unused. */
+    size_t size;                        /* Size in bytes. */
+    struct site *site;                  /* Site it is charged to. */
+  };
+
+bool memtrack_enabled;
+
+/* Protects the tables below. */
+static struct spinlock memtrack_lock;
+
+static struct site sites[SITE_MAX];     /* Allocation sites. */
+static unsigned site_cnt;               /* Sites in use. */
+static struct live *live;               /* LIVE_MAX live blocks. */
+static unsigned live_cnt;               /* Live blocks in use. */
+static unsigned long long untracked_cnt; /* Allocations not tracked. */
+
+static struct site *find_site (enum memtrack_source, const char *tag,
+                               void *caller);
+static unsigned live_home (const void *ptr);
+static struct live *find_live (const void *ptr);
+static void remove_live (struct live *);
+static void print_sites (bool live_only);
+
+/* Starts tracking allocations, if the -mt option was given.
+   Must be called after palloc_init(). */
+void
+memtrack_init (void)
+{
+  if (!memtrack_enabled)
+    return;
+
+  spinlock_init (&memtrack_lock, "memtrack");
+  live = palloc_get_multiple (PAL_ASSERT | PAL_ZERO, LIVE_PAGES);
+}
+
+/* Records that PTR, a block of SIZE bytes, was just allocated
+   from SOURCE by CALLER, with TAG, which may be null. */
+void
+memtrack_alloc (enum memtrack_source source, void *ptr, size_t size,
+                const char *tag, void *caller)
+{
+  enum intr_level old_level;
+  struct site *s = NULL;
+
+  if (live == NULL)
+    return;
+
+  old_level = spinlock_acquire_irqsave (&memtrack_lock);
+  if (live_cnt < LIVE_LIMIT)
+    s = find_site (source, tag, caller);
+  if (s != NULL)
+    {
+      struct live *l = find_live (ptr);
+
+      ASSERT (l->ptr == NULL);
+      l->ptr = ptr;
+      l->size = size;
+      l->site = s;
+      live_cnt++;
+
+      s->alloc_cnt++;
+      s->live_cnt++;
+      s->live_bytes += size;
+      if (s->live_bytes > s->peak_bytes)
+        s->peak_bytes = s->live_bytes;
+    }
+  else
+    untracked_cnt++;
+  spinlock_release_irqrestore (&memtrack_lock, old_level);
+}
+
+/* Records that PTR is about to be freed. */
+void
+memtrack_free (void *ptr)
+{
+  enum intr_level old_level;
+  struct live *l;
+
+  if (live == NULL || ptr == NULL)
+    return;
+
+  old_level = spinlock_acquire_irqsave (&memtrack_lock);
+  l = find_live (ptr);
+  if (l->ptr != NULL)
+    {
+      l->site->live_cnt--;
+      l->site->live_bytes -= l->size;
+      live_cnt--;
+      remove_live (l);
+    }
+  spinlock_release_irqrestore (&memtrack_lock, old_level);
+}
+
+/* Prints every allocation site. */
+void
+memtrack_print_usage (void)
+{
+  if (live == NULL)
+    {
+      printf ("Memory tracking is off (use -mt to turn it on).\n");
+      return;
+    }
+  printf ("Kernel memory by allocation site:\n");
+  print_sites (false);
+}
+
+/* Prints the allocation sites that still have memory live, if
+   tracking is on. */
+void
+memtrack_print_stats (void)
+{
+  if (live == NULL)
+    return;
+  printf ("Kernel memory still allocated:\n");
+  print_sites (true);
+}
+
+/* Returns the site for an allocation from SOURCE with TAG by
+   CALLER, creating it if necessary.  Returns a null pointer if
+   the site table is full.  memtrack_lock must be held. */
+static struct site *
+find_site (enum memtrack_source source, const char *tag, void *caller)
+{
+  unsigned i;
+
+  i = tag != NULL ? hash_string (tag) : hash_int ((uintptr_t) caller);
+  for (i = (i + source) % SITE_MAX; ; i = (i + 1) % SITE_MAX)
+    {
+      struct site *s = &sites[i];
+
+      if (s->alloc_cnt == 0)
+        {
+          /* Keep one slot unused, so that probing ends. */
+          if (site_cnt == SITE_MAX - 1)
+            return NULL;
+          site_cnt++;
+          s->tag = tag;
+          s->caller = caller;
+          s->source = source;
+          return s;
+        }
+      if (s->source == source
+          && (tag != NULL
+              ? s->tag != NULL && !strcmp (s->tag, tag)
+              : s->tag == NULL && s->caller == caller))
+        return s;
+    }
+}
+
+/* Returns the index in the live table where probing for PTR
+   starts. */
+static unsigned
+live_home (const void *ptr)
+{
+  return hash_int ((uintptr_t) ptr) % LIVE_MAX;
+}
+
+/* Returns PTR's entry in the live table, or the unused entry
+   where it would go.  memtrack_lock must be held. */
+static struct live *
+find_live (const void *ptr)
+{
+  unsigned i;
+
+  for (i = live_home (ptr); live[i].ptr != NULL; i = (i + 1) % LIVE_MAX)
+    if (live[i].ptr == ptr)
+      break;
+  return &live[i];
+}
+
+/* Removes L from the live table, moving later entries in its
+   probe sequence back so that none of them becomes unreachable.
+   memtrack_lock must be held. */
+static void
+remove_live (struct live *l)
+{
+  unsigned hole = l - live;
+  unsigned i;
+
+  for (i = (hole + 1) % LIVE_MAX; live[i].ptr != NULL; i = (i + 1) % LIVE_MAX)
+    {
+      /* Entry I may move to HOLE unless its home lies
+         cyclically in (HOLE, I]. */
+      unsigned home = live_home (live[i].ptr);
+      if (hole < i ? home <= hole || home > i : home <= hole && home > i)
+        {
+          live[hole] = live[i];
+          hole = i;
+        }
+    }
+  live[hole].ptr = NULL;
+}
+
+/* Orders sites by live bytes, then by peak bytes, most first. */
+static int
+compare_sites (const void *a_, const void *b_)
+{
+  const struct site *a = *(struct site *const *) a_;
+  const struct site *b = *(struct site *const *) b_;
+
+  if (a->live_bytes != b->live_bytes)
+    return a->live_bytes < b->live_bytes ? 1 : -1;
+  if (a->peak_bytes != b->peak_bytes)
+    return a->peak_bytes < b->peak_bytes ? 1 : -1;
+  return 0;
+}
+
+/* Prints the allocation sites, or if LIVE_ONLY is true just
+   those with live blocks, largest first.  The counts are read
+   without the lock, so they may be slightly out of date. */
+static void
+print_sites (bool live_only)
+{
+  static const char *source_names[] = {"palloc", "malloc"};
+  struct site *order[SITE_MAX];
+  size_t live_bytes[2] = {0, 0};
+  enum intr_level old_level;
+  size_t i, cnt = 0;
+
+  old_level = spinlock_acquire_irqsave (&memtrack_lock);
+  for (i = 0; i < SITE_MAX; i++)
+    if (sites[i].alloc_cnt > 0 && (!live_only || sites[i].live_cnt > 0))
+      order[cnt++] = &sites[i];
+  qsort (order, cnt, sizeof *order, compare_sites);
+  spinlock_release_irqrestore (&memtrack_lock, old_level);
+
+  printf ("  %-6s %10s %10s %7s %10s  %s\n",
+          "from", "live", "peak", "blocks", "allocs", "site");
+  for (i = 0; i < cnt; i++)
+    {
+      struct site *s = order[i];
+
+      printf ("  %-6s %10zu %10zu %7u %10llu  ",
+              source_names[s->source], s->live_bytes, s->peak_bytes,
+              s->live_cnt, s->alloc_cnt);
+      if (s->tag != NULL)
+        printf ("%s (first %p)\n", s->tag, s->caller);
+      else
+        printf ("%p\n", s->caller);
+      live_bytes[s->source] += s->live_bytes;
+    }
+  printf ("  %zu bytes live from palloc, %zu from malloc, "
+          "%llu allocations untracked\n",
+          live_bytes[MEMTRACK_PALLOC], live_bytes[MEMTRACK_MALLOC],
+          untracked_cnt);
+}
@@ -0,0 +1,26 @@
+#ifndef THREADS_MEMTRACK_H
+#define THREADS_MEMTRACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Kernel memory accounting.  See memtrack.c. */
+
+/* Allocator that an allocation came from. */
+enum memtrack_source
+  {
+    MEMTRACK_PALLOC,            /* palloc_get_multiple() and friends. */
+    MEMTRACK_MALLOC             /* malloc() and friends. */
+  };
+
+/* -mt: Track kernel allocations by site? */
+extern bool memtrack_enabled;
+
+void memtrack_init (void);
+void memtrack_alloc (enum memtrack_source, void *, size_t size,
+                     const char *tag, void *caller);
+void memtrack_free (void *);
+void memtrack_print_usage (void);
+void memtrack_print_stats (void);
+
+#endif /* threads/memtrack.h */
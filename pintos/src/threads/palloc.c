@@ -2,13 +2,18 @@
 #include <bitmap.h>
 #include <debug.h>
 #include <inttypes.h>
+#include <list.h>
 #include <round.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/loader.h"
-#include "threads/synch.h"
+#include "threads/magazine.h"
+#include "threads/memtrack.h"
+#include "threads/smp.h"
+#include "threads/spinlock.h"
 #include "threads/vaddr.h"
 
 /* Page allocator.  Hands out memory in page-size (or
@@ -23,22 +28,94 @@
 
    By default, half of system RAM is given to the kernel pool and
    half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   kernel pool, but that's just fine for demonstration purposes.
+
+   Each pool is a binary buddy allocator.  Its free pages form
+   blocks of 2**ORDER pages, for ORDER from 0 to MAX_ORDER, each
+   starting at a page index that is a multiple of its size, and
+   each on the free list for its order.  A request for PAGE_CNT
+   pages takes a block from the smallest order that fits and has
+   one, splitting it in halves as needed, and gives back the
+   pages past PAGE_CNT.  Freeing a block merges it with its
+   "buddy", the other half of the block of the next order up,
+   for as long as the buddy is free too.  Both take O(log n) time
+   in the size of the pool, independent of how many pages are in
+   use.  The largest request that can succeed is the largest
+   free block, though, rather than the longest run of free pages.
+
+   The pages on a free list hold their own list elements.  Each
+   pool also keeps a bitmap of used pages, to catch double frees,
+   and the order of the free block starting at each page, or
+   CACHED for a page in a magazine (see below).
+
+   Single pages, by far the most common request, mostly bypass
+   the buddy allocator: each CPU keeps a magazine of free pages
+   for each pool (see magazine.h), refilled from and drained to
+   the pool under the pool's lock.  Taking a page from a magazine
+   or putting one back, with interrupts off, takes only a lock of
+   the CPU's own, which other CPUs take only to reclaim pages
+   when memory runs out.  Pages in magazines count as used
+   in the pool, so a request that the pool cannot satisfy takes
+   back the pages in every CPU's magazine and tries again before
+   it fails.  A page in a magazine keeps its used_map bit, but is
+   marked CACHED in the order_map, so freeing it again is still
+   caught. */
+
+/* Largest block order.  4 GB of RAM, far more than Pintos can
+   address, is 2**20 pages. */
+#define MAX_ORDER 20
+
+/* Entry in a pool's order_map for a page that does not start a
+   free block. */
+#define NOT_FREE 0xff
+
+/* Entry in a pool's order_map for a free page in a magazine. */
+#define CACHED 0xfe
+
+/* A CPU's cache of free pages from one pool. */
+struct page_cache
+  {
+    struct spinlock lock;               /* Taken by other CPUs only to
+                                           reclaim pages. */
+    struct magazine magazine;           /* Free pages. */
+  };
 
 /* A memory pool. */
 struct pool
   {
-    struct lock lock;                   /* Mutual exclusion. */
-    struct bitmap *used_map;            /* Bitmap of free pages. */
+    struct spinlock lock;               /* Mutual exclusion. */
+    struct bitmap *used_map;            /* Bitmap of used pages. */
+    uint8_t *order_map;                 /* Order of free block at each
+                                           page, or NOT_FREE. */
     uint8_t *base;                      /* Base of pool. */
+    size_t page_cnt;                    /* Number of pages in pool. */
+    size_t free_cnt;                    /* Number of free pages. */
+    size_t used_cnt;                    /* Pages held by callers. */
+    size_t peak_used_cnt;               /* Maximum of used_cnt. */
+    struct list free[MAX_ORDER + 1];    /* Free blocks of each order. */
+    uint32_t nonempty;                  /* Bitmap of nonempty free lists. */
+    struct page_cache caches[CPU_MAX];  /* Per-CPU caches, by CPU id. */
   };
 
 /* Two pools: one for kernel data, one for user pages. */
 static struct pool kernel_pool, user_pool;
 
+static void *get_multiple (enum palloc_flags, size_t page_cnt,
+                           const char *tag, void *caller);
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
 static bool page_from_pool (const struct pool *, void *page);
+static size_t alloc_pages (struct pool *, size_t page_cnt);
+static void free_pages (struct pool *, size_t page_idx, size_t page_cnt);
+static void free_block (struct pool *, size_t page_idx, int order);
+static struct list_elem *block_elem (const struct pool *, size_t page_idx);
+static void *cache_get (struct pool *);
+static void cache_put (struct pool *, void *page);
+static void cache_drain (struct pool *, struct page_cache *, unsigned cnt);
+static bool cache_reclaim (struct pool *);
+static void count_used (struct pool *, int page_cnt);
+static size_t alloc_pages_locked (struct pool *, size_t page_cnt);
+static void print_pool (const char *name, struct pool *);
 
 /* Initializes the page allocator.  At most USER_PAGE_LIMIT
    pages are put into the user pool. */
@@ -70,34 +147,15 @@ palloc_init (size_t user_page_limit)
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 {
-  struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
-  void *pages;
-  size_t page_idx;
-
-  if (page_cnt == 0)
-    return NULL;
-
-  lock_acquire (&pool->lock);
-  page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
-  lock_release (&pool->lock);
-
-  if (page_idx != BITMAP_ERROR)
-    pages = pool->base + PGSIZE * page_idx;
-  else
-    pages = NULL;
-
-  if (pages != NULL) 
-    {
-      if (flags & PAL_ZERO)
-        memset (pages, 0, PGSIZE * page_cnt);
-    }
-  else 
-    {
-      if (flags & PAL_ASSERT)
-        PANIC ("palloc_get: out of pages");
-    }
+  return get_multiple (flags, page_cnt, NULL, __builtin_return_address (0));
+}
 
-  return pages;
+/* Like palloc_get_multiple(), but with -mt charges the pages to
+   TAG instead of to the caller. */
+void *
+palloc_get_tagged (enum palloc_flags flags, size_t page_cnt, const char *tag)
+{
+  return get_multiple (flags, page_cnt, tag, __builtin_return_address (0));
 }
 
 /* Obtains a single free page and returns its kernel virtual
@@ -110,19 +168,22 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 void *
 palloc_get_page (enum palloc_flags flags) 
 {
-  return palloc_get_multiple (flags, 1);
+  return get_multiple (flags, 1, NULL, __builtin_return_address (0));
 }
 
 /* Frees the PAGE_CNT pages starting at PAGES. */
 void
 palloc_free_multiple (void *pages, size_t page_cnt) 
 {
+  enum intr_level old_level;
   struct pool *pool;
-  size_t page_idx;
+  size_t page_idx, i;
 
   ASSERT (pg_ofs (pages) == 0);
   if (pages == NULL || page_cnt == 0)
     return;
+  if (memtrack_enabled)
+    memtrack_free (pages);
 
   if (page_from_pool (&kernel_pool, pages))
     pool = &kernel_pool;
@@ -132,13 +193,30 @@ palloc_free_multiple (void *pages, size_t page_cnt)
     NOT_REACHED ();
 
   page_idx = pg_no (pages) - pg_no (pool->base);
+  count_used (pool, -(int) page_cnt);
 
 #ifndef NDEBUG
   memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
 
+  if (page_cnt == 1)
+    {
+      /* Nobody else may change the used_map bit or order_map
+         entry for a page in use, so they can be checked without
+         the lock. */
+      ASSERT (bitmap_test (pool->used_map, page_idx));
+      ASSERT (pool->order_map[page_idx] == NOT_FREE);
+      cache_put (pool, pages);
+      return;
+    }
+
+  old_level = spinlock_acquire_irqsave (&pool->lock);
   ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
+  for (i = 0; i < page_cnt; i++)
+    ASSERT (pool->order_map[page_idx + i] == NOT_FREE);
   bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+  free_pages (pool, page_idx, page_cnt);
+  spinlock_release_irqrestore (&pool->lock, old_level);
 }
 
 /* Frees the page at PAGE. */
@@ -148,25 +226,104 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Prints statistics about the pools: how fragmented their free
+   memory is, and their locks. */
+void
+palloc_print_stats (void) 
+{
+  print_pool ("kernel pool", &kernel_pool);
+  print_pool ("user pool", &user_pool);
+  spinlock_print_stats (&kernel_pool.lock);
+  spinlock_print_stats (&user_pool.lock);
+}
+
+/* Does the work of palloc_get_multiple() for CALLER, charging
+   the pages to TAG if it is nonnull. */
+static void *
+get_multiple (enum palloc_flags flags, size_t page_cnt,
+              const char *tag, void *caller)
+{
+  struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+  void *pages;
+  size_t page_idx;
+
+  if (page_cnt == 0)
+    return NULL;
+
+  if (page_cnt == 1)
+    {
+      pages = cache_get (pool);
+      if (pages == NULL && cache_reclaim (pool))
+        pages = cache_get (pool);
+    }
+  else
+    {
+      page_idx = alloc_pages_locked (pool, page_cnt);
+      if (page_idx == BITMAP_ERROR && cache_reclaim (pool))
+        page_idx = alloc_pages_locked (pool, page_cnt);
+
+      if (page_idx != BITMAP_ERROR)
+        pages = pool->base + PGSIZE * page_idx;
+      else
+        pages = NULL;
+    }
+
+  if (pages != NULL) 
+    {
+      count_used (pool, page_cnt);
+      if (flags & PAL_ZERO)
+        memset (pages, 0, PGSIZE * page_cnt);
+      if (memtrack_enabled)
+        memtrack_alloc (MEMTRACK_PALLOC, pages, PGSIZE * page_cnt,
+                        tag, caller);
+    }
+  else 
+    {
+      if (flags & PAL_ASSERT)
+        PANIC ("palloc_get: out of pages");
+    }
+
+  return pages;
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
 init_pool (struct pool *p, void *base, size_t page_cnt, const char *name) 
 {
-  /* We'll put the pool's used_map at its base.
-     Calculate the space needed for the bitmap
-     and subtract it from the pool's size. */
-  size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (page_cnt), PGSIZE);
-  if (bm_pages > page_cnt)
+  size_t bm_size, meta_pages;
+  unsigned i;
+  int order;
+
+  /* We'll put the pool's used_map and order_map at its base.
+     Calculate the space needed for them and subtract it from the
+     pool's size. */
+  bm_size = ROUND_UP (bitmap_buf_size (page_cnt), sizeof (uint32_t));
+  meta_pages = DIV_ROUND_UP (bm_size + page_cnt, PGSIZE);
+  if (meta_pages > page_cnt)
     PANIC ("Not enough memory in %s for bitmap.", name);
-  page_cnt -= bm_pages;
+  page_cnt -= meta_pages;
 
   printf ("%zu pages available in %s.\n", page_cnt, name);
 
-  /* Initialize the pool. */
-  lock_init (&p->lock);
-  p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
-  p->base = base + bm_pages * PGSIZE;
+  /* Initialize the pool, with all of its pages free. */
+  spinlock_init (&p->lock, name);
+  p->used_map = bitmap_create_in_buf (page_cnt, base, bm_size);
+  p->order_map = (uint8_t *) base + bm_size;
+  memset (p->order_map, NOT_FREE, page_cnt);
+  p->base = base + meta_pages * PGSIZE;
+  p->page_cnt = page_cnt;
+  p->free_cnt = 0;
+  for (order = 0; order <= MAX_ORDER; order++)
+    list_init (&p->free[order]);
+  p->nonempty = 0;
+  for (i = 0; i < CPU_MAX; i++)
+    {
+      spinlock_init (&p->caches[i].lock, name);
+      p->caches[i].magazine.cnt = 0;
+    }
+  free_pages (p, 0, page_cnt);
+  p->used_cnt = p->peak_used_cnt = 0;
 }
 
 /* Returns true if PAGE was allocated from POOL,
@@ -180,3 +337,284 @@ page_from_pool (const struct pool *pool, void *page)
 
   return page_no >= start_page && page_no < end_page;
 }
+
+/* Takes PAGE_CNT contiguous pages out of POOL's free lists and
+   marks them used.  Returns the index of the first page, or
+   BITMAP_ERROR if POOL has no free block large enough.  POOL's
+   lock must be held. */
+static size_t
+alloc_pages (struct pool *pool, size_t page_cnt)
+{
+  int need, order;
+  uint32_t orders;
+  size_t page_idx;
+
+  /* Find the smallest nonempty free list that fits. */
+  ASSERT (page_cnt > 0);
+  if (page_cnt > (size_t) 1 << MAX_ORDER)
+    return BITMAP_ERROR;
+  need = page_cnt > 1 ? 32 - __builtin_clz (page_cnt - 1) : 0;
+  orders = pool->nonempty & ~((1u << need) - 1);
+  if (orders == 0)
+    return BITMAP_ERROR;
+  order = __builtin_ctz (orders);
+
+  /* Take its first block. */
+  page_idx = pg_no (list_pop_front (&pool->free[order])) - pg_no (pool->base);
+  if (list_empty (&pool->free[order]))
+    pool->nonempty &= ~(1u << order);
+  pool->order_map[page_idx] = NOT_FREE;
+  pool->free_cnt -= (size_t) 1 << order;
+
+  /* Split it down to the order we need, freeing the upper
+     halves, which cannot merge with anything. */
+  while (order > need)
+    {
+      order--;
+      free_block (pool, page_idx + ((size_t) 1 << order), order);
+    }
+
+  /* Give back the pages past PAGE_CNT. */
+  if (page_cnt < (size_t) 1 << order)
+    free_pages (pool, page_idx + page_cnt, ((size_t) 1 << order) - page_cnt);
+
+  bitmap_set_multiple (pool->used_map, page_idx, page_cnt, true);
+  return page_idx;
+}
+
+/* Like alloc_pages(), but takes POOL's lock itself. */
+static size_t
+alloc_pages_locked (struct pool *pool, size_t page_cnt)
+{
+  enum intr_level old_level;
+  size_t page_idx;
+
+  old_level = spinlock_acquire_irqsave (&pool->lock);
+  page_idx = alloc_pages (pool, page_cnt);
+  spinlock_release_irqrestore (&pool->lock, old_level);
+  return page_idx;
+}
+
+/* Puts the PAGE_CNT pages starting at index PAGE_IDX in POOL,
+   which are not in any free block, back onto POOL's free lists,
+   as the fewest aligned blocks that cover them.  POOL's lock
+   must be held. */
+static void
+free_pages (struct pool *pool, size_t page_idx, size_t page_cnt)
+{
+  while (page_cnt > 0)
+    {
+      int order = page_idx != 0 ? __builtin_ctz (page_idx) : MAX_ORDER;
+
+      if (order > MAX_ORDER)
+        order = MAX_ORDER;
+      while (((size_t) 1 << order) > page_cnt)
+        order--;
+      free_block (pool, page_idx, order);
+      page_idx += (size_t) 1 << order;
+      page_cnt -= (size_t) 1 << order;
+    }
+}
+
+/* Adds the block of 2**ORDER pages starting at index PAGE_IDX in
+   POOL to POOL's free lists, merging it with its buddy for as
+   long as the buddy is free.  POOL's lock must be held. */
+static void
+free_block (struct pool *pool, size_t page_idx, int order)
+{
+  pool->free_cnt += (size_t) 1 << order;
+  while (order < MAX_ORDER)
+    {
+      size_t buddy = page_idx ^ ((size_t) 1 << order);
+
+      if (buddy >= pool->page_cnt || pool->order_map[buddy] != order)
+        break;
+      list_remove (block_elem (pool, buddy));
+      if (list_empty (&pool->free[order]))
+        pool->nonempty &= ~(1u << order);
+      pool->order_map[buddy] = NOT_FREE;
+      if (buddy < page_idx)
+        page_idx = buddy;
+      order++;
+    }
+  pool->order_map[page_idx] = order;
+  list_push_front (&pool->free[order], block_elem (pool, page_idx));
+  pool->nonempty |= 1u << order;
+}
+
+/* Returns the list element that free block PAGE_IDX in POOL
+   keeps at its start. */
+static struct list_elem *
+block_elem (const struct pool *pool, size_t page_idx)
+{
+  return (struct list_elem *) (pool->base + PGSIZE * page_idx);
+}
+
+/* Returns a page from the running CPU's cache for POOL,
+   refilling the cache from POOL first if it is empty, or a null
+   pointer if POOL is out of pages too. */
+static void *
+cache_get (struct pool *pool)
+{
+  enum intr_level old_level = intr_disable ();
+  struct page_cache *pc = &pool->caches[cpu_current ()->id];
+  struct magazine *m = &pc->magazine;
+  void *page;
+
+  spinlock_acquire (&pc->lock);
+  if (m->cnt == 0)
+    {
+      spinlock_acquire (&pool->lock);
+      while (m->cnt < MAGAZINE_BATCH)
+        {
+          size_t page_idx = alloc_pages (pool, 1);
+          if (page_idx == BITMAP_ERROR)
+            break;
+          pool->order_map[page_idx] = CACHED;
+          magazine_push (m, pool->base + PGSIZE * page_idx);
+        }
+      spinlock_release (&pool->lock);
+    }
+  page = magazine_pop (m);
+  if (page != NULL)
+    pool->order_map[pg_no (page) - pg_no (pool->base)] = NOT_FREE;
+  spinlock_release (&pc->lock);
+  intr_set_level (old_level);
+  return page;
+}
+
+/* Puts PAGE, a used page from POOL, into the running CPU's cache
+   for POOL, first giving back the cache's coldest pages to POOL
+   if it is full. */
+static void
+cache_put (struct pool *pool, void *page)
+{
+  enum intr_level old_level = intr_disable ();
+  struct page_cache *pc = &pool->caches[cpu_current ()->id];
+
+  spinlock_acquire (&pc->lock);
+  if (magazine_full (&pc->magazine))
+    {
+      spinlock_acquire (&pool->lock);
+      cache_drain (pool, pc, MAGAZINE_BATCH);
+      spinlock_release (&pool->lock);
+    }
+  pool->order_map[pg_no (page) - pg_no (pool->base)] = CACHED;
+  magazine_push (&pc->magazine, page);
+  spinlock_release (&pc->lock);
+  intr_set_level (old_level);
+}
+
+/* Frees the CNT coldest pages in cache PC back into POOL.  PC's
+   lock and then POOL's lock must be held. */
+static void
+cache_drain (struct pool *pool, struct page_cache *pc, unsigned cnt)
+{
+  void *pages[MAGAZINE_SIZE];
+  unsigned i;
+
+  magazine_take_cold (&pc->magazine, pages, cnt);
+  for (i = 0; i < cnt; i++)
+    {
+      size_t page_idx = pg_no (pages[i]) - pg_no (pool->base);
+
+      ASSERT (pool->order_map[page_idx] == CACHED);
+      pool->order_map[page_idx] = NOT_FREE;
+      bitmap_reset (pool->used_map, page_idx);
+      free_pages (pool, page_idx, 1);
+    }
+}
+
+/* Frees the pages in every CPU's cache for POOL back into POOL,
+   for a request that POOL could not satisfy.  Returns true if
+   there were any. */
+static bool
+cache_reclaim (struct pool *pool)
+{
+  enum intr_level old_level = intr_disable ();
+  bool reclaimed = false;
+  unsigned i;
+
+  for (i = 0; i < cpu_cnt; i++)
+    {
+      struct page_cache *pc = &pool->caches[i];
+
+      spinlock_acquire (&pc->lock);
+      if (pc->magazine.cnt > 0)
+        {
+          spinlock_acquire (&pool->lock);
+          cache_drain (pool, pc, pc->magazine.cnt);
+          spinlock_release (&pool->lock);
+          reclaimed = true;
+        }
+      spinlock_release (&pc->lock);
+    }
+  intr_set_level (old_level);
+  return reclaimed;
+}
+
+/* Adds PAGE_CNT, which may be negative, to the number of
+   POOL's pages held by callers, and updates its maximum.  Pages
+   in magazines do not count.  Single pages come and go without
+   POOL's lock, so this uses atomic operations instead. */
+static void
+count_used (struct pool *pool, int page_cnt)
+{
+  size_t used = page_cnt;
+  size_t peak;
+
+  asm volatile ("lock xaddl %0, %1"
+                : "+r" (used), "+m" (pool->used_cnt) : : "memory");
+  used += page_cnt;
+  for (peak = pool->peak_used_cnt; used > peak; )
+    {
+      size_t prev;
+      asm volatile ("lock cmpxchgl %2, %1"
+                    : "=a" (prev), "+m" (pool->peak_used_cnt)
+                    : "r" (used), "0" (peak)
+                    : "memory");
+      if (prev == peak)
+        break;
+      peak = prev;
+    }
+}
+
+/* Prints how fragmented POOL's free memory is: how many free
+   blocks it has of each order, and how large a request could
+   still succeed compared to how many pages are free.  Also
+   prints the most pages that callers have held from POOL at
+   once, which is a guide for sizing the user pool with -ul. */
+static void
+print_pool (const char *name, struct pool *pool)
+{
+  enum intr_level old_level;
+  size_t blocks[MAX_ORDER + 1];
+  size_t free_cnt, cached_cnt = 0;
+  unsigned i;
+  int order, top = -1;
+
+  old_level = spinlock_acquire_irqsave (&pool->lock);
+  for (order = 0; order <= MAX_ORDER; order++)
+    {
+      blocks[order] = list_size (&pool->free[order]);
+      if (blocks[order] > 0)
+        top = order;
+    }
+  free_cnt = pool->free_cnt;
+  spinlock_release_irqrestore (&pool->lock, old_level);
+  for (i = 0; i < cpu_cnt; i++)
+    cached_cnt += pool->caches[i].magazine.cnt;
+
+  printf ("%s: %zu of %zu pages free, %zu cached by CPUs, "
+          "largest free block %zu pages\n",
+          name, free_cnt, pool->page_cnt, cached_cnt,
+          top >= 0 ? (size_t) 1 << top : 0);
+  printf ("  %zu pages in use, peak %zu\n",
+          pool->used_cnt, pool->peak_used_cnt);
+  if (top < 0)
+    return;
+  printf ("  free blocks by order:");
+  for (order = 0; order <= top; order++)
+    printf (" %zu", blocks[order]);
+  printf ("\n");
+}
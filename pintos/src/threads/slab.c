@@ -0,0 +1,415 @@
+#include "threads/slab.h"
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/interrupt.h"
+#include "threads/magazine.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/smp.h"
+#include "threads/spinlock.h"
+#include "threads/vaddr.h"
+
+/* Slab allocator.
+
+   malloc() rounds every request up to a power of 2, which wastes
+   up to half of each block: a 536-byte struct inode takes a
+   1 kB block.  An object cache hands out objects of a single
+   size instead, packed as tightly as their alignment allows, from
+   pages called "slabs".  See Bonwick, "The Slab Allocator: An
+   Object-Caching Kernel Memory Allocator", USENIX Summer 1994.
+
+   Each slab is one page.  It begins with a header, followed by
+   an array with one index per object that links the slab's free
+   objects together, followed by the objects themselves.  Keeping
+   the free list outside the objects lets a cache with a
+   constructor hand back objects still in the state the
+   constructor left them in, and lets free objects of any cache
+   be poisoned in debug builds.
+
+   The bytes left over at the end of a slab are put to use by
+   "coloring": each new slab starts its objects a cache line
+   further along than the previous one, wrapping around when the
+   leftover space runs out, so that the same object in different
+   slabs does not always land in the same cache set.
+
+   A cache keeps its slabs on three lists: partial, full, and
+   empty.  Objects are taken from partial slabs first, so that
+   empty ones stay empty.  At most KMEM_EMPTY_MAX empty slabs are
+   kept; beyond that, a slab whose last object is freed goes back
+   to the page allocator.
+
+   Each CPU has a magazine of free objects per cache in front of
+   the slabs (see magazine.h), which only that CPU touches, with
+   interrupts off, so kmem_cache_alloc() and kmem_cache_free()
+   usually take no lock. */
+
+/* Max empty slabs kept per cache. */
+#define KMEM_EMPTY_MAX 1
+
+/* Distance between slab colors, in bytes. */
+#define KMEM_COLOR_STEP 64
+
+/* Magic number for detecting slab corruption. */
+#define SLAB_MAGIC 0x51ab51ab
+
+/* End of a slab's free list. */
+#define SLAB_END 0xffff
+
+/* An object cache. */
+struct kmem_cache
+  {
+    char name[16];                      /* Name, for statistics. */
+    size_t obj_size;                    /* Object size, rounded up to
+                                           the alignment. */
+    kmem_ctor_func *ctor;               /* Constructor, or null. */
+    size_t objs_per_slab;               /* Number of objects in a slab. */
+    size_t objs_ofs;                    /* Offset of the first object in
+                                           a slab of color 0. */
+    size_t color_step;                  /* Distance between colors. */
+    size_t color_max;                   /* Largest color. */
+    size_t color_next;                  /* Color for the next slab. */
+    struct list_elem elem;              /* Element in `caches'. */
+
+    /* Protected by `lock'. */
+    struct spinlock lock;
+    struct list partial;                /* Slabs with some objects free. */
+    struct list full;                   /* Slabs with no objects free. */
+    struct list empty;                  /* Slabs with all objects free. */
+    size_t slab_cnt;                    /* Number of slabs. */
+    size_t empty_cnt;                   /* Number of slabs in `empty'. */
+    size_t in_use_cnt;                  /* Objects allocated from slabs,
+                                           including those in magazines. */
+
+    /* Each only touched by its own CPU. */
+    struct magazine magazines[CPU_MAX]; /* Per-CPU caches. */
+  };
+
+/* Slab header, at the start of each slab's page. */
+struct slab
+  {
+    unsigned magic;                     /* Always SLAB_MAGIC. */
+    struct kmem_cache *cache;           /* Owning cache. */
+    struct list_elem elem;              /* Element in cache's lists. */
+    uint8_t *objs;                      /* First object. */
+    size_t in_use;                      /* Number of allocated objects. */
+    uint16_t free;                      /* First free object, or SLAB_END. */
+    uint16_t next[];                    /* Next free object after each. */
+  };
+
+/* All caches, for statistics. */
+static struct list caches = LIST_INITIALIZER (caches);
+static struct spinlock caches_lock = { .name = "kmem caches" };
+
+static bool cache_grow (struct kmem_cache *);
+static void *slab_get (struct kmem_cache *);
+static struct slab *slab_put (struct kmem_cache *, void *obj);
+static struct slab *obj_to_slab (struct kmem_cache *, void *obj);
+
+/* Creates and returns a cache of SIZE-byte objects, each aligned
+   on an ALIGN-byte boundary, where ALIGN is a power of 2, or 0
+   for word alignment.  If CTOR is nonnull, it is called on each
+   object when the object's slab is created.  NAME is used in
+   statistics.  Returns a null pointer if memory is not
+   available.
+
+   An object and its share of the slab header must fit in a
+   page. */
+struct kmem_cache *
+kmem_cache_create (const char *name, size_t size, size_t align,
+                   kmem_ctor_func *ctor)
+{
+  struct kmem_cache *c;
+  enum intr_level old_level;
+  size_t hdr_size;
+
+  if (align == 0)
+    align = sizeof (void *);
+  ASSERT ((align & (align - 1)) == 0);
+  ASSERT (size > 0);
+
+  c = calloc (1, sizeof *c);
+  if (c == NULL)
+    return NULL;
+
+  strlcpy (c->name, name, sizeof c->name);
+  c->obj_size = ROUND_UP (size, align);
+  c->ctor = ctor;
+
+  /* Fit as many objects as possible, with their free list
+     indexes and the header, into a page. */
+  c->objs_per_slab = ((PGSIZE - sizeof (struct slab))
+                      / (c->obj_size + sizeof (uint16_t)));
+  for (;;)
+    {
+      ASSERT (c->objs_per_slab > 0);
+      hdr_size = sizeof (struct slab) + c->objs_per_slab * sizeof (uint16_t);
+      c->objs_ofs = ROUND_UP (hdr_size, align);
+      if (c->objs_ofs + c->objs_per_slab * c->obj_size <= PGSIZE)
+        break;
+      c->objs_per_slab--;
+    }
+  ASSERT (c->objs_per_slab < SLAB_END);
+
+  /* Colors are multiples of the cache line size or the alignment,
+     whichever is bigger, that fit in the leftover space. */
+  c->color_step = align > KMEM_COLOR_STEP ? align : KMEM_COLOR_STEP;
+  c->color_max = ROUND_DOWN (PGSIZE - c->objs_ofs
+                             - c->objs_per_slab * c->obj_size,
+                             c->color_step);
+  c->color_next = 0;
+
+  spinlock_init (&c->lock, c->name);
+  list_init (&c->partial);
+  list_init (&c->full);
+  list_init (&c->empty);
+
+  old_level = spinlock_acquire_irqsave (&caches_lock);
+  list_push_back (&caches, &c->elem);
+  spinlock_release_irqrestore (&caches_lock, old_level);
+  return c;
+}
+
+/* Obtains and returns an object from cache C, or a null pointer
+   if memory is not available.  If C has a constructor, the
+   object is in its constructed state, otherwise its contents are
+   undefined. */
+void *
+kmem_cache_alloc (struct kmem_cache *c)
+{
+  for (;;)
+    {
+      enum intr_level old_level = intr_disable ();
+      struct magazine *m = &c->magazines[cpu_current ()->id];
+      void *obj;
+
+      /* Refill an empty magazine from the slabs. */
+      if (m->cnt == 0)
+        {
+          spinlock_acquire (&c->lock);
+          while (m->cnt < MAGAZINE_BATCH)
+            {
+              obj = slab_get (c);
+              if (obj == NULL)
+                break;
+              magazine_push (m, obj);
+            }
+          spinlock_release (&c->lock);
+        }
+
+      obj = magazine_pop (m);
+      intr_set_level (old_level);
+      if (obj != NULL)
+        return obj;
+
+      /* Every slab is full.  Add one, with interrupts as the
+         caller had them, since the constructor runs on all of
+         its objects, then try again. */
+      if (!cache_grow (c))
+        return NULL;
+    }
+}
+
+/* Returns OBJ, which must have been obtained from cache C with
+   kmem_cache_alloc(), to C.  If C has a constructor, OBJ must be
+   in its constructed state. */
+void
+kmem_cache_free (struct kmem_cache *c, void *obj)
+{
+  struct slab *victims[MAGAZINE_BATCH];
+  unsigned victim_cnt = 0;
+  enum intr_level old_level;
+  struct magazine *m;
+
+  if (obj == NULL)
+    return;
+  ASSERT (obj_to_slab (c, obj) != NULL);
+
+#ifndef NDEBUG
+  /* Clear the object to help detect use-after-free bugs, unless
+     it has to stay constructed. */
+  if (c->ctor == NULL)
+    memset (obj, 0xcc, c->obj_size);
+#endif
+
+  old_level = intr_disable ();
+  m = &c->magazines[cpu_current ()->id];
+  if (magazine_full (m))
+    {
+      void *batch[MAGAZINE_BATCH];
+      unsigned i;
+
+      /* Give back the coldest objects.  Slabs that this leaves
+         empty are freed once we drop the lock. */
+      magazine_take_cold (m, batch, MAGAZINE_BATCH);
+      spinlock_acquire (&c->lock);
+      for (i = 0; i < MAGAZINE_BATCH; i++)
+        {
+          struct slab *s = slab_put (c, batch[i]);
+          if (s != NULL)
+            victims[victim_cnt++] = s;
+        }
+      spinlock_release (&c->lock);
+    }
+  magazine_push (m, obj);
+  intr_set_level (old_level);
+
+  while (victim_cnt > 0)
+    palloc_free_page (victims[--victim_cnt]);
+}
+
+/* Prints statistics about each cache. */
+void
+kmem_cache_print_stats (void)
+{
+  struct list_elem *e;
+  enum intr_level old_level;
+
+  old_level = spinlock_acquire_irqsave (&caches_lock);
+  for (e = list_begin (&caches); e != list_end (&caches); e = list_next (e))
+    {
+      struct kmem_cache *c = list_entry (e, struct kmem_cache, elem);
+      size_t slab_cnt, in_use_cnt, cached_cnt = 0;
+      unsigned i;
+
+      spinlock_acquire (&c->lock);
+      slab_cnt = c->slab_cnt;
+      in_use_cnt = c->in_use_cnt;
+      spinlock_release (&c->lock);
+      for (i = 0; i < cpu_cnt; i++)
+        cached_cnt += c->magazines[i].cnt;
+
+      printf ("Slab cache %s: %zu of %zu %zu-byte objects in use, "
+              "%zu cached by CPUs, %zu slabs\n",
+              c->name, in_use_cnt - cached_cnt,
+              slab_cnt * c->objs_per_slab, c->obj_size, cached_cnt,
+              slab_cnt);
+    }
+  spinlock_release_irqrestore (&caches_lock, old_level);
+}
+
+/* Adds a new, empty slab to cache C, constructing its objects.
+   Returns true if successful, false if out of memory. */
+static bool
+cache_grow (struct kmem_cache *c)
+{
+  enum intr_level old_level;
+  struct slab *s;
+  size_t color, i;
+
+  s = palloc_get_tagged (0, 1, "slab");
+  if (s == NULL)
+    return false;
+
+  old_level = spinlock_acquire_irqsave (&c->lock);
+  color = c->color_next;
+  c->color_next = (color + c->color_step <= c->color_max
+                   ? color + c->color_step : 0);
+  spinlock_release_irqrestore (&c->lock, old_level);
+
+  /* Build the slab, with all of its objects on its free list. */
+  s->magic = SLAB_MAGIC;
+  s->cache = c;
+  s->objs = (uint8_t *) s + c->objs_ofs + color;
+  s->in_use = 0;
+  s->free = 0;
+  for (i = 0; i < c->objs_per_slab; i++)
+    {
+      s->next[i] = i + 1 < c->objs_per_slab ? i + 1 : SLAB_END;
+      if (c->ctor != NULL)
+        c->ctor (s->objs + i * c->obj_size);
+    }
+
+  old_level = spinlock_acquire_irqsave (&c->lock);
+  list_push_front (&c->empty, &s->elem);
+  c->empty_cnt++;
+  c->slab_cnt++;
+  spinlock_release_irqrestore (&c->lock, old_level);
+  return true;
+}
+
+/* Takes a free object from one of cache C's slabs, preferring a
+   partial slab, and returns it, or a null pointer if every slab
+   is full.  C's lock must be held. */
+static void *
+slab_get (struct kmem_cache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  if (!list_empty (&c->partial))
+    s = list_entry (list_front (&c->partial), struct slab, elem);
+  else if (!list_empty (&c->empty))
+    {
+      s = list_entry (list_pop_front (&c->empty), struct slab, elem);
+      list_push_front (&c->partial, &s->elem);
+      c->empty_cnt--;
+    }
+  else
+    return NULL;
+
+  ASSERT (s->free != SLAB_END);
+  obj = s->objs + s->free * c->obj_size;
+  s->free = s->next[s->free];
+  s->in_use++;
+  c->in_use_cnt++;
+  if (s->free == SLAB_END)
+    {
+      list_remove (&s->elem);
+      list_push_front (&c->full, &s->elem);
+    }
+  return obj;
+}
+
+/* Puts OBJ back on its slab's free list in cache C.  If that
+   leaves the slab empty and C already has KMEM_EMPTY_MAX empty
+   slabs, removes the slab from C and returns it, for the caller
+   to free once it drops C's lock.  Otherwise returns a null
+   pointer.  C's lock must be held. */
+static struct slab *
+slab_put (struct kmem_cache *c, void *obj)
+{
+  struct slab *s = obj_to_slab (c, obj);
+  size_t idx = ((uint8_t *) obj - s->objs) / c->obj_size;
+
+  ASSERT (s->in_use > 0);
+
+  if (s->free == SLAB_END)
+    {
+      list_remove (&s->elem);
+      list_push_front (&c->partial, &s->elem);
+    }
+  s->next[idx] = s->free;
+  s->free = idx;
+  s->in_use--;
+  c->in_use_cnt--;
+
+  if (s->in_use == 0)
+    {
+      list_remove (&s->elem);
+      if (c->empty_cnt >= KMEM_EMPTY_MAX)
+        {
+          c->slab_cnt--;
+          return s;
+        }
+      list_push_front (&c->empty, &s->elem);
+      c->empty_cnt++;
+    }
+  return NULL;
+}
+
+/* Returns the slab that OBJ, an object of cache C, is in. */
+static struct slab *
+obj_to_slab (struct kmem_cache *c, void *obj)
+{
+  struct slab *s = pg_round_down (obj);
+
+  ASSERT (s->magic == SLAB_MAGIC);
+  ASSERT (s->cache == c);
+  ASSERT ((uint8_t *) obj >= s->objs);
+  ASSERT (((uint8_t *) obj - s->objs) % c->obj_size == 0);
+  return s;
+}
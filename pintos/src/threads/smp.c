@@ -0,0 +1,320 @@
+#include "threads/smp.h"
+#include <debug.h>
+#include <packed.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/lapic.h"
+#include "devices/timer.h"
+#include "threads/init.h"
+#include "threads/interrupt.h"
+#include "threads/palloc.h"
+#include "threads/pte.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#ifdef USERPROG
+#include "userprog/gdt.h"
+#endif
+
+/* Symmetric multiprocessing support.
+
+   The BIOS describes the CPUs in the machine in the tables
+   defined by the Intel MultiProcessor Specification [MPSPEC].
+   smp_init() finds them there and brings up each application
+   processor (AP) in turn by sending it INIT and start-up IPIs
+   through the local APIC.  Each AP runs ap-start.S, then
+   ap_main(), which turns the AP's boot stack into the AP's idle
+   thread.  From then on the AP schedules threads from its own
+   run queue, stealing from the other CPUs' queues when it has
+   nothing to do (see thread.c). */
+
+/* All CPUs, with the bootstrap processor first. */
+struct cpu cpus[CPU_MAX];
+
+/* Number of CPUs in cpus[] that have started. */
+unsigned cpu_cnt = 1;
+
+/* MP floating pointer structure.  See [MPSPEC] 4.1. */
+struct mp_float
+  {
+    char signature[4];          /* "_MP_". */
+    uint32_t config_paddr;      /* Physical address of MP config table. */
+    uint8_t length;             /* Length in 16-byte units. */
+    uint8_t version;            /* MP specification revision. */
+    uint8_t checksum;           /* All bytes must add up to 0. */
+    uint8_t features[5];        /* Nonzero features[0]: default config. */
+  }
+PACKED;
+
+/* MP configuration table header.  See [MPSPEC] 4.2. */
+struct mp_config
+  {
+    char signature[4];          /* "PCMP". */
+    uint16_t length;            /* Length of base table, in bytes. */
+    uint8_t version;            /* MP specification revision. */
+    uint8_t checksum;           /* All bytes must add up to 0. */
+    char oem_id[8];             /* System manufacturer. */
+    char product_id[12];        /* Product family. */
+    uint32_t oem_table_paddr;   /* OEM-defined table, optional. */
+    uint16_t oem_table_size;    /* Size of OEM-defined table. */
+    uint16_t entry_cnt;         /* Number of entries after header. */
+    uint32_t lapic_paddr;       /* Physical address of local APICs. */
+    uint16_t ext_length;        /* Length of extended entries. */
+    uint8_t ext_checksum;       /* Checksum of extended entries. */
+    uint8_t reserved;
+  }
+PACKED;
+
+/* MP configuration table processor entry.  See [MPSPEC] 4.3.1.
+   All other entry types are 8 bytes long. */
+struct mp_proc
+  {
+    uint8_t type;               /* MP_PROC. */
+    uint8_t lapic_id;           /* Local APIC ID. */
+    uint8_t lapic_version;      /* Local APIC version. */
+    uint8_t flags;              /* MP_PROC_* flags. */
+    uint32_t signature;         /* CPU stepping, model, family. */
+    uint32_t features;          /* CPUID feature flags. */
+    uint32_t reserved[2];
+  }
+PACKED;
+
+#define MP_PROC 0               /* Processor entry type. */
+#define MP_PROC_ENABLED 0x01    /* Processor is usable. */
+#define MP_OTHER_SIZE 8         /* Size of non-processor entries. */
+
+/* Start-up code in ap-start.S. */
+extern uint8_t ap_trampoline[], ap_trampoline_end[];
+extern uint32_t ap_boot_cr3, ap_boot_esp, ap_boot_entry;
+
+/* CPU that ap_main() should set up. */
+static struct cpu *volatile booting_cpu;
+
+static struct mp_float *mp_search (void);
+static struct mp_config *mp_get_config (const struct mp_float *);
+static bool start_ap (struct cpu *, uint32_t *boot_pd);
+static void ap_main (void) NO_RETURN;
+static intr_handler_func lapic_timer_interrupt;
+static intr_handler_func resched_interrupt;
+
+/* Finds the application processors and starts up to MAX_CPUS
+   CPUs in total, including the bootstrap processor.  Must be
+   called with interrupts on, after the timer is calibrated.  If
+   the machine has only one CPU, or if its MP tables can't be
+   found, does nothing. */
+void
+smp_init (unsigned max_cpus)
+{
+  struct mp_float *mp;
+  struct mp_config *conf;
+  uint8_t ap_ids[CPU_MAX];
+  unsigned ap_cnt = 0;
+  uint8_t *entry;
+  uint32_t *boot_pd;
+  unsigned i;
+
+  ASSERT (intr_get_level () == INTR_ON);
+
+  if (max_cpus > CPU_MAX)
+    max_cpus = CPU_MAX;
+  mp = mp_search ();
+  if (max_cpus <= 1 || mp == NULL)
+    return;
+  conf = mp_get_config (mp);
+  if (conf == NULL)
+    return;
+
+  /* Enable our own local APIC, then collect the others. */
+  lapic_init (conf->lapic_paddr);
+  cpu_bsp ()->lapic_id = lapic_id ();
+  entry = (uint8_t *) (conf + 1);
+  for (i = 0; i < conf->entry_cnt; i++)
+    if (*entry == MP_PROC)
+      {
+        struct mp_proc *proc = (struct mp_proc *) entry;
+        if ((proc->flags & MP_PROC_ENABLED)
+            && proc->lapic_id != cpu_bsp ()->lapic_id
+            && ap_cnt + 1 < max_cpus)
+          ap_ids[ap_cnt++] = proc->lapic_id;
+        entry += sizeof *proc;
+      }
+    else
+      entry += MP_OTHER_SIZE;
+  if (ap_cnt == 0)
+    return;
+
+  intr_register_ext (LAPIC_VEC_TIMER, lapic_timer_interrupt,
+                     "Local APIC Timer");
+  intr_register_ext (LAPIC_VEC_RESCHED, resched_interrupt,
+                     "Reschedule IPI");
+  lapic_timer_calibrate ();
+
+  /* Copy the start-up code into low memory.  While it runs, the
+     APs need an identity mapping of that memory in addition to
+     the kernel mappings. */
+  memcpy (ptov (AP_TRAMPOLINE), ap_trampoline,
+          ap_trampoline_end - ap_trampoline);
+  boot_pd = palloc_get_page (PAL_ASSERT);
+  memcpy (boot_pd, init_page_dir, PGSIZE);
+  boot_pd[0] = init_page_dir[pd_no (PHYS_BASE)];
+
+  for (i = 0; i < ap_cnt; i++)
+    {
+      struct cpu *c = &cpus[cpu_cnt];
+      c->id = cpu_cnt;
+      c->lapic_id = ap_ids[i];
+      if (start_ap (c, boot_pd))
+        cpu_cnt++;
+      else
+        printf ("CPU with local APIC ID %u failed to start.\n",
+                ap_ids[i]);
+    }
+  palloc_free_page (boot_pd);
+
+  printf ("%u CPUs online.\n", cpu_cnt);
+}
+
+/* Returns the address in the copy of the start-up code at
+   AP_TRAMPOLINE of SYM, a symbol within the original. */
+static void *
+trampoline_addr (void *sym)
+{
+  return (uint8_t *) ptov (AP_TRAMPOLINE) + ((uint8_t *) sym - ap_trampoline);
+}
+
+/* Starts application processor C using page directory BOOT_PD
+   and waits for it to finish booting.  Returns true if
+   successful, false if the CPU did not respond. */
+static bool
+start_ap (struct cpu *c, uint32_t *boot_pd)
+{
+  /* The AP boots on its idle thread's stack, just as the
+     bootstrap processor booted on the initial thread's. */
+  struct thread *idle = thread_create_ap_idle (c);
+  int ms;
+
+  if (idle == NULL)
+    return false;
+  *(uint32_t *) trampoline_addr (&ap_boot_cr3) = vtop (boot_pd);
+  *(uint32_t *) trampoline_addr (&ap_boot_esp) = (uint32_t) idle->stack;
+  *(uint32_t *) trampoline_addr (&ap_boot_entry) = (uint32_t) ap_main;
+  booting_cpu = c;
+
+  /* See [IA32-v3a] 8.4.4 "MP Initialization Example". */
+  lapic_send_init (c->lapic_id);
+  lapic_send_startup (c->lapic_id, AP_TRAMPOLINE);
+  lapic_send_startup (c->lapic_id, AP_TRAMPOLINE);
+
+  for (ms = 0; ms < 100 && !c->started; ms++)
+    timer_mdelay (1);
+
+  /* If the AP did not start, it might still be running on its
+     idle thread's stack, so we can't free it. */
+  return c->started;
+}
+
+/* Entered by each application processor from ap-start.S, with
+   interrupts off, on the stack of its idle thread. */
+static void
+ap_main (void)
+{
+  struct cpu *c = booting_cpu;
+
+  /* Drop the identity mapping used by the start-up code. */
+  asm volatile ("movl %0, %%cr3" : : "r" (vtop (init_page_dir)) : "memory");
+
+#ifdef USERPROG
+  gdt_init_ap (c->id);
+#endif
+  intr_init_ap ();
+  lapic_init_ap ();
+  lapic_timer_start ();
+
+  c->started = true;
+  thread_idle_ap ();
+}
+
+/* Returns the sum of the SIZE bytes starting at P, which must be
+   0 for a valid MP structure. */
+static uint8_t
+checksum (const void *p, size_t size)
+{
+  const uint8_t *bytes = p;
+  uint8_t sum = 0;
+
+  while (size-- > 0)
+    sum += *bytes++;
+  return sum;
+}
+
+/* Looks for the MP floating pointer structure in the SIZE bytes
+   of physical memory starting at PADDR. */
+static struct mp_float *
+mp_search_range (uintptr_t paddr, size_t size)
+{
+  uint8_t *p = ptov (paddr);
+  uint8_t *end = p + size;
+
+  for (; p + sizeof (struct mp_float) <= end; p += 16)
+    if (!memcmp (p, "_MP_", 4) && checksum (p, sizeof (struct mp_float)) == 0)
+      return (struct mp_float *) p;
+  return NULL;
+}
+
+/* Finds the MP floating pointer structure, which must be in the
+   first kB of the extended BIOS data area, in the last kB of
+   base memory, or in the BIOS ROM.  See [MPSPEC] 4. */
+static struct mp_float *
+mp_search (void)
+{
+  const uint8_t *bda = ptov (0x400);
+  uintptr_t ebda = *(const uint16_t *) (bda + 0x0e) << 4;
+  uintptr_t base_end = *(const uint16_t *) (bda + 0x13) * 1024;
+  struct mp_float *mp = NULL;
+
+  if (ebda != 0)
+    mp = mp_search_range (ebda, 1024);
+  if (mp == NULL && base_end >= 1024)
+    mp = mp_search_range (base_end - 1024, 1024);
+  if (mp == NULL)
+    mp = mp_search_range (0xf0000, 0x10000);
+  return mp;
+}
+
+/* Returns the MP configuration table that MP points to, or a
+   null pointer if there is none we can use.  We don't support
+   the "default configurations", which describe only two CPUs
+   and are not used by any machine we run on. */
+static struct mp_config *
+mp_get_config (const struct mp_float *mp)
+{
+  struct mp_config *conf;
+  uintptr_t ram_end = (uintptr_t) init_ram_pages * PGSIZE;
+
+  if (mp->features[0] != 0 || mp->config_paddr == 0
+      || mp->config_paddr + sizeof *conf > ram_end)
+    return NULL;
+
+  conf = ptov (mp->config_paddr);
+  if (memcmp (conf->signature, "PCMP", 4)
+      || mp->config_paddr + conf->length > ram_end
+      || checksum (conf, conf->length) != 0)
+    return NULL;
+  return conf;
+}
+
+/* Local APIC timer interrupt handler.  The bootstrap processor
+   is driven by the 8254 timer instead (see timer.c), so this
+   only runs on application processors. */
+static void
+lapic_timer_interrupt (struct intr_frame *args UNUSED)
+{
+  thread_tick ();
+}
+
+/* Reschedule IPI handler.  Another CPU made a thread ready on our
+   run queue that outranks the thread we are running. */
+static void
+resched_interrupt (struct intr_frame *args UNUSED)
+{
+  intr_yield_on_return ();
+}
@@ -0,0 +1,66 @@
+#ifndef THREADS_SMP_H
+#define THREADS_SMP_H
+
+/* Maximum number of CPUs supported. */
+#define CPU_MAX 8
+
+/* Physical address of the application processor start-up code.
+   Must be page-aligned and below 1 MB.  This page lies between
+   the loader and the initial thread's stack at 0xe000, and
+   nothing else uses it once the kernel is running. */
+#define AP_TRAMPOLINE 0x8000
+
+/* Number of freed thread pages that each CPU keeps for reuse. */
+#define THREAD_CACHE_SIZE 4
+
+#ifndef __ASSEMBLER__
+#include <stdbool.h>
+#include <stdint.h>
+#include "threads/spinlock.h"
+
+/* Per-CPU state.
+
+   cpus[0] is always the bootstrap processor (BSP), the CPU that
+   ran the loader and main().  The application processors (APs)
+   follow in the order the BIOS lists them.  Most members are
+   only touched by their own CPU with interrupts off. */
+struct cpu
+  {
+    unsigned id;                        /* Index into cpus[]. */
+    uint8_t lapic_id;                   /* Local APIC ID. */
+    volatile bool started;              /* Finished booting? */
+
+    /* Owned by thread.c. */
+    struct thread *idle_thread;         /* This CPU's idle thread. */
+    struct thread *running;             /* Thread running on this CPU. */
+    unsigned thread_ticks;              /* Timer ticks since last yield. */
+    long long idle_ticks;               /* # of timer ticks spent idle. */
+    long long kernel_ticks;             /* # of timer ticks in kernel threads. */
+    long long user_ticks;               /* # of timer ticks in user programs. */
+    long long schedule_cnt;             /* # of calls to schedule(). */
+    long long switch_cnt;               /* # of thread switches. */
+    struct thread *thread_cache[THREAD_CACHE_SIZE]; /* Freed thread pages. */
+    unsigned thread_cache_cnt;          /* Number of pages in thread_cache. */
+    struct spinlock thread_cache_lock;  /* Protects thread_cache. */
+
+    /* Owned by devices/timer.c. */
+    bool tickless;                      /* Timer stopped while idle? */
+
+    /* Owned by interrupt.c. */
+    bool in_external_intr;              /* Processing external interrupt? */
+    bool intr_from_user;                /* ...that interrupted user mode? */
+    bool yield_on_return;               /* Yield on interrupt return? */
+  };
+
+extern struct cpu cpus[CPU_MAX];
+extern unsigned cpu_cnt;
+
+/* Returns the bootstrap processor. */
+#define cpu_bsp() (&cpus[0])
+
+struct cpu *cpu_current (void);
+
+void smp_init (unsigned max_cpus);
+#endif
+
+#endif /* threads/smp.h */
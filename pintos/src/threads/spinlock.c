@@ -0,0 +1,161 @@
+#include "threads/spinlock.h"
+#include <debug.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include "threads/smp.h"
+#include "threads/tsc.h"
+
+/* Ticket halves of struct spinlock's `tickets' member. */
+#define TICKET_SHIFT 16
+#define SERVING(TICKETS) ((uint16_t) (TICKETS))
+#define NEXT(TICKETS) ((uint16_t) ((TICKETS) >> TICKET_SHIFT))
+
+/* Initializes LOCK as unlocked, naming it NAME for debugging
+   purposes. */
+void
+spinlock_init (struct spinlock *lock, const char *name)
+{
+  ASSERT (lock != NULL);
+
+  lock->tickets = 0;
+  lock->cpu = NULL;
+  lock->name = name;
+  lock->acquire_cnt = 0;
+  lock->contended_cnt = 0;
+  lock->hold_cycles = 0;
+  lock->max_hold_cycles = 0;
+  lock->acquired_at = 0;
+}
+
+/* Records that the running CPU now holds LOCK. */
+static void
+mark_acquired (struct spinlock *lock)
+{
+  lock->cpu = cpu_current ();
+  lock->acquire_cnt++;
+  lock->acquired_at = tsc_read ();
+}
+
+/* Acquires LOCK, spinning until it is available.  LOCK must not
+   already be held by the running CPU, and interrupts must be
+   off. */
+void
+spinlock_acquire (struct spinlock *lock)
+{
+  uint32_t tickets = 1 << TICKET_SHIFT;
+  uint16_t ticket;
+  bool contended = false;
+
+  ASSERT (lock != NULL);
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (!spinlock_held_by_current_cpu (lock));
+
+  /* Take a ticket. */
+  asm volatile ("lock xaddl %0, %1"
+                : "+r" (tickets), "+m" (lock->tickets) : : "memory");
+  ticket = NEXT (tickets);
+
+  /* Wait for it to be served.  See [IA32-v2b] "PAUSE". */
+  while (SERVING (tickets) != ticket)
+    {
+      contended = true;
+      asm volatile ("pause" : : : "memory");
+      tickets = lock->tickets;
+    }
+
+  mark_acquired (lock);
+  if (contended)
+    lock->contended_cnt++;
+}
+
+/* Tries to acquire LOCK without spinning.  Returns true if
+   successful, false if another CPU holds LOCK or is waiting for
+   it.  Interrupts must be off. */
+bool
+spinlock_try_acquire (struct spinlock *lock)
+{
+  uint32_t old = lock->tickets;
+  uint32_t prev;
+
+  ASSERT (lock != NULL);
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (!spinlock_held_by_current_cpu (lock));
+
+  if (SERVING (old) != NEXT (old))
+    return false;
+  asm volatile ("lock cmpxchgl %2, %1"
+                : "=a" (prev), "+m" (lock->tickets)
+                : "r" (old + (1 << TICKET_SHIFT)), "0" (old)
+                : "memory");
+  if (prev != old)
+    return false;
+
+  mark_acquired (lock);
+  return true;
+}
+
+/* Releases LOCK, which must be held by the running CPU. */
+void
+spinlock_release (struct spinlock *lock)
+{
+  uint64_t held;
+
+  ASSERT (lock != NULL);
+  ASSERT (spinlock_held_by_current_cpu (lock));
+
+  held = tsc_read () - lock->acquired_at;
+  lock->hold_cycles += held;
+  if (held > lock->max_hold_cycles)
+    lock->max_hold_cycles = held;
+  lock->cpu = NULL;
+
+  /* Serve the next ticket.  Only the holder writes the low half,
+     and x86 does not reorder stores with older loads or stores,
+     so a plain increment releases the lock. */
+  asm volatile ("incw %0" : "+m" (*(volatile uint16_t *) &lock->tickets)
+                : : "memory");
+}
+
+/* Returns true if the running CPU holds LOCK, false otherwise.
+   (Note that testing whether some other CPU holds a lock would
+   be racy.) */
+bool
+spinlock_held_by_current_cpu (const struct spinlock *lock)
+{
+  ASSERT (lock != NULL);
+
+  return lock->cpu == cpu_current ();
+}
+
+/* Disables interrupts, acquires LOCK, and returns the previous
+   interrupt status, which should be passed to
+   spinlock_release_irqrestore(). */
+enum intr_level
+spinlock_acquire_irqsave (struct spinlock *lock)
+{
+  enum intr_level old_level = intr_disable ();
+  spinlock_acquire (lock);
+  return old_level;
+}
+
+/* Releases LOCK and then sets the interrupt status to
+   OLD_LEVEL. */
+void
+spinlock_release_irqrestore (struct spinlock *lock,
+                             enum intr_level old_level)
+{
+  spinlock_release (lock);
+  intr_set_level (old_level);
+}
+
+/* Prints LOCK's acquisition and hold-time statistics. */
+void
+spinlock_print_stats (const struct spinlock *lock)
+{
+  uint64_t avg = lock->acquire_cnt ? lock->hold_cycles / lock->acquire_cnt : 0;
+
+  printf ("Spinlock %s: %"PRIu64" acquisitions, %"PRIu64" contended, "
+          "%"PRIu64" cycles average hold, %"PRIu64" max\n",
+          lock->name, lock->acquire_cnt, lock->contended_cnt,
+          avg, lock->max_hold_cycles);
+}
@@ -0,0 +1,50 @@
+#ifndef THREADS_SPINLOCK_H
+#define THREADS_SPINLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "threads/interrupt.h"
+
+/* A ticket spinlock.
+
+   Each CPU that wants the lock takes the next ticket and spins
+   until that ticket is served, so CPUs acquire the lock in the
+   order in which they asked for it.  The low 16 bits of
+   `tickets' hold the ticket now being served, the high 16 bits
+   the next ticket to hand out.
+
+   A spinlock protects data from other CPUs, while disabling
+   interrupts protects it from the running CPU's own interrupt
+   handlers and from preemption.  Thus, a spinlock may only be
+   held with interrupts off.  spinlock_acquire_irqsave() and
+   spinlock_release_irqrestore() take care of that for callers
+   that do not already have interrupts off.  A thread must not
+   sleep while holding a spinlock, except that the scheduler
+   holds the running CPU's run queue lock across a thread
+   switch (see thread.c). */
+struct spinlock
+  {
+    volatile uint32_t tickets;  /* Serving (low), next (high). */
+    struct cpu *cpu;            /* CPU holding lock (for debugging). */
+    const char *name;           /* Name (for debugging). */
+
+    /* Statistics. */
+    uint64_t acquire_cnt;       /* Number of acquisitions. */
+    uint64_t contended_cnt;     /* Acquisitions that had to spin. */
+    uint64_t hold_cycles;       /* Total TSC cycles held. */
+    uint64_t max_hold_cycles;   /* Longest single hold, in cycles. */
+    uint64_t acquired_at;       /* TSC value at last acquisition. */
+  };
+
+void spinlock_init (struct spinlock *, const char *name);
+void spinlock_acquire (struct spinlock *);
+bool spinlock_try_acquire (struct spinlock *);
+void spinlock_release (struct spinlock *);
+bool spinlock_held_by_current_cpu (const struct spinlock *);
+
+enum intr_level spinlock_acquire_irqsave (struct spinlock *);
+void spinlock_release_irqrestore (struct spinlock *, enum intr_level);
+
+void spinlock_print_stats (const struct spinlock *);
+
+#endif /* threads/spinlock.h */
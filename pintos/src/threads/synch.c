@@ -27,10 +27,30 @@
 */
 
 #include "threads/synch.h"
+#include <hash.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include "threads/interrupt.h"
+#include "threads/smp.h"
 #include "threads/thread.h"
+#include "threads/trace.h"
+#include "threads/tsc.h"
+
+struct spinlock donation_lock = { .name = "donation" };
+
+/* Locks being profiled, and the spinlock that protects the
+   list. */
+static struct list profiled_locks = LIST_INITIALIZER (profiled_locks);
+static struct spinlock profile_lock = { .name = "lock profile" };
+
+/* Number of locks listed by lock_print_profile(). */
+#define LOCK_PROFILE_TOP 10
+
+static pheap_less_func sema_waiter_less;
+static pheap_less_func cond_waiter_less;
+static void rwlock_donate (struct rwlock *, struct thread *, int dep);
+static bool lock_take (struct lock *);
 
 /* Initializes semaphore SEMA to VALUE.  A semaphore is a
    nonnegative integer along with two atomic operators for
@@ -47,7 +67,9 @@ sema_init (struct semaphore *sema, unsigned value)
   ASSERT (sema != NULL);
 
   sema->value = value;
-  list_init (&sema->waiters);
+  pheap_init (&sema->waiters, sema_waiter_less);
+  sema->next_seq = 0;
+  spinlock_init (&sema->lock, "semaphore");
 }
 
 /* Down or "P" operation on a semaphore.  Waits for SEMA's value
@@ -60,19 +82,30 @@ sema_init (struct semaphore *sema, unsigned value)
 void
 sema_down (struct semaphore *sema) 
 {
+  struct thread *cur = thread_current ();
   enum intr_level old_level;
 
   ASSERT (sema != NULL);
   ASSERT (!intr_context ());
 
-  old_level = intr_disable ();
+  old_level = spinlock_acquire_irqsave (&sema->lock);
   while (sema->value == 0) 
     {
-      list_push_back (&sema->waiters, &thread_current ()->elem);
-      thread_block ();
+      cur->sema_waiting = sema;
+      cur->wait_seq = sema->next_seq++;
+
+      /* Order the store to sema_waiting before reading our own
+         priority in pheap_push().  Pairs with the fence in
+         thread_set_effective_priority(), which changes priority
+         first and reads sema_waiting second, so that one of us
+         sees the other's update. */
+      asm volatile ("mfence" : : : "memory");
+      pheap_push (&sema->waiters, &cur->wait_elem);
+      thread_block_and_release (&sema->lock);
+      spinlock_acquire (&sema->lock);
     }
   sema->value--;
-  intr_set_level (old_level);
+  spinlock_release_irqrestore (&sema->lock, old_level);
 }
 
 /* Down or "P" operation on a semaphore, but only if the
@@ -88,7 +121,7 @@ sema_try_down (struct semaphore *sema)
 
   ASSERT (sema != NULL);
 
-  old_level = intr_disable ();
+  old_level = spinlock_acquire_irqsave (&sema->lock);
   if (sema->value > 0) 
     {
       sema->value--;
@@ -96,38 +129,45 @@ sema_try_down (struct semaphore *sema)
     }
   else
     success = false;
-  intr_set_level (old_level);
+  spinlock_release_irqrestore (&sema->lock, old_level);
 
   return success;
 }
 
+/* Adds CNT to SEMA's value and wakes up the CNT threads of
+   highest priority among those waiting for SEMA, or all of them
+   if there are fewer.  Does not preempt the running thread. */
+static void
+sema_wake (struct semaphore *sema, unsigned cnt)
+{
+  enum intr_level old_level;
+  unsigned i;
+
+  old_level = spinlock_acquire_irqsave (&sema->lock);
+  for (i = 0; i < cnt && !pheap_empty (&sema->waiters); i++)
+    {
+      struct thread *t = pheap_entry (pheap_pop (&sema->waiters),
+                                      struct thread, wait_elem);
+      t->sema_waiting = NULL;
+      thread_unblock (t);
+    }
+  sema->value += cnt;
+  spinlock_release_irqrestore (&sema->lock, old_level);
+}
+
 /* Up or "V" operation on a semaphore.  Increments SEMA's value
    and wakes up one thread of those waiting for SEMA, if any.
+   Yields the CPU only if the thread woken up outranks the
+   running thread.
 
    This function may be called from an interrupt handler. */
 void
 sema_up (struct semaphore *sema) 
 {
-  enum intr_level old_level;
-
   ASSERT (sema != NULL);
 
-  old_level = intr_disable ();
-  if (!list_empty (&sema->waiters))
-    {
-      /* Unblock thread with highest priority */
-      struct list_elem *t_elem = list_max (&sema->waiters, 
-                                           cmp_thread_priority, NULL);
-      struct thread *t = list_entry (t_elem, struct thread, elem);
-      thread_unblock (t);
-      list_remove (t_elem);
-    }
-  sema->value++;
-  intr_set_level (old_level);
-  if (intr_context ())
-    intr_yield_on_return ();
-  else
-    thread_yield ();
+  sema_wake (sema, 1);
+  thread_preempt ();
 }
 
 static void sema_test_helper (void *sema_);
@@ -188,10 +228,69 @@ lock_init (struct lock *lock)
   ASSERT (lock != NULL);
 
   lock->holder = NULL;
-  lock->priority_donate = PRI_MIN;
+  lock->donation.priority = PRI_MIN;
+  lock->adaptive = false;
+  lock->spin_cnt = 0;
+  lock->sleep_cnt = 0;
+  lock->name = NULL;
   sema_init (&lock->semaphore, 1);
 }
 
+/* Initializes LOCK like lock_init(), but as an adaptive lock.
+   When an adaptive lock is taken, lock_acquire() first spins as
+   long as the holder is running on another CPU, on the theory
+   that it will soon release the lock, and only sleeps if the
+   holder is not running or LOCK_SPIN_MAX checks go by.  This
+   avoids two thread switches for locks that are only ever held
+   for a short time.  Locks held across sleeps, such as a lock
+   held during disk I/O, should not be adaptive. */
+void
+lock_init_adaptive (struct lock *lock)
+{
+  lock_init (lock);
+  lock->adaptive = true;
+}
+
+/* Spins until adaptive LOCK is free and then acquires it, for as
+   long as its holder is running on another CPU.  Returns true if
+   successful, false if the caller should sleep instead.
+
+   The lock is not actually held between sema_try_down() and
+   setting `holder', so a null holder means that the lock is
+   about to be taken or released: keep spinning. */
+static bool
+lock_spin (struct lock *lock)
+{
+  int spins;
+
+  if (cpu_cnt == 1)
+    return false;
+  for (spins = 0; spins < LOCK_SPIN_MAX; spins++)
+    {
+      struct thread *holder = lock->holder;
+
+      if (lock->semaphore.value > 0 && lock_try_acquire (lock))
+        return true;
+      if (holder != NULL && !thread_is_running (holder))
+        return false;
+      asm volatile ("pause" : : : "memory");
+    }
+  return false;
+}
+
+/* Records that the running thread has just acquired LOCK, if
+   LOCK is being profiled. */
+static void
+lock_profile_acquired (struct lock *lock)
+{
+  if (lock->name != NULL)
+    {
+      lock->acquire_cnt++;
+      lock->acquired_at = tsc_read ();
+      lock->last_holder = thread_tid ();
+    }
+}
+
 /* Acquires LOCK, sleeping until it becomes available if
    necessary.  The lock must not already be held by the current
    thread.
@@ -210,25 +309,35 @@ lock_acquire (struct lock *lock)
   ASSERT (!lock_held_by_current_thread (lock));
 
   struct thread *cur = thread_current ();
+  uint64_t start;
+  bool donated;
 
-  bool success = lock_try_acquire (lock);
-  if (!success)
+  if (lock_try_acquire (lock))
+    return;
+
+  start = lock->name != NULL ? tsc_read () : 0;
+  if (lock->adaptive && lock_spin (lock))
+    lock->spin_cnt++;
+  else
     {
+      old_level = spinlock_acquire_irqsave (&donation_lock);
       cur->lock_waiting = lock;
       donate_priority (cur, 0);
-
-      old_level = intr_disable ();
-      sort_ready_heap ();
-      intr_set_level (old_level);
+      spinlock_release_irqrestore (&donation_lock, old_level);
 
       sema_down (&lock->semaphore);
 
-      old_level = intr_disable ();
-      lock->holder = cur;
+      old_level = spinlock_acquire_irqsave (&donation_lock);
       cur->lock_waiting = NULL;
-      list_push_back(&cur->locks_holding_list, &lock->elem);
-      intr_set_level (old_level);
+      donated = lock_take (lock);
+      spinlock_release_irqrestore (&donation_lock, old_level);
+      if (donated)
+        thread_update_priority (cur, NULL);
+      lock->sleep_cnt++;
+      lock_profile_acquired (lock);
     }
+  if (lock->name != NULL)
+    lock->wait_cycles += tsc_read () - start;
 }
 
 /* Tries to acquires LOCK and returns true if successful or false
@@ -240,21 +349,67 @@ lock_acquire (struct lock *lock)
 bool
 lock_try_acquire (struct lock *lock)
 {
-  bool success;
+  enum intr_level old_level;
+  bool success, donated = false;
 
   ASSERT (lock != NULL);
   ASSERT (!lock_held_by_current_thread (lock));
 
+  /* Taking the semaphore and setting the holder under
+     donation_lock keeps donate_priority() from seeing the lock
+     taken with no holder to donate to. */
+  old_level = spinlock_acquire_irqsave (&donation_lock);
   success = sema_try_down (&lock->semaphore);
+  if (success)
+    donated = lock_take (lock);
+  spinlock_release_irqrestore (&donation_lock, old_level);
+
   if (success)
     {
-      struct thread *cur = thread_current ();
-      lock->holder = cur;
-      list_push_back(&cur->locks_holding_list, &lock->elem);
+      if (donated)
+        thread_update_priority (thread_current (), NULL);
+      lock_profile_acquired (lock);
     }
   return success;
 }
 
+/* Makes the running thread the holder of LOCK, whose semaphore
+   it has just downed, and adds LOCK's donation to its donors.
+   The donation starts out at the priority of the highest waiter
+   still on the semaphore, or of a waiter that found the lock
+   without a holder in donate_priority() and has yet to join the
+   semaphore's waiters, whichever is higher.  Returns true if the
+   donation may raise the running thread's priority, in which case
+   the caller must call thread_update_priority() after releasing
+   donation_lock.  The caller must hold donation_lock. */
+static bool
+lock_take (struct lock *lock)
+{
+  struct thread *cur = thread_current ();
+  struct semaphore *sema = &lock->semaphore;
+
+  ASSERT (spinlock_held_by_current_cpu (&donation_lock));
+
+  lock->holder = cur;
+
+  /* A priority recorded no higher than our own may be our own,
+     from before we got the lock, so do not count it. */
+  if (lock->donation.priority <= cur->priority)
+    lock->donation.priority = PRI_MIN;
+  spinlock_acquire (&sema->lock);
+  if (!pheap_empty (&sema->waiters))
+    {
+      struct thread *t = pheap_entry (pheap_top (&sema->waiters),
+                                      struct thread, wait_elem);
+      if (t->priority > lock->donation.priority)
+        lock->donation.priority = t->priority;
+    }
+  spinlock_release (&sema->lock);
+
+  pheap_push (&cur->donors, &lock->donation.elem);
+  return !thread_mlfqs && lock->donation.priority > cur->priority;
+}
+
 /* Releases LOCK, which must be owned by the current thread.
 
    An interrupt handler cannot acquire a lock, so it does not
@@ -267,34 +422,76 @@ lock_release (struct lock *lock)
   ASSERT (lock != NULL);
   ASSERT (lock_held_by_current_thread (lock));
 
-  old_level = intr_disable ();
+  if (lock->name != NULL)
+    {
+      uint64_t held = tsc_read () - lock->acquired_at;
+      if (held > lock->max_hold_cycles)
+        lock->max_hold_cycles = held;
+    }
+
+  old_level = spinlock_acquire_irqsave (&donation_lock);
   lock->holder = NULL;
-  lock->priority_donate = PRI_MIN;
-  list_remove (&lock->elem);
+  pheap_remove (&thread_current ()->donors, &lock->donation.elem);
+  lock->donation.priority = PRI_MIN;
+  spinlock_release_irqrestore (&donation_lock, old_level);
 
-  intr_set_level (old_level);
   thread_update_priority (thread_current (), NULL);
   sema_up (&lock->semaphore);
 }
 
-/* Donate priority.
-   DO not exceed depth limit. */
+/* Donates T's priority along the chain of threads that T waits
+   for, directly or indirectly: to the holder of the lock that T
+   waits for, then to the holder of the lock that that thread
+   waits for, and so on.  Only the threads along the chain are
+   touched, each one's donors heap and, if its priority rises, its
+   place in the run queue or a waiters queue.  Propagation stops
+   as soon as a thread's priority does not rise, since the
+   threads beyond it then already have at least its priority, or
+   after DONATE_MAX_DEPTH steps.
+   The caller must hold donation_lock. */
 void
 donate_priority (struct thread *t, int dep)
 {
   if (thread_mlfqs)
     return;
   ASSERT (t != NULL);
-  
-  if (dep > DONATE_MAX_DEPTH || t->lock_waiting == NULL)
-    return;
-  if (t->lock_waiting->priority_donate < t->priority)
+  ASSERT (spinlock_held_by_current_cpu (&donation_lock));
+
+  for (; dep <= DONATE_MAX_DEPTH; dep++)
     {
-      ASSERT (t->lock_waiting->holder != NULL);
-      t->lock_waiting->priority_donate = t->priority;
-      if (t->priority > t->lock_waiting->holder->priority)
-        t->lock_waiting->holder->priority = t->priority;
-      donate_priority (t->lock_waiting->holder, dep + 1);
+      struct lock *lock = t->lock_waiting;
+      struct thread *holder;
+
+      if (lock == NULL)
+        {
+          if (t->rwlock_waiting != NULL)
+            rwlock_donate (t->rwlock_waiting, t, dep);
+          return;
+        }
+
+      if (lock->donation.priority >= t->priority)
+        return;
+
+      /* The lock has no holder if it was released since we found
+         it taken, or if its next holder has downed its semaphore
+         but not yet called lock_take().  Leave our priority on the
+         lock, so that lock_take() donates it to the next holder
+         even if we have not joined the semaphore's waiters by
+         then. */
+      holder = lock->holder;
+      if (holder == NULL)
+        {
+          lock->donation.priority = t->priority;
+          return;
+        }
+      lock->donation.priority = t->priority;
+      pheap_update (&holder->donors, &lock->donation.elem);
+      trace_donate (t, holder);
+
+      if (t->priority <= holder->priority)
+        return;
+      thread_set_effective_priority (holder, t->priority);
+      t = holder;
     }
 }
 
@@ -309,46 +506,127 @@ lock_held_by_current_thread (const struct lock *lock)
   return lock->holder == thread_current ();
 }
 
-bool 
-cmp_lock_priority (const struct list_elem *a,
-                   const struct list_elem *b,
-                   void *aux UNUSED)
+/* Returns true if donation A is lower than donation B. */
+bool
+donation_less (const struct pheap_elem *a_, const struct pheap_elem *b_)
 {
-  return list_entry (a, struct lock, elem)->priority_donate < 
-         list_entry (b, struct lock, elem)->priority_donate;
+  const struct donation *a = pheap_entry (a_, struct donation, elem);
+  const struct donation *b = pheap_entry (b_, struct donation, elem);
+
+  return a->priority < b->priority;
 }
-
-/* One semaphore in a list. */
-struct semaphore_elem 
-  {
-    struct list_elem elem;              /* List element. */
-    struct semaphore semaphore;         /* This semaphore. */
-  };
 
-int
-sema_waiter_priority (struct semaphore *sema)
+/* Prints how many of LOCK's acquisitions succeeded by spinning
+   and how many had to sleep, naming it NAME. */
+void
+lock_print_stats (const struct lock *lock, const char *name)
 {
-  int priority = PRI_MIN;
-  if (!list_empty (&sema->waiters))
+  printf ("Lock %s: %u acquisitions by spinning, %u by sleeping\n",
+          name, lock->spin_cnt, lock->sleep_cnt);
+}
+
+/* Starts profiling LOCK under the name NAME, which must remain
+   valid as long as LOCK does.  LOCK must then never be destroyed,
+   so this is meant for locks that live as long as the kernel,
+   such as those in static data.  lock_print_profile() reports on
+   all the profiled locks. */
+void
+lock_profile (struct lock *lock, const char *name)
+{
+  enum intr_level old_level;
+
+  ASSERT (lock != NULL);
+  ASSERT (name != NULL);
+  ASSERT (lock->name == NULL);
+
+  lock->acquire_cnt = 0;
+  lock->wait_cycles = 0;
+  lock->max_hold_cycles = 0;
+  lock->acquired_at = 0;
+  lock->last_holder = TID_ERROR;
+  lock->name = name;
+
+  old_level = spinlock_acquire_irqsave (&profile_lock);
+  list_push_back (&profiled_locks, &lock->prof_elem);
+  spinlock_release_irqrestore (&profile_lock, old_level);
+}
+
+/* Returns true if profiled lock A has spent more time waited
+   for than profiled lock B. */
+static bool
+lock_waited_more (const struct list_elem *a_, const struct list_elem *b_,
+                  void *aux UNUSED)
+{
+  const struct lock *a = list_entry (a_, struct lock, prof_elem);
+  const struct lock *b = list_entry (b_, struct lock, prof_elem);
+
+  return a->wait_cycles > b->wait_cycles;
+}
+
+/* Prints the LOCK_PROFILE_TOP profiled locks that were waited
+   for longest, with their contention statistics.  The list is
+   walked without profile_lock, since printing may sleep, but
+   lock_profile() only ever appends to it. */
+void
+lock_print_profile (void)
+{
+  enum intr_level old_level;
+  struct list_elem *e;
+  int i;
+
+  old_level = spinlock_acquire_irqsave (&profile_lock);
+  list_sort (&profiled_locks, lock_waited_more, NULL);
+  spinlock_release_irqrestore (&profile_lock, old_level);
+
+  printf ("Lock profile, top %d by time waited, in TSC cycles:\n",
+          LOCK_PROFILE_TOP);
+  printf ("  %-12s %10s %10s %8s %14s %12s %6s\n",
+          "name", "acquires", "contended", "spun", "waited",
+          "max hold", "last");
+  for (e = list_begin (&profiled_locks), i = 0;
+       e != list_end (&profiled_locks) && i < LOCK_PROFILE_TOP;
+       e = list_next (e), i++)
     {
-      int waiter_priority = list_entry(list_max (&sema->waiters,
-                                       cmp_thread_priority, NULL),
-                                       struct thread, elem)->priority;
-      if (waiter_priority > priority)
-        priority = waiter_priority;
+      const struct lock *lock = list_entry (e, struct lock, prof_elem);
+
+      printf ("  %-12s %10u %10u %8u %14"PRIu64
+              " %12"PRIu64" %6d\n",
+              lock->name, lock->acquire_cnt,
+              lock->spin_cnt + lock->sleep_cnt, lock->spin_cnt,
+              lock->wait_cycles, lock->max_hold_cycles, lock->last_holder);
     }
-  return priority;
+}
+
+/* Returns true if waiter A should be woken after waiter B:
+   if A has lower priority, or the same priority and arrived
+   later.  Sequence numbers are compared by their difference, so
+   that they may wrap around.  A_SEQ and B_SEQ are A's and B's
+   sequence numbers in the waiters being ordered. */
+static inline bool
+waiter_less (const struct thread *a, const struct thread *b,
+             const unsigned *a_seq, const unsigned *b_seq)
+{
+  if (a->priority != b->priority)
+    return a->priority < b->priority;
+  return (int) (*a_seq - *b_seq) > 0;
 }
 
-bool
-cmp_sema_priority (const struct list_elem *a,
-                   const struct list_elem *b,
-                   void *aux UNUSED)
+/* Orders the waiters of a semaphore. */
+static bool
+sema_waiter_less (const struct pheap_elem *a_, const struct pheap_elem *b_)
+{
+  const struct thread *a = pheap_entry (a_, struct thread, wait_elem);
+  const struct thread *b = pheap_entry (b_, struct thread, wait_elem);
+  return waiter_less (a, b, &a->wait_seq, &b->wait_seq);
+}
+
+/* Orders the waiters of a condition variable. */
+static bool
+cond_waiter_less (const struct pheap_elem *a_, const struct pheap_elem *b_)
 {
-  return sema_waiter_priority(&list_entry (a, struct semaphore_elem,
-                                           elem)->semaphore) < 
-         sema_waiter_priority(&list_entry (b, struct semaphore_elem,
-                                           elem)->semaphore) ;
+  const struct thread *a = pheap_entry (a_, struct thread, cond_elem);
+  const struct thread *b = pheap_entry (b_, struct thread, cond_elem);
+  return waiter_less (a, b, &a->cond_seq, &b->cond_seq);
 }
 
 /* Initializes condition variable COND.  A condition variable
@@ -359,7 +637,9 @@ cond_init (struct condition *cond)
 {
   ASSERT (cond != NULL);
 
-  list_init (&cond->waiters);
+  pheap_init (&cond->waiters, cond_waiter_less);
+  cond->next_seq = 0;
+  spinlock_init (&cond->lock, "condition");
 }
 
 /* Atomically releases LOCK and waits for COND to be signaled by
@@ -381,24 +661,66 @@ cond_init (struct condition *cond)
    This function may sleep, so it must not be called within an
    interrupt handler.  This function may be called with
    interrupts disabled, but interrupts will be turned back on if
-   we need to sleep. */
+   we need to sleep.
+
+   Each waiter sleeps on a semaphore of its own, which
+   cond_signal() ups.  The waiter is on COND's waiters from
+   before it releases LOCK until it is signaled, so it may be
+   there while running or ready as well as while blocked.  Its
+   cond_waiting member changes only with donation_lock held, so
+   that thread_set_effective_priority() can safely follow it. */
 void
 cond_wait (struct condition *cond, struct lock *lock) 
 {
-  struct semaphore_elem waiter;
+  struct thread *cur = thread_current ();
+  struct semaphore waiter;
+  enum intr_level old_level;
 
   ASSERT (cond != NULL);
   ASSERT (lock != NULL);
   ASSERT (!intr_context ());
   ASSERT (lock_held_by_current_thread (lock));
   
-  sema_init (&waiter.semaphore, 0);
-  list_push_back (&cond->waiters, &waiter.elem);
+  sema_init (&waiter, 0);
+  old_level = spinlock_acquire_irqsave (&donation_lock);
+  spinlock_acquire (&cond->lock);
+  cur->cond_waiting = cond;
+  cur->cond_sema = &waiter;
+  cur->cond_seq = cond->next_seq++;
+  pheap_push (&cond->waiters, &cur->cond_elem);
+  spinlock_release (&cond->lock);
+  spinlock_release_irqrestore (&donation_lock, old_level);
+
   lock_release (lock);
-  sema_down (&waiter.semaphore);
+  sema_down (&waiter);
   lock_acquire (lock);
 }
 
+/* Takes the highest-priority waiter, if any, off COND's waiters
+   and returns the semaphore that it waits on to be signaled, or a
+   null pointer if COND has no waiters.  The waiter cannot return
+   from cond_wait() until that semaphore is up, so it stays valid
+   until then. */
+static struct semaphore *
+cond_pop (struct condition *cond)
+{
+  struct semaphore *sema = NULL;
+  enum intr_level old_level;
+
+  old_level = spinlock_acquire_irqsave (&donation_lock);
+  spinlock_acquire (&cond->lock);
+  if (!pheap_empty (&cond->waiters))
+    {
+      struct thread *t = pheap_entry (pheap_pop (&cond->waiters),
+                                      struct thread, cond_elem);
+      t->cond_waiting = NULL;
+      sema = t->cond_sema;
+    }
+  spinlock_release (&cond->lock);
+  spinlock_release_irqrestore (&donation_lock, old_level);
+  return sema;
+}
+
 /* If any threads are waiting on COND (protected by LOCK), then
    this function signals one of them to wake up from its wait.
    LOCK must be held before calling this function.
@@ -414,15 +736,9 @@ cond_signal (struct condition *cond, struct lock *lock UNUSED)
   ASSERT (!intr_context ());
   ASSERT (lock_held_by_current_thread (lock));
 
-  if (!list_empty (&cond->waiters)) {
-    struct list_elem *elem_max = list_max (&cond->waiters,
-                                           cmp_sema_priority, NULL);
-    struct semaphore *sema_max = &list_entry (elem_max,
-                                              struct semaphore_elem,
-                                              elem)->semaphore;
-    list_remove (elem_max);
-    sema_up (sema_max);
-  }
+  struct semaphore *sema = cond_pop (cond);
+  if (sema != NULL)
+    sema_up (sema);
 }
 
 /* Wakes up all threads, if any, waiting on COND (protected by
@@ -436,7 +752,489 @@ cond_broadcast (struct condition *cond, struct lock *lock)
 {
   ASSERT (cond != NULL);
   ASSERT (lock != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (lock_held_by_current_thread (lock));
+
+  /* Wake the waiters in priority order without yielding, then
+     let the highest-priority one of them run, if it outranks
+     us, with a single yield. */
+  while (!pheap_empty (&cond->waiters))
+    {
+      struct semaphore *sema = cond_pop (cond);
+      if (sema != NULL)
+        sema_wake (sema, 1);
+    }
+  thread_preempt ();
+}
+
+/* Returns true if a reader may enter RW right away, that is, if
+   no writer holds it or waits for it. */
+static bool
+rwlock_readable (const struct rwlock *rw)
+{
+  return !rw->writing && rw->writers_waiting == 0;
+}
+
+/* Returns true if a writer may enter RW right away. */
+static bool
+rwlock_writable (const struct rwlock *rw)
+{
+  return !rw->writing && rw->reader_cnt == 0;
+}
+
+/* Initializes RW.  A readers-writer lock can be held by many
+   readers or by one writer at a time.
+
+   Like a lock, a readers-writer lock takes part in priority
+   donation: a thread waiting for RW donates its priority to
+   every thread holding it, readers included.  Each holder keeps
+   track of the rwlocks it holds in its rwlock_holds[], so a
+   thread may hold at most RWLOCK_HOLD_MAX of them at once. */
+void
+rwlock_init (struct rwlock *rw)
+{
+  ASSERT (rw != NULL);
+
+  lock_init_adaptive (&rw->lock);
+  cond_init (&rw->can_read);
+  cond_init (&rw->can_write);
+  rw->reader_cnt = 0;
+  rw->writers_waiting = 0;
+  rw->writing = false;
+  list_init (&rw->holders);
+  rw->priority_donate = PRI_MIN;
+}
+
+/* Returns the priority of the highest-priority thread waiting on
+   COND, or PRI_MIN if there is none. */
+static int
+cond_max_priority (struct condition *cond)
+{
+  int priority = PRI_MIN;
+
+  spinlock_acquire (&cond->lock);
+  if (!pheap_empty (&cond->waiters))
+    priority = pheap_entry (pheap_top (&cond->waiters),
+                            struct thread, cond_elem)->priority;
+  spinlock_release (&cond->lock);
+  return priority;
+}
+
+/* Recomputes the priority that RW donates to its holders from
+   the threads that wait for it, and updates each holder's
+   donation to match.  The caller must hold RW's lock and
+   donation_lock. */
+static void
+rwlock_update_donation (struct rwlock *rw)
+{
+  int read_priority, write_priority;
+  struct list_elem *e;
+
+  ASSERT (spinlock_held_by_current_cpu (&donation_lock));
+
+  read_priority = cond_max_priority (&rw->can_read);
+  write_priority = cond_max_priority (&rw->can_write);
+  rw->priority_donate = (read_priority > write_priority
+                         ? read_priority : write_priority);
+  for (e = list_begin (&rw->holders); e != list_end (&rw->holders);
+       e = list_next (e))
+    {
+      struct rwlock_hold *hold = list_entry (e, struct rwlock_hold, elem);
+
+      hold->donation.priority = rw->priority_donate;
+      pheap_update (&hold->thread->donors, &hold->donation.elem);
+    }
+}
+
+/* Donates T's priority to each holder of RW, which T waits for.
+   The caller must hold donation_lock. */
+static void
+rwlock_donate (struct rwlock *rw, struct thread *t, int dep)
+{
+  struct list_elem *e;
+
+  if (rw->priority_donate >= t->priority)
+    return;
+  rw->priority_donate = t->priority;
+  for (e = list_begin (&rw->holders); e != list_end (&rw->holders);
+       e = list_next (e))
+    {
+      struct rwlock_hold *hold = list_entry (e, struct rwlock_hold, elem);
+      struct thread *holder = hold->thread;
+
+      hold->donation.priority = t->priority;
+      pheap_update (&holder->donors, &hold->donation.elem);
+      trace_donate (t, holder);
+      if (t->priority > holder->priority)
+        {
+          thread_set_effective_priority (holder, t->priority);
+          donate_priority (holder, dep + 1);
+        }
+    }
+}
+
+/* Waits on COND, one of RW's condition variables, donating our
+   priority to RW's holders in the meantime.  The caller must
+   hold RW's lock. */
+static void
+rwlock_wait (struct rwlock *rw, struct condition *cond)
+{
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
+  old_level = spinlock_acquire_irqsave (&donation_lock);
+  cur->rwlock_waiting = rw;
+  donate_priority (cur, 0);
+  spinlock_release_irqrestore (&donation_lock, old_level);
+
+  cond_wait (cond, &rw->lock);
+
+  old_level = spinlock_acquire_irqsave (&donation_lock);
+  cur->rwlock_waiting = NULL;
+  spinlock_release_irqrestore (&donation_lock, old_level);
+}
+
+/* Records that the running thread now holds RW, so that it
+   receives the priority of RW's waiters.  The caller must hold
+   RW's lock. */
+static void
+rwlock_add_holder (struct rwlock *rw)
+{
+  struct thread *cur = thread_current ();
+  struct rwlock_hold *hold = NULL;
+  enum intr_level old_level;
+  int i;
+
+  for (i = 0; i < RWLOCK_HOLD_MAX; i++)
+    if (cur->rwlock_holds[i].rwlock == NULL)
+      {
+        hold = &cur->rwlock_holds[i];
+        break;
+      }
+  if (hold == NULL)
+    PANIC ("thread %s holds more than %d rwlocks",
+           cur->name, RWLOCK_HOLD_MAX);
+
+  old_level = spinlock_acquire_irqsave (&donation_lock);
+  hold->rwlock = rw;
+  hold->thread = cur;
+  hold->donation.priority = PRI_MIN;
+  list_push_back (&rw->holders, &hold->elem);
+  pheap_push (&cur->donors, &hold->donation.elem);
+  rwlock_update_donation (rw);
+  spinlock_release_irqrestore (&donation_lock, old_level);
+
+  thread_update_priority (cur, NULL);
+}
+
+/* Records that the running thread no longer holds RW, and drops
+   any priority that it received through RW.  The caller must
+   hold RW's lock. */
+static void
+rwlock_remove_holder (struct rwlock *rw)
+{
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+  int i;
+
+  for (i = 0; i < RWLOCK_HOLD_MAX; i++)
+    if (cur->rwlock_holds[i].rwlock == rw)
+      break;
+  ASSERT (i < RWLOCK_HOLD_MAX);
+
+  old_level = spinlock_acquire_irqsave (&donation_lock);
+  list_remove (&cur->rwlock_holds[i].elem);
+  pheap_remove (&cur->donors, &cur->rwlock_holds[i].donation.elem);
+  cur->rwlock_holds[i].rwlock = NULL;
+  rwlock_update_donation (rw);
+  spinlock_release_irqrestore (&donation_lock, old_level);
+
+  thread_update_priority (cur, NULL);
+}
+
+/* Acquires RW for reading, sleeping until no writer holds it or
+   waits for it.  RW must not already be held by the current
+   thread.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_read (struct rwlock *rw)
+{
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rwlock_held_by_current_thread (rw));
+
+  lock_acquire (&rw->lock);
+  while (!rwlock_readable (rw))
+    rwlock_wait (rw, &rw->can_read);
+  rw->reader_cnt++;
+  rwlock_add_holder (rw);
+  lock_release (&rw->lock);
+}
+
+/* Tries to acquire RW for reading and returns true if successful
+   or false on failure.  RW must not already be held by the
+   current thread.
+
+   This function may briefly sleep on RW's internal lock, but
+   never waits for RW's holders, so it must not be called within
+   an interrupt handler. */
+bool
+rwlock_try_acquire_read (struct rwlock *rw)
+{
+  bool success;
+
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rwlock_held_by_current_thread (rw));
+
+  lock_acquire (&rw->lock);
+  success = rwlock_readable (rw);
+  if (success)
+    {
+      rw->reader_cnt++;
+      rwlock_add_holder (rw);
+    }
+  lock_release (&rw->lock);
+  return success;
+}
+
+/* Releases RW, which must be held for reading by the current
+   thread.  The last reader out lets a waiting writer in. */
+void
+rwlock_release_read (struct rwlock *rw)
+{
+  ASSERT (rw != NULL);
+  ASSERT (rwlock_held_by_current_thread (rw));
+
+  lock_acquire (&rw->lock);
+  ASSERT (!rw->writing && rw->reader_cnt > 0);
+  rwlock_remove_holder (rw);
+  if (--rw->reader_cnt == 0 && rw->writers_waiting > 0)
+    cond_signal (&rw->can_write, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Acquires RW for writing, sleeping until no other thread holds
+   it.  RW must not already be held by the current thread.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_write (struct rwlock *rw)
+{
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rwlock_held_by_current_thread (rw));
+
+  lock_acquire (&rw->lock);
+  if (!rwlock_writable (rw))
+    {
+      rw->writers_waiting++;
+      do
+        rwlock_wait (rw, &rw->can_write);
+      while (!rwlock_writable (rw));
+      rw->writers_waiting--;
+    }
+  rw->writing = true;
+  rwlock_add_holder (rw);
+  lock_release (&rw->lock);
+}
+
+/* Tries to acquire RW for writing and returns true if successful
+   or false on failure.  RW must not already be held by the
+   current thread.
+
+   This function may briefly sleep on RW's internal lock, but
+   never waits for RW's holders, so it must not be called within
+   an interrupt handler. */
+bool
+rwlock_try_acquire_write (struct rwlock *rw)
+{
+  bool success;
+
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rwlock_held_by_current_thread (rw));
+
+  lock_acquire (&rw->lock);
+  success = rwlock_writable (rw);
+  if (success)
+    {
+      rw->writing = true;
+      rwlock_add_holder (rw);
+    }
+  lock_release (&rw->lock);
+  return success;
+}
+
+/* Releases RW, which must be held for writing by the current
+   thread.  Hands RW to the next waiting writer if there is one,
+   otherwise to all the waiting readers. */
+void
+rwlock_release_write (struct rwlock *rw)
+{
+  ASSERT (rw != NULL);
+  ASSERT (rwlock_held_by_current_thread (rw));
+
+  lock_acquire (&rw->lock);
+  ASSERT (rw->writing);
+  rw->writing = false;
+  rwlock_remove_holder (rw);
+  if (rw->writers_waiting > 0)
+    cond_signal (&rw->can_write, &rw->lock);
+  else
+    cond_broadcast (&rw->can_read, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Returns true if the current thread holds RW, for reading or
+   for writing, false otherwise. */
+bool
+rwlock_held_by_current_thread (const struct rwlock *rw)
+{
+  struct thread *cur = thread_current ();
+  int i;
+
+  ASSERT (rw != NULL);
+
+  for (i = 0; i < RWLOCK_HOLD_MAX; i++)
+    if (cur->rwlock_holds[i].rwlock == rw)
+      return true;
+  return false;
+}
+
+/* Futexes.
+
+   A futex ("fast user-space mutex") is just an int in memory.
+   Threads that share it synchronize mostly without the kernel,
+   using atomic instructions on the int, and only call into the
+   kernel to sleep until the int changes or to wake up sleepers.
+   Since the address of the int is the futex's only identity,
+   waiters are kept in a fixed hash table of wait queues, keyed by
+   address, so that a futex needs no initialization or kernel
+   memory of its own.  Two futexes that hash to the same bucket
+   share its lock and list but never wake each other's waiters. */
+
+/* Number of futex hash buckets. */
+#define FUTEX_BUCKET_CNT 64
+
+/* A futex hash bucket. */
+struct futex_bucket
+  {
+    struct spinlock lock;       /* Protects waiters. */
+    struct list waiters;        /* struct futex_waiter, by priority. */
+  };
+
+static struct futex_bucket futex_buckets[FUTEX_BUCKET_CNT];
+
+/* A thread waiting on a futex. */
+struct futex_waiter
+  {
+    struct list_elem elem;      /* Element in bucket's waiters. */
+    const int *addr;            /* Futex waited on. */
+    struct thread *thread;      /* Waiting thread. */
+  };
+
+/* Initializes the futex hash table. */
+void
+futex_init (void)
+{
+  size_t i;
+
+  for (i = 0; i < FUTEX_BUCKET_CNT; i++)
+    {
+      spinlock_init (&futex_buckets[i].lock, "futex");
+      list_init (&futex_buckets[i].waiters);
+    }
+}
+
+/* Returns the hash bucket for the futex at ADDR. */
+static struct futex_bucket *
+futex_bucket (const int *addr)
+{
+  return &futex_buckets[hash_int ((int) addr) % FUTEX_BUCKET_CNT];
+}
+
+/* Returns true if futex waiter A has higher priority than B,
+   which keeps a bucket's waiters in descending priority order
+   and in arrival order among equals. */
+static bool
+futex_waiter_more (const struct list_elem *a_, const struct list_elem *b_,
+                   void *aux UNUSED)
+{
+  const struct futex_waiter *a = list_entry (a_, struct futex_waiter, elem);
+  const struct futex_waiter *b = list_entry (b_, struct futex_waiter, elem);
+
+  return a->thread->priority > b->thread->priority;
+}
+
+/* If *ADDR equals VAL, sleeps until futex_wake() is called on
+   ADDR and returns true.  Otherwise, returns false at once.  The
+   comparison and going to sleep are atomic with respect to
+   futex_wake(), so a wakeup that follows a change to *ADDR cannot
+   be missed.
+
+   Waiters are woken in order of their priority when they began
+   to wait, and in arrival order among equals.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+bool
+futex_wait (const int *addr, int val)
+{
+  struct futex_bucket *b = futex_bucket (addr);
+  struct futex_waiter w;
+  enum intr_level old_level;
+
+  ASSERT (addr != NULL);
+  ASSERT (!intr_context ());
+
+  old_level = spinlock_acquire_irqsave (&b->lock);
+  if (*(volatile const int *) addr != val)
+    {
+      spinlock_release_irqrestore (&b->lock, old_level);
+      return false;
+    }
+  w.addr = addr;
+  w.thread = thread_current ();
+  list_insert_ordered (&b->waiters, &w.elem, futex_waiter_more, NULL);
+  thread_block_and_release (&b->lock);
+  intr_set_level (old_level);
+  return true;
+}
+
+/* Wakes up to CNT threads waiting on the futex at ADDR, those of
+   highest priority first, and returns the number woken.  Yields
+   the CPU if one of them outranks the running thread. */
+unsigned
+futex_wake (const int *addr, unsigned cnt)
+{
+  struct futex_bucket *b = futex_bucket (addr);
+  enum intr_level old_level;
+  struct list_elem *e;
+  unsigned woken = 0;
+
+  ASSERT (addr != NULL);
+
+  old_level = spinlock_acquire_irqsave (&b->lock);
+  for (e = list_begin (&b->waiters);
+       woken < cnt && e != list_end (&b->waiters); )
+    {
+      struct futex_waiter *w = list_entry (e, struct futex_waiter, elem);
+
+      e = list_next (e);
+      if (w->addr == addr)
+        {
+          list_remove (&w->elem);
+          thread_unblock (w->thread);
+          woken++;
+        }
+    }
+  spinlock_release_irqrestore (&b->lock, old_level);
 
-  while (!list_empty (&cond->waiters))
-    cond_signal (cond, lock);
+  if (woken > 0)
+    thread_preempt ();
+  return woken;
 }
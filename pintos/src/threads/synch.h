@@ -2,13 +2,18 @@
 #define THREADS_SYNCH_H
 
 #include <list.h>
+#include <pheap.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "threads/spinlock.h"
 
 /* A counting semaphore. */
 struct semaphore 
   {
     unsigned value;             /* Current value. */
-    struct list waiters;        /* List of waiting threads. */
+    struct pheap waiters;       /* Waiting threads, by priority. */
+    unsigned next_seq;          /* Arrival order for next waiter. */
+    struct spinlock lock;       /* Protects the members above. */
   };
 
 void sema_init (struct semaphore *, unsigned value);
@@ -17,30 +22,69 @@ bool sema_try_down (struct semaphore *);
 void sema_up (struct semaphore *);
 void sema_self_test (void);
 
+/* Something held by a thread, through which the threads that
+   wait for it donate their priority to that thread.  Each thread
+   keeps the donations that it receives in a max-heap, so that
+   its donated priority is always at hand and adding, removing or
+   raising a donation takes O(log n) time. */
+struct donation
+  {
+    struct pheap_elem elem;     /* Element in the holder's donors. */
+    int priority;               /* Max priority from priority donation. */
+  };
+
+pheap_less_func donation_less;
+
 /* Lock. */
 struct lock 
   {
     struct thread *holder;      /* Thread holding lock (for debugging). */
     struct semaphore semaphore; /* Binary semaphore controlling access. */
-    struct list_elem elem;      /* List element. */
-    int priority_donate;        /* Max priority from priority donation */
+    struct donation donation;   /* Donation to the holder. */
+    bool adaptive;              /* Spin while the holder runs? */
+
+    /* Statistics, protected by the lock itself. */
+    unsigned spin_cnt;          /* Acquisitions that spun, then succeeded. */
+    unsigned sleep_cnt;         /* Acquisitions that slept. */
+
+    /* Profiling, only done if `name' is nonnull (see
+       lock_profile()).  Also protected by the lock itself. */
+    const char *name;           /* Name, or null if not profiled. */
+    struct list_elem prof_elem; /* Element in list of profiled locks. */
+    unsigned acquire_cnt;       /* Number of acquisitions. */
+    uint64_t wait_cycles;       /* Total TSC cycles spent waiting. */
+    uint64_t max_hold_cycles;   /* Longest single hold, in cycles. */
+    uint64_t acquired_at;       /* TSC value at last acquisition. */
+    int last_holder;            /* Tid of last thread to acquire. */
   };
 
+/* Maximum number of times that an adaptive lock's acquirer
+   checks the lock before giving up and going to sleep, even if
+   the holder is still running. */
+#define LOCK_SPIN_MAX 2000
+
+/* Protects the priority donation state of every lock and thread:
+   lock->holder, lock->donation, and each thread's lock_waiting
+   and donors. */
+extern struct spinlock donation_lock;
+
 void lock_init (struct lock *);
+void lock_init_adaptive (struct lock *);
 void lock_acquire (struct lock *);
 bool lock_try_acquire (struct lock *);
 void lock_release (struct lock *);
 void donate_priority (struct thread *, int);
 bool lock_held_by_current_thread (const struct lock *);
-list_less_func cmp_lock_priority;
-
-int sema_waiter_priority (struct semaphore *);
-list_less_func cmp_sema_priority;
+void lock_print_stats (const struct lock *, const char *name);
+void lock_profile (struct lock *, const char *name);
+void lock_print_profile (void);
 
 /* Condition variable. */
 struct condition 
   {
-    struct list waiters;        /* List of waiting threads. */
+    struct pheap waiters;       /* Waiting threads, by priority. */
+    unsigned next_seq;          /* Arrival order for next waiter. */
+    struct spinlock lock;       /* Protects the members above. */
   };
 
 void cond_init (struct condition *);
@@ -48,6 +92,55 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Readers-writer lock.  Held either by any number of readers at
+   once or by a single writer.  Waiting writers take precedence
+   over arriving readers, so that a stream of readers cannot
+   starve a writer. */
+struct rwlock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition can_read;  /* Readers wait here. */
+    struct condition can_write; /* Writers wait here. */
+    unsigned reader_cnt;        /* Number of readers holding. */
+    unsigned writers_waiting;   /* Number of writers waiting. */
+    bool writing;               /* Held by a writer? */
+
+    /* Protected by donation_lock. */
+    struct list holders;        /* Holds of each holder. */
+    int priority_donate;        /* Max priority from priority donation. */
+  };
+
+/* One thread's hold on a readers-writer lock.  Each thread has
+   RWLOCK_HOLD_MAX of these, so that it can take part in priority
+   donation for every rwlock it holds, even as one of many
+   readers. */
+struct rwlock_hold
+  {
+    struct list_elem elem;      /* Element in rwlock's holders. */
+    struct rwlock *rwlock;      /* Held rwlock, or null if unused. */
+    struct thread *thread;      /* Holding thread. */
+    struct donation donation;   /* Donation to the holding thread. */
+  };
+
+/* Number of rwlocks that a thread can hold at once. */
+#define RWLOCK_HOLD_MAX 4
+
+void rwlock_init (struct rwlock *);
+void rwlock_acquire_read (struct rwlock *);
+bool rwlock_try_acquire_read (struct rwlock *);
+void rwlock_release_read (struct rwlock *);
+void rwlock_acquire_write (struct rwlock *);
+bool rwlock_try_acquire_write (struct rwlock *);
+void rwlock_release_write (struct rwlock *);
+bool rwlock_held_by_current_thread (const struct rwlock *);
+
+/* Futexes: wait queues keyed by the address of an int.  Used to
+   implement the futex system calls, but usable by kernel threads
+   as well. */
+void futex_init (void);
+bool futex_wait (const int *, int val);
+unsigned futex_wake (const int *, unsigned cnt);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
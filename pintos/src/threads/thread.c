@@ -4,13 +4,20 @@
 #include <random.h>
 #include <stdio.h>
 #include <string.h>
+#include "devices/lapic.h"
 #include "devices/timer.h"
 #include "threads/flags.h"
+#include "threads/init.h"
 #include "threads/interrupt.h"
 #include "threads/intr-stubs.h"
+#include "threads/memtrack.h"
 #include "threads/palloc.h"
+#include "threads/pte.h"
+#include "threads/smp.h"
 #include "threads/switch.h"
 #include "threads/synch.h"
+#include "threads/trace.h"
+#include "threads/tsc.h"
 #include "threads/vaddr.h"
 #ifdef USERPROG
 #include "userprog/process.h"
@@ -21,22 +28,57 @@
    of thread.h for details. */
 #define THREAD_MAGIC 0xcd6abf4b
 
-/* Heap of processes in THREAD_READY state, that is, processes
-   that are ready to run but not actually running. */
-struct heap ready_heap;
+/* Run queue of processes in THREAD_READY state, that is,
+   processes that are ready to run but not actually running.
+
+   There is one FIFO list per priority level, plus a bitmap with
+   bit P set iff the list for priority P is nonempty.  Finding the
+   highest-priority ready thread is then a single bit scan, and
+   moving a thread to another level is a list removal and a push,
+   so every run queue operation is O(1).  Deadline threads with
+   budget left are kept apart in a heap ordered by deadline,
+   which comes before all the levels (see "Deadline scheduling"
+   below).
+
+   Each CPU has its own run queue, indexed by the CPU's id.  A
+   ready thread T is always in the run queue of T->cpu.
+
+   A run queue's lock protects the queue itself, plus the status
+   of every thread whose `cpu' is the queue's CPU, plus that
+   CPU's `running' member.  T->cpu only changes while the lock of
+   T's old CPU is held, when another CPU steals T.  A CPU holds
+   its own run queue lock across each thread switch: schedule()
+   is entered with the lock held, and thread_schedule_tail()
+   releases it in the thread switched to.  Thus, a thread that
+   another CPU sees as ready or blocked has always finished
+   switching away.
+
+   Spinlocks are always acquired in this order: donation_lock,
+   a condition variable's lock, a semaphore's lock, the timer's
+   sleep lock, or all_list_lock, then the run queue locks.
+   (thread_set_effective_priority() only tries for a semaphore's
+   lock while holding a run queue lock.) */
+struct ready_queue
+  {
+    struct spinlock lock;               /* Protects the members below. */
+    struct list levels[PRI_MAX + 1];    /* One list per priority. */
+    uint64_t nonempty;                  /* Bitmap of nonempty levels. */
+    struct pheap deadlines;             /* Deadline threads, earliest
+                                           deadline on top. */
+    int64_t earliest;                   /* Top deadline, or INT64_MAX. */
+    size_t size;                        /* Number of ready threads. */
+  };
 
-static heap_less_func cmp_thread_priority_heap;
+static struct ready_queue ready_queues[CPU_MAX];
 
-static bool
-cmp_thread_priority_heap (const heap_elem a,
-                          const heap_elem b)
-{
-  const struct thread *elem_a = (struct thread *)a;
-  const struct thread *elem_b = (struct thread *)b;
-  return elem_a->priority != elem_b->priority ? 
-         elem_a->priority < elem_b->priority :
-         elem_a->entry_ord > elem_b->entry_ord;
-}
+static void rusage_add (struct rusage *, const struct rusage *);
+static void ready_queue_init (struct ready_queue *);
+static void ready_queue_push (struct ready_queue *, struct thread *);
+static void ready_queue_remove (struct ready_queue *, struct thread *);
+static struct thread *ready_queue_pop (struct ready_queue *);
+static int ready_queue_max_priority (struct ready_queue *);
+static bool ready_queue_outranks (struct ready_queue *,
+                                  const struct thread *);
 
 bool
 cmp_thread_priority (const struct list_elem *a,
@@ -47,19 +89,18 @@ cmp_thread_priority (const struct list_elem *a,
          list_entry (b, struct thread, elem)->priority;
 }
 
-/* Rebuild ready heap. */
-void
-sort_ready_heap (void)
-{
-  heap_rebuild (&ready_heap);
-}
-
 /* List of all processes.  Processes are added to this list
    when they are first scheduled and removed when they exit. */
 static struct list all_list;
+static struct spinlock all_list_lock;
 
-/* Idle thread. */
-static struct thread *idle_thread;
+/* Combined resource usage of the threads that have exited.
+   Protected by all_list_lock. */
+static struct rusage exited_rusage;
+
+/* Maximum number of threads whose resource usage
+   thread_print_stats() lists one by one. */
+#define RUSAGE_PRINT_MAX 16
 
 /* Initial thread, the thread running init.c:main(). */
 static struct thread *initial_thread;
@@ -75,14 +116,8 @@ struct kernel_thread_frame
     void *aux;                  /* Auxiliary data for function. */
   };
 
-/* Statistics. */
-static long long idle_ticks;    /* # of timer ticks spent idle. */
-static long long kernel_ticks;  /* # of timer ticks in kernel threads. */
-static long long user_ticks;    /* # of timer ticks in user programs. */
-
 /* Scheduling. */
 #define TIME_SLICE 4            /* # of timer ticks to give each thread. */
-static unsigned thread_ticks;   /* # of timer ticks since last yield. */
 
 /* If false (default), use round-robin scheduler.
    If true, use multi-level feedback queue scheduler.
@@ -90,11 +125,109 @@ static unsigned thread_ticks;   /* # of timer ticks since last yield. */
 bool thread_mlfqs;
 int load_avg;
 
+/* If true, each thread's page is preceded by an unmapped guard
+   page.  Controlled by kernel command-line option
+   "-stack-guard". */
+bool thread_stack_guard;
+
+/* Incremental MLFQS.
+
+   The 4.4BSD scheduler recalculates every thread's priority every
+   4 ticks and decays every thread's recent_cpu once a second.
+   Walking all_list in the timer interrupt to do that costs time
+   in proportion to the number of threads, most of which are
+   usually blocked and unaffected.  Instead:
+
+     - A thread's priority only changes when its recent_cpu or
+       nice value does.  The running thread's recent_cpu grows
+       each tick, so its priority is recalculated after each
+       MLFQS_RECALC_TICKS ticks that it runs, when it yields, and
+       when it wakes up.
+
+     - Each once-a-second decay begins a new epoch and records the
+       decay coefficient for it, 2*load_avg / (2*load_avg + 1), in
+       decay_history[].  A thread remembers the epoch up to which
+       its recent_cpu is decayed and catches up whenever it is
+       examined: when it runs a tick, yields, wakes up, or has its
+       recent_cpu read.  A thread that slept through more than
+       DECAY_HISTORY epochs applies only the latest DECAY_HISTORY
+       coefficients, whose product is negligible unless the load
+       average stayed very high for all that time.
+
+   A thread waiting on a run queue across an epoch keeps its old
+   priority until it runs.  That delays the boost the decay would
+   have given it by at most the time the queue ahead of it takes.
+   In return, the timer interrupt does the same amount of work
+   however many threads exist. */
+#define MLFQS_RECALC_TICKS 4
+#define DECAY_HISTORY 64
+static fixed_point decay_history[DECAY_HISTORY];
+static volatile unsigned mlfqs_epoch;
+static int64_t mlfqs_second;    /* Second at which the last epoch began. */
+
+static void mlfqs_catch_up (struct thread *);
+static int mlfqs_priority (const struct thread *);
+static void mlfqs_new_epoch (void);
+static void update_load_avg (void);
+
+/* Deadline scheduling.
+
+   A thread that calls thread_set_deadline(RUNTIME, PERIOD) asks
+   for RUNTIME timer ticks of CPU time in every PERIOD ticks.
+   Such a deadline thread is scheduled earliest deadline first
+   (EDF), ahead of every priority level, so priority threads
+   cannot delay it however many of them are ready.
+
+   Each deadline thread is a constant bandwidth server (see
+   Abeni and Buttazzo, "Integrating Multimedia Applications in
+   Hard Real-Time Systems", RTSS 1998).  It has a budget of
+   RUNTIME ticks to use up by its current deadline.  Each tick it
+   runs takes one tick of budget.  Once the budget is gone the
+   thread is throttled: until its deadline it is scheduled like
+   any other thread at its priority, and at its deadline its
+   budget is refilled and its deadline moves one period on.  A
+   thread that wakes up keeps its deadline only if its budget
+   still fits its bandwidth before then, and otherwise begins a
+   new period.  Thus a deadline thread can never take more than
+   its bandwidth, RUNTIME/PERIOD, away from the rest.
+
+   EDF on one CPU meets every deadline as long as the bandwidths
+   add up to no more than 1.  Deadline threads may be woken or
+   stolen onto any CPU, and might all end up on the same one, so
+   thread_set_deadline() admits a new deadline thread only if the
+   total stays within DL_BW_MAX of one CPU.  The rest is left to
+   priority threads. */
+#define DL_BW_SHIFT 20                          /* Bandwidth 1.0. */
+#define DL_BW_MAX (((int64_t) 95 << DL_BW_SHIFT) / 100)
+
+/* Total bandwidth of the deadline threads. */
+static int64_t dl_bw_total;
+static struct spinlock dl_bw_lock;
+
+static bool is_deadline_thread (const struct thread *);
+static bool thread_outranks (const struct thread *, const struct thread *);
+static int64_t deadline_bw (int64_t runtime, int64_t period);
+static void deadline_stop (struct thread *);
+static void deadline_wakeup (struct thread *);
+static timer_func deadline_replenish;
+static pheap_less_func deadline_later;
+
 static void kernel_thread (thread_func *, void *aux);
 
 static void idle (void *aux UNUSED);
 static struct thread *running_thread (void);
-static struct thread *next_thread_to_run (void);
+static struct thread *next_thread_to_run (struct cpu *);
+static struct thread *steal_thread (struct cpu *);
+static void kick_idle_cpu (void);
+static bool is_idle_thread (const struct thread *);
+static struct ready_queue *lock_thread_queue (struct thread *);
+static struct thread *alloc_thread_page (void);
+static void free_thread_page (struct thread *);
+static void release_thread_page (struct thread *);
+static bool drain_thread_caches (void);
+static size_t thread_page_cnt (void);
+static uint8_t *thread_page_base (struct thread *);
+static void set_page_present (void *kpage, bool present);
 static void init_thread (struct thread *, const char *name, int priority);
 static bool is_thread (struct thread *) UNUSED;
 static void *alloc_frame (struct thread *, size_t size);
@@ -118,16 +251,26 @@ static tid_t allocate_tid (void);
 void
 thread_init (void) 
 {
+  int i;
+
   ASSERT (intr_get_level () == INTR_OFF);
 
-  lock_init (&tid_lock);
-  heap_init (&ready_heap, cmp_thread_priority_heap);
+  lock_init_adaptive (&tid_lock);
+  lock_profile (&tid_lock, "tid");
+  for (i = 0; i < CPU_MAX; i++)
+    ready_queue_init (&ready_queues[i]);
   list_init (&all_list);
+  spinlock_init (&all_list_lock, "all_list");
+  spinlock_init (&dl_bw_lock, "deadline bandwidth");
+  for (i = 0; i < CPU_MAX; i++)
+    spinlock_init (&cpus[i].thread_cache_lock, "thread cache");
 
   /* Set up a thread structure for the running thread. */
   initial_thread = running_thread ();
   init_thread (initial_thread, "main", PRI_DEFAULT);
   initial_thread->status = THREAD_RUNNING;
+  initial_thread->cpu = cpu_bsp ();
+  cpu_bsp ()->running = initial_thread;
   initial_thread->tid = allocate_tid ();
 
   load_avg = 0;
@@ -146,7 +289,7 @@ thread_start (void)
   /* Start preemptive thread scheduling. */
   intr_enable ();
 
-  /* Wait for the idle thread to initialize idle_thread. */
+  /* Wait for the idle thread to register itself with the CPU. */
   sema_down (&idle_started);
 }
 
@@ -155,42 +298,192 @@ thread_start (void)
 void
 thread_tick (void) 
 {
+  struct cpu *c = cpu_current ();
   struct thread *t = thread_current ();
 
-  /* Update statistics. */
-  if (t == idle_thread)
-    idle_ticks++;
-#ifdef USERPROG
-  else if (t->pagedir != NULL)
-    user_ticks++;
-#endif
+  ASSERT (intr_context ());
+
+  /* Update statistics.  intr_handler() records whether the
+     external interrupt being handled, whichever it is,
+     interrupted user code or the kernel. */
+  if (t == c->idle_thread)
+    c->idle_ticks++;
+  else if (c->intr_from_user)
+    {
+      c->user_ticks++;
+      t->rusage.ru_utime++;
+    }
   else
-    kernel_ticks++;
+    {
+      c->kernel_ticks++;
+      t->rusage.ru_stime++;
+    }
   if (thread_mlfqs)
     {
-      if (t != idle_thread)
-        t->recent_cpu = fp_int_add (t->recent_cpu, 1);
-      int64_t ticks = timer_ticks ();
-      if (ticks % 4 == 0)
-        thread_foreach (thread_update_priority, NULL);
-      if (ticks % TIMER_FREQ == 0)
+      if (t != c->idle_thread)
         {
-          update_load_avg ();
-          thread_foreach (thread_update_recent_cpu, NULL);
+          mlfqs_catch_up (t);
+          t->recent_cpu = fp_int_add (t->recent_cpu, 1);
+          if (++t->recalc_ticks >= MLFQS_RECALC_TICKS)
+            {
+              t->recalc_ticks = 0;
+              t->priority = mlfqs_priority (t);
+            }
         }
+
+      /* The load average is driven by the 8254 timer, which only
+         interrupts the bootstrap processor.  In event mode, a late
+         timer interrupt may account for several ticks at once, so
+         begin one epoch for each second boundary crossed since the
+         last one. */
+      if (c == cpu_bsp ())
+        while (mlfqs_second < timer_ticks () / TIMER_FREQ)
+          {
+            mlfqs_second++;
+            mlfqs_new_epoch ();
+          }
+    }
+
+  /* Charge a deadline thread for the tick, and throttle it until
+     its deadline if its budget ran out.  Only the running CPU
+     touches a running deadline thread's budget until then. */
+  if (is_deadline_thread (t) && --t->dl_budget <= 0)
+    {
+      t->dl_throttled = true;
+      timer_add (&t->dl_timer, t->dl_deadline);
+      intr_yield_on_return ();
     }
 
   /* Enforce preemption. */
-  if (++thread_ticks >= TIME_SLICE)
+  if (++c->thread_ticks >= TIME_SLICE)
     intr_yield_on_return ();
 }
 
+/* Accounts TICKS timer ticks that the running CPU's idle thread
+   slept through without taking timer interrupts.  See
+   timer_idle(). */
+void
+thread_tick_idle (unsigned ticks)
+{
+  cpu_current ()->idle_ticks += ticks;
+}
+
 /* Prints thread statistics. */
 void
 thread_print_stats (void) 
 {
+  long long idle_ticks = 0, kernel_ticks = 0, user_ticks = 0;
+  unsigned i;
+
+  for (i = 0; i < cpu_cnt; i++)
+    {
+      idle_ticks += cpus[i].idle_ticks;
+      kernel_ticks += cpus[i].kernel_ticks;
+      user_ticks += cpus[i].user_ticks;
+    }
   printf ("Thread: %lld idle ticks, %lld kernel ticks, %lld user ticks\n",
           idle_ticks, kernel_ticks, user_ticks);
+
+  printf ("Thread: %lld schedules, %lld context switches\n",
+          thread_schedule_count (), thread_switch_count ());
+
+  thread_print_rusage ();
+
+  for (i = 0; i < cpu_cnt; i++)
+    spinlock_print_stats (&ready_queues[i].lock);
+  spinlock_print_stats (&all_list_lock);
+  lock_print_stats (&tid_lock, "tid");
+}
+
+/* Adds the counts in B to those in A. */
+static void
+rusage_add (struct rusage *a, const struct rusage *b)
+{
+  a->ru_utime += b->ru_utime;
+  a->ru_stime += b->ru_stime;
+  a->ru_nvcsw += b->ru_nvcsw;
+  a->ru_nivcsw += b->ru_nivcsw;
+  a->ru_faults += b->ru_faults;
+  a->ru_inblock += b->ru_inblock;
+  a->ru_oublock += b->ru_oublock;
+}
+
+/* Prints one line of resource usage RU for the thread called
+   NAME. */
+static void
+print_rusage_line (const char *name, const struct rusage *ru)
+{
+  printf ("Thread %s: %lld user ticks, %lld kernel ticks, "
+          "%lld+%lld switches, %lld faults, %lld+%lld sectors\n",
+          name, ru->ru_utime, ru->ru_stime, ru->ru_nvcsw, ru->ru_nivcsw,
+          ru->ru_faults, ru->ru_inblock, ru->ru_oublock);
+}
+
+/* Prints the resource usage of each thread still alive, up to
+   RUSAGE_PRINT_MAX of them, and of all the exited threads
+   combined.  Context switches are listed as voluntary plus
+   involuntary, sectors as read plus written.  The usage is
+   copied out under all_list_lock first, since printing may
+   sleep. */
+void
+thread_print_rusage (void)
+{
+  static struct
+    {
+      char name[16];
+      struct rusage rusage;
+    }
+  threads[RUSAGE_PRINT_MAX];
+  struct rusage exited;
+  enum intr_level old_level;
+  struct list_elem *e;
+  size_t cnt = 0, i;
+
+  old_level = spinlock_acquire_irqsave (&all_list_lock);
+  for (e = list_begin (&all_list);
+       e != list_end (&all_list) && cnt < RUSAGE_PRINT_MAX;
+       e = list_next (e))
+    {
+      struct thread *t = list_entry (e, struct thread, allelem);
+      if (!is_idle_thread (t))
+        {
+          strlcpy (threads[cnt].name, t->name, sizeof threads[cnt].name);
+          threads[cnt].rusage = t->rusage;
+          cnt++;
+        }
+    }
+  exited = exited_rusage;
+  spinlock_release_irqrestore (&all_list_lock, old_level);
+
+  for (i = 0; i < cnt; i++)
+    print_rusage_line (threads[i].name, &threads[i].rusage);
+  print_rusage_line ("(exited)", &exited);
+}
+
+/* Returns the number of times that any CPU has entered the
+   scheduler, whether or not it switched threads. */
+long long
+thread_schedule_count (void)
+{
+  long long cnt = 0;
+  unsigned i;
+
+  for (i = 0; i < cpu_cnt; i++)
+    cnt += cpus[i].schedule_cnt;
+  return cnt;
+}
+
+/* Returns the number of times that any CPU has switched from one
+   thread to another. */
+long long
+thread_switch_count (void)
+{
+  long long cnt = 0;
+  unsigned i;
+
+  for (i = 0; i < cpu_cnt; i++)
+    cnt += cpus[i].switch_cnt;
+  return cnt;
 }
 
 /* Creates a new kernel thread named NAME with the given initial
@@ -221,7 +514,7 @@ thread_create (const char *name, int priority,
   ASSERT (function != NULL);
 
   /* Allocate thread. */
-  t = palloc_get_page (PAL_ZERO);
+  t = alloc_thread_page ();
   if (t == NULL)
     return TID_ERROR;
 
@@ -229,10 +522,14 @@ thread_create (const char *name, int priority,
   init_thread (t, name, priority);
   tid = t->tid = allocate_tid ();
 
-  /* Initialize mlfqs options. */
+  /* Initialize mlfqs options.  T's priority is calculated when
+     it is unblocked below. */
   if (thread_mlfqs)
     {
       struct thread *cur = thread_current ();
+      enum intr_level old_level = intr_disable ();
+
+      mlfqs_catch_up (cur);
       if (cur != initial_thread)
         {
           t->nice = cur->nice;
@@ -240,7 +537,8 @@ thread_create (const char *name, int priority,
         }
       else
         t->nice = t->recent_cpu = 0;
-      thread_update_priority(thread_current (), NULL);
+      t->recent_cpu_epoch = cur->recent_cpu_epoch;
+      intr_set_level (old_level);
     }
 
   /* Stack frame for kernel_thread(). */
@@ -275,10 +573,27 @@ thread_create (const char *name, int priority,
 void
 thread_block (void) 
 {
+  thread_block_and_release (NULL);
+}
+
+/* Like thread_block(), but if LOCK is nonnull, also releases
+   LOCK, which the running CPU must hold.  LOCK is released only
+   after the current thread is marked blocked, and the waker must
+   acquire LOCK before calling thread_unblock(), so a wakeup from
+   another CPU cannot be lost between releasing LOCK and going to
+   sleep. */
+void
+thread_block_and_release (struct spinlock *lock) 
+{
+  struct thread *cur = thread_current ();
+
   ASSERT (!intr_context ());
   ASSERT (intr_get_level () == INTR_OFF);
 
-  thread_current ()->status = THREAD_BLOCKED;
+  spinlock_acquire (&ready_queues[cur->cpu->id].lock);
+  cur->status = THREAD_BLOCKED;
+  if (lock != NULL)
+    spinlock_release (lock);
   schedule ();
 }
 
@@ -294,14 +609,42 @@ void
 thread_unblock (struct thread *t) 
 {
   enum intr_level old_level;
+  struct ready_queue *rq;
+  struct cpu *c;
 
   ASSERT (is_thread (t));
 
+  /* T goes back on the CPU it last ran on, whose cache may
+     still hold T's working set.  Nothing else touches a blocked
+     thread's MLFQS state, so bring it up to date first. */
   old_level = intr_disable ();
+  if (thread_mlfqs)
+    {
+      mlfqs_catch_up (t);
+      t->recalc_ticks = 0;
+      t->priority = mlfqs_priority (t);
+    }
+  rq = lock_thread_queue (t);
   ASSERT (t->status == THREAD_BLOCKED);
-  t->entry_ord = heap_entry_count (&ready_heap);
-  heap_push (&ready_heap, t);
+  if (is_deadline_thread (t))
+    deadline_wakeup (t);
+  ready_queue_push (rq, t);
   t->status = THREAD_READY;
+  trace_wakeup (t);
+
+  /* If T outranks what that CPU is running, or the CPU is idle,
+     ask it to reschedule.  Our own CPU is left to the caller.
+     Otherwise, T has to wait there, so wake up an idle CPU, which
+     sleeps through its timer ticks, to steal it. */
+  c = t->cpu;
+  if (is_idle_thread (c->running) || thread_outranks (t, c->running))
+    {
+      if (c != cpu_current ())
+        lapic_send_ipi (c->lapic_id, LAPIC_VEC_RESCHED);
+    }
+  else
+    kick_idle_cpu ();
+  spinlock_release (&rq->lock);
   intr_set_level (old_level);
 }
 
@@ -349,11 +692,18 @@ thread_exit (void)
   process_exit ();
 #endif
 
+  /* Give back our deadline bandwidth, if any. */
+  thread_set_deadline (0, 0);
+
   /* Remove thread from all threads list, set our status to dying,
      and schedule another process.  That process will destroy us
      when it calls thread_schedule_tail(). */
   intr_disable ();
+  spinlock_acquire (&all_list_lock);
   list_remove (&thread_current()->allelem);
+  rusage_add (&exited_rusage, &thread_current ()->rusage);
+  spinlock_release (&all_list_lock);
+  spinlock_acquire (&ready_queues[thread_current ()->cpu->id].lock);
   thread_current ()->status = THREAD_DYING;
   schedule ();
   NOT_REACHED ();
@@ -365,21 +715,64 @@ void
 thread_yield (void) 
 {
   struct thread *cur = thread_current ();
+  struct ready_queue *rq;
   enum intr_level old_level;
   
   ASSERT (!intr_context ());
 
   old_level = intr_disable ();
-  if (cur != idle_thread)
+  if (thread_mlfqs && !is_idle_thread (cur))
     {
-      cur->entry_ord = heap_entry_count (&ready_heap);
-      heap_push (&ready_heap, cur);
+      mlfqs_catch_up (cur);
+      cur->recalc_ticks = 0;
+      cur->priority = mlfqs_priority (cur);
     }
+  rq = &ready_queues[cur->cpu->id];
+  spinlock_acquire (&rq->lock);
+  if (!is_idle_thread (cur))
+    ready_queue_push (rq, cur);
   cur->status = THREAD_READY;
   schedule ();
   intr_set_level (old_level);
 }
 
+/* Yields the CPU if a thread that outranks the running thread is
+   ready on the running CPU, e.g. because the caller just woke it
+   up.  Called from an interrupt handler, yields on return from
+   the interrupt instead.  thread_unblock() already asks other
+   CPUs to reschedule as needed, so the running CPU's run queue
+   is the only one to check.  It is read without its lock; at
+   worst we yield needlessly or miss a thread that was made ready
+   concurrently, which the other CPU then takes care of. */
+void
+thread_preempt (void)
+{
+  struct thread *cur = thread_current ();
+  struct ready_queue *rq = &ready_queues[cur->cpu->id];
+
+  if (rq->size == 0
+      || (!is_idle_thread (cur) && !ready_queue_outranks (rq, cur)))
+    return;
+  if (intr_context ())
+    intr_yield_on_return ();
+  else
+    thread_yield ();
+}
+
+/* Returns true if T is running on some CPU, false otherwise.
+   The answer may be stale by the time the caller looks at it.
+   T itself is never dereferenced, so T may even have exited. */
+bool
+thread_is_running (const struct thread *t)
+{
+  unsigned i;
+
+  for (i = 0; i < cpu_cnt; i++)
+    if (cpus[i].running == t)
+      return true;
+  return false;
+}
+
 /* Invoke function 'func' on all threads, passing along 'aux'.
    This function must be called with interrupts off. */
 void
@@ -389,12 +782,14 @@ thread_foreach (thread_action_func *func, void *aux)
 
   ASSERT (intr_get_level () == INTR_OFF);
 
+  spinlock_acquire (&all_list_lock);
   for (e = list_begin (&all_list); e != list_end (&all_list);
        e = list_next (e))
     {
       struct thread *t = list_entry (e, struct thread, allelem);
       func (t, aux);
     }
+  spinlock_release (&all_list_lock);
 }
 
 /* Sets the current thread's priority to NEW_PRIORITY. */
@@ -406,38 +801,178 @@ thread_set_priority (int new_priority)
   struct thread *cur = thread_current ();
   int old_priority = cur->priority;
   cur->priority_origin = new_priority;
-  if (cur->priority < new_priority || list_empty (&cur->locks_holding_list))
-    cur->priority = new_priority;
-  if (cur->priority < old_priority)
+  thread_update_priority (cur, NULL);
+
+  /* The run queue is read without its lock; at worst we yield
+     needlessly or miss a thread that was just made ready. */
+  if (cur->priority < old_priority
+      && ready_queue_outranks (&ready_queues[cur->cpu->id], cur))
     thread_yield ();
 }
 
+/* Makes the running thread a deadline thread that needs RUNTIME
+   timer ticks of CPU time in every PERIOD ticks, starting now,
+   or changes its RUNTIME and PERIOD if it already is one.  With
+   a RUNTIME of 0, makes it an ordinary priority thread again.
+   Returns false, leaving the thread as it was, if RUNTIME or
+   PERIOD is invalid or if admitting the thread would take the
+   total bandwidth of deadline threads above DL_BW_MAX.  See
+   "Deadline scheduling" at the top of this file. */
+bool
+thread_set_deadline (int64_t runtime, int64_t period)
+{
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+  struct ready_queue *rq;
+  int64_t bw, old_bw;
+  bool ok;
+
+  ASSERT (!intr_context ());
+
+  if (runtime < 0 || (runtime > 0 && period < runtime))
+    return false;
+  if (runtime == 0 && cur->dl_runtime == 0)
+    return true;
+
+  bw = runtime > 0 ? deadline_bw (runtime, period) : 0;
+  old_bw = cur->dl_runtime > 0 ? deadline_bw (cur->dl_runtime,
+                                              cur->dl_period) : 0;
+  old_level = spinlock_acquire_irqsave (&dl_bw_lock);
+  ok = dl_bw_total - old_bw + bw <= DL_BW_MAX;
+  if (ok)
+    dl_bw_total += bw - old_bw;
+  spinlock_release_irqrestore (&dl_bw_lock, old_level);
+  if (!ok)
+    return false;
+
+  old_level = intr_disable ();
+  deadline_stop (cur);
+  if (runtime > 0)
+    {
+      rq = &ready_queues[cur->cpu->id];
+      spinlock_acquire (&rq->lock);
+      cur->dl_runtime = runtime;
+      cur->dl_period = period;
+      cur->dl_deadline = timer_ticks () + period;
+      cur->dl_budget = runtime;
+      spinlock_release (&rq->lock);
+    }
+  intr_set_level (old_level);
+
+  /* A deadline thread with an earlier deadline, or any ready
+     thread if we just left the deadline class, may outrank us. */
+  thread_preempt ();
+  return true;
+}
+
 /* Update thread priority from original
-   priority and priority donation.  */
+   priority and priority donation.  The highest donation is the
+   top of T's donors, so this takes constant time. */
 void
 thread_update_priority (struct thread *t, void *aux UNUSED)
 {
+  enum intr_level old_level = spinlock_acquire_irqsave (&donation_lock);
+  int priority;
+
   if (thread_mlfqs)
     {
-      t->priority = PRI_MAX;
-      t->priority -= fptoi_round (fp_int_div (t->recent_cpu, 4));
-      t->priority -= 2 * t->nice;
-      if (t->priority > PRI_MAX)
-        t->priority = PRI_MAX;
-      else if (t->priority < PRI_MIN)
-        t->priority = PRI_MIN;
-      return;
+      mlfqs_catch_up (t);
+      t->recalc_ticks = 0;
+      priority = mlfqs_priority (t);
     }
-  int priority = t->priority_origin;
-  if (!list_empty (&t->locks_holding_list))
+  else
     {
-      int donate_priority = list_entry (list_max (&t->locks_holding_list, 
-                                                  cmp_lock_priority, NULL), 
-                                        struct lock, elem)->priority_donate;
-      if (donate_priority > priority)
-        priority = donate_priority;
+      priority = t->priority_origin;
+      if (!pheap_empty (&t->donors))
+        {
+          int donate_priority = pheap_entry (pheap_top (&t->donors),
+                                             struct donation,
+                                             elem)->priority;
+          if (donate_priority > priority)
+            priority = donate_priority;
+        }
     }
-  t->priority = priority;
+
+  /* T may be on a condition variable's waiters, for example when
+     it releases a lock inside cond_wait(), so donation_lock must
+     be held here even under the MLFQS scheduler. */
+  thread_set_effective_priority (t, priority);
+  spinlock_release_irqrestore (&donation_lock, old_level);
+}
+
+/* Sets T's effective priority to PRIORITY.  If T is in the run
+   queue, it is moved to the level for its new priority, so no
+   rebuild of the run queue is ever needed.  Likewise, if T is
+   waiting on a semaphore or a condition variable, it is moved
+   within that one's waiters.
+
+   The caller must hold donation_lock if T might be waiting on a
+   condition variable, which pins T's cond_waiting (see
+   cond_wait()).  T's sema_waiting is pinned by T's run queue
+   lock instead: a thread on a semaphore's waiters is blocked, or
+   still inside sema_down() holding the semaphore's lock, and in
+   either case cannot leave sema_down() until it is unblocked.
+   The semaphore's lock comes before run queue locks, though, so
+   we may only try for it, and must start over if that fails. */
+void
+thread_set_effective_priority (struct thread *t, int priority)
+{
+  enum intr_level old_level;
+  struct ready_queue *rq;
+  struct condition *cond;
+  struct semaphore *sema = NULL;
+  bool changed = false;
+
+  ASSERT (is_thread (t));
+  ASSERT (PRI_MIN <= priority && priority <= PRI_MAX);
+
+  old_level = intr_disable ();
+  cond = t->cond_waiting;
+  if (cond != NULL)
+    {
+      ASSERT (spinlock_held_by_current_cpu (&donation_lock));
+      spinlock_acquire (&cond->lock);
+    }
+  for (;;)
+    {
+      rq = lock_thread_queue (t);
+      if (t->priority != priority)
+        {
+          if (t->status == THREAD_READY)
+            {
+              ready_queue_remove (rq, t);
+              t->priority = priority;
+              ready_queue_push (rq, t);
+            }
+          else
+            t->priority = priority;
+          changed = true;
+        }
+      if (!changed)
+        break;
+
+      /* Pairs with the fence in sema_down(). */
+      asm volatile ("mfence" : : : "memory");
+      sema = t->sema_waiting;
+      if (sema == NULL || spinlock_try_acquire (&sema->lock))
+        break;
+      spinlock_release (&rq->lock);
+      asm volatile ("pause" : : : "memory");
+    }
+
+  if (sema != NULL)
+    {
+      pheap_update (&sema->waiters, &t->wait_elem);
+      spinlock_release (&sema->lock);
+    }
+  if (cond != NULL)
+    {
+      if (changed)
+        pheap_update (&cond->waiters, &t->cond_elem);
+      spinlock_release (&cond->lock);
+    }
+  spinlock_release (&rq->lock);
+  intr_set_level (old_level);
 }
 
 /* Returns the current thread's priority. */
@@ -475,69 +1010,213 @@ thread_get_load_avg (void)
 int
 thread_get_recent_cpu (void) 
 {
-  return fptoi_round (fp_int_mul (thread_current ()->recent_cpu, 100));
+  struct thread *cur = thread_current ();
+  enum intr_level old_level = intr_disable ();
+  int recent_cpu;
+
+  mlfqs_catch_up (cur);
+  recent_cpu = fptoi_round (fp_int_mul (cur->recent_cpu, 100));
+  intr_set_level (old_level);
+  return recent_cpu;
 }
 
-/* Update recent_cpu for a thread. */
-void
-thread_update_recent_cpu (struct thread *t, void *aux UNUSED)
+/* Applies to T's recent_cpu the once-a-second decays of the
+   epochs that have begun since it was last brought up to date.
+   Interrupts must be off, and T must be the running thread or
+   not running at all. */
+static void
+mlfqs_catch_up (struct thread *t)
 {
-  if (t == idle_thread)
-    return;
-  t->recent_cpu = fp_mul (fp_div (fp_int_mul (load_avg, 2),
-                                  fp_add (fp_int_mul (load_avg, 2),
-                                          itofp (1))),
-                          t->recent_cpu);
-  t->recent_cpu = fp_int_add (t->recent_cpu, t->nice);
+  unsigned epoch = mlfqs_epoch;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (epoch - t->recent_cpu_epoch > DECAY_HISTORY)
+    t->recent_cpu_epoch = epoch - DECAY_HISTORY;
+  for (; t->recent_cpu_epoch != epoch; t->recent_cpu_epoch++)
+    {
+      fixed_point coeff = decay_history[t->recent_cpu_epoch % DECAY_HISTORY];
+      t->recent_cpu = fp_int_add (fp_mul (coeff, t->recent_cpu), t->nice);
+    }
 }
 
-void
+/* Returns T's MLFQS priority for its current recent_cpu and nice
+   values. */
+static int
+mlfqs_priority (const struct thread *t)
+{
+  int priority = PRI_MAX;
+  priority -= fptoi_round (fp_int_div (t->recent_cpu, 4));
+  priority -= 2 * t->nice;
+  if (priority > PRI_MAX)
+    priority = PRI_MAX;
+  else if (priority < PRI_MIN)
+    priority = PRI_MIN;
+  return priority;
+}
+
+/* Updates the load average and begins a new decay epoch.  Called
+   by the bootstrap processor's timer tick once for each second
+   that goes by. */
+static void
+mlfqs_new_epoch (void)
+{
+  unsigned epoch = mlfqs_epoch;
+
+  update_load_avg ();
+  decay_history[epoch % DECAY_HISTORY]
+    = fp_div (fp_int_mul (load_avg, 2),
+              fp_add (fp_int_mul (load_avg, 2), itofp (1)));
+  barrier ();
+  mlfqs_epoch = epoch + 1;
+}
+
+/* Updates the load average from the number of threads that are
+   running or ready to run. */
+static void
 update_load_avg (void)
 {
   const fixed_point eff1 = fp_div (itofp (59), itofp (60));
   const fixed_point eff2 = fp_int_div (itofp(1), 60);
-  int ready_threads_cnt = heap_size (&ready_heap);
-  if (thread_current () != idle_thread)
-    ready_threads_cnt++;
+  int ready_threads_cnt = 0;
+  unsigned i;
+
+  /* A snapshot taken without the run queue locks is good enough
+     for a moving average. */
+  for (i = 0; i < cpu_cnt; i++)
+    {
+      ready_threads_cnt += ready_queues[i].size;
+      if (!is_idle_thread (cpus[i].running))
+        ready_threads_cnt++;
+    }
   load_avg = fp_add (fp_mul (eff1, load_avg),
                      fp_int_mul (eff2, ready_threads_cnt));
 }
 
 /* Idle thread.  Executes when no other thread is ready to run.
 
-   The idle thread is initially put on the ready list by
-   thread_start().  It will be scheduled once initially, at which
-   point it initializes idle_thread, "up"s the semaphore passed
-   to it to enable thread_start() to continue, and immediately
-   blocks.  After that, the idle thread never appears in the
-   ready list.  It is returned by next_thread_to_run() as a
-   special case when the ready list is empty. */
+   The bootstrap processor's idle thread is initially put on the
+   ready list by thread_start().  It will be scheduled once
+   initially, at which point it registers itself with the CPU,
+   "up"s the semaphore passed to it to enable thread_start() to
+   continue, and immediately blocks.  An application processor's
+   idle thread is created by thread_create_ap_idle() instead and
+   enters here through thread_idle_ap(), with a null IDLE_STARTED_.
+   After that, an idle thread never appears in the ready list.
+   It is returned by next_thread_to_run() as a special case when
+   there is nothing else to run. */
 static void
-idle (void *idle_started_ UNUSED) 
+idle (void *idle_started_) 
 {
   struct semaphore *idle_started = idle_started_;
-  idle_thread = thread_current ();
-  sema_up (idle_started);
+  if (idle_started != NULL)
+    {
+      cpu_current ()->idle_thread = thread_current ();
+      sema_up (idle_started);
+    }
 
   for (;;) 
     {
-      /* Let someone else run. */
+      /* Let someone else run.  When we get back here, there was
+         nothing to run or steal, so wait for an interrupt with
+         the timer stopped.  After any interrupt, look again. */
       intr_disable ();
       thread_block ();
+      timer_idle ();
+    }
+}
+
+/* Creates the idle thread for application processor C, which
+   has not started yet.  The thread is marked as running on C,
+   and its stack is what C boots on; C must call
+   thread_idle_ap() once it is ready to run threads.  Returns
+   the new thread, or a null pointer if out of memory. */
+struct thread *
+thread_create_ap_idle (struct cpu *c)
+{
+  struct thread *t;
+  char name[16];
+
+  ASSERT (c != cpu_bsp ());
+
+  t = alloc_thread_page ();
+  if (t == NULL)
+    return NULL;
+
+  snprintf (name, sizeof name, "idle%u", c->id);
+  init_thread (t, name, PRI_MIN);
+  t->tid = allocate_tid ();
+  t->status = THREAD_RUNNING;
+  t->cpu = c;
+  c->idle_thread = c->running = t;
+  return t;
+}
+
+/* Turns the running application processor's boot code into its
+   idle thread.  Never returns. */
+void
+thread_idle_ap (void)
+{
+  struct thread *t = running_thread ();
+
+  ASSERT (is_thread (t) && is_idle_thread (t));
+
+  idle (NULL);
+  NOT_REACHED ();
+}
+
+/* Returns the CPU that the caller is running on.  Before
+   thread_init() this is always the bootstrap processor. */
+struct cpu *
+cpu_current (void)
+{
+  struct thread *t = running_thread ();
+  return is_thread (t) && t->cpu != NULL ? t->cpu : cpu_bsp ();
+}
+
+/* Sends a reschedule IPI to some CPU other than the running one
+   that is idle, if there is one, so that it looks for threads to
+   steal.  Interrupts must be off. */
+static void
+kick_idle_cpu (void)
+{
+  struct cpu *self = cpu_current ();
+  unsigned i;
+
+  for (i = 0; i < cpu_cnt; i++)
+    {
+      struct cpu *c = &cpus[i];
+      if (c != self && c->running != NULL && is_idle_thread (c->running))
+        {
+          lapic_send_ipi (c->lapic_id, LAPIC_VEC_RESCHED);
+          return;
+        }
+    }
+}
 
-      /* Re-enable interrupts and wait for the next one.
+/* Returns true if T is some CPU's idle thread. */
+static bool
+is_idle_thread (const struct thread *t)
+{
+  return t == t->cpu->idle_thread;
+}
 
-         The `sti' instruction disables interrupts until the
-         completion of the next instruction, so these two
-         instructions are executed atomically.  This atomicity is
-         important; otherwise, an interrupt could be handled
-         between re-enabling interrupts and waiting for the next
-         one to occur, wasting as much as one clock tick worth of
-         time.
+/* Acquires the lock of the run queue that T belongs to and
+   returns the run queue.  Interrupts must be off.  T may be
+   stolen by another CPU until we hold the lock, so check that T
+   is still on the same CPU and retry if not. */
+static struct ready_queue *
+lock_thread_queue (struct thread *t)
+{
+  for (;;)
+    {
+      struct cpu *c = t->cpu;
+      struct ready_queue *rq = &ready_queues[c->id];
 
-         See [IA32-v2a] "HLT", [IA32-v2b] "STI", and [IA32-v3a]
-         7.11.1 "HLT Instruction". */
-      asm volatile ("sti; hlt" : : : "memory");
+      spinlock_acquire (&rq->lock);
+      if (t->cpu == c)
+        return rq;
+      spinlock_release (&rq->lock);
     }
 }
 
@@ -573,6 +1252,173 @@ is_thread (struct thread *t)
   return t != NULL && t->magic == THREAD_MAGIC;
 }
 
+/* Thread pages.
+
+   A thread's page is taken from palloc only when its CPU has no
+   freed page cached: a dying thread's page goes back onto the
+   thread_cache of the CPU that destroys it, so that workloads
+   that create and destroy threads in a loop skip palloc's bitmap
+   scan, and its fill of every freed page in debug builds.  Pages
+   are not zeroed, since init_thread() clears `struct thread' and
+   nothing reads the stack above it before writing.  Each cache
+   is used by its own CPU with interrupts off, and its spinlock
+   lets a CPU that runs out of pages take back the pages cached
+   by the others.  A cached page does not count as allocated for
+   -mt.
+
+   With thread_stack_guard, each thread gets two pages instead of
+   one, of which the lower is unmapped, and a cached page keeps
+   its guard. */
+
+/* Returns a page for a new thread, or a null pointer if none is
+   available. */
+static struct thread *
+alloc_thread_page (void)
+{
+  struct thread *t = NULL;
+  enum intr_level old_level;
+  struct cpu *c;
+  uint8_t *base;
+
+  old_level = intr_disable ();
+  c = cpu_current ();
+  spinlock_acquire (&c->thread_cache_lock);
+  if (c->thread_cache_cnt > 0)
+    t = c->thread_cache[--c->thread_cache_cnt];
+  spinlock_release (&c->thread_cache_lock);
+  intr_set_level (old_level);
+  if (t != NULL)
+    {
+      if (memtrack_enabled)
+        memtrack_alloc (MEMTRACK_PALLOC, thread_page_base (t),
+                        thread_page_cnt () * PGSIZE, "thread",
+                        __builtin_return_address (0));
+      return t;
+    }
+
+  base = palloc_get_tagged (0, thread_page_cnt (), "thread");
+  if (base == NULL && drain_thread_caches ())
+    base = palloc_get_tagged (0, thread_page_cnt (), "thread");
+  if (base == NULL || !thread_stack_guard)
+    return (struct thread *) base;
+  set_page_present (base, false);
+  return (struct thread *) (base + PGSIZE);
+}
+
+/* Frees T's page, obtained from alloc_thread_page().  Interrupts
+   must be off. */
+static void
+free_thread_page (struct thread *t)
+{
+  struct cpu *c = cpu_current ();
+  bool cached = false;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  spinlock_acquire (&c->thread_cache_lock);
+  if (c->thread_cache_cnt < THREAD_CACHE_SIZE)
+    {
+      c->thread_cache[c->thread_cache_cnt++] = t;
+      cached = true;
+    }
+  spinlock_release (&c->thread_cache_lock);
+
+  if (!cached)
+    release_thread_page (t);
+  else if (memtrack_enabled)
+    memtrack_free (thread_page_base (t));
+}
+
+/* Returns T's page to palloc. */
+static void
+release_thread_page (struct thread *t)
+{
+  uint8_t *base = thread_page_base (t);
+
+  if (thread_stack_guard)
+    set_page_present (base, true);
+  palloc_free_multiple (base, thread_page_cnt ());
+}
+
+/* Returns every CPU's cached thread pages to palloc.  Returns
+   true if there were any. */
+static bool
+drain_thread_caches (void)
+{
+  bool drained = false;
+  unsigned i;
+
+  for (i = 0; i < cpu_cnt; i++)
+    {
+      struct cpu *c = &cpus[i];
+      struct thread *pages[THREAD_CACHE_SIZE];
+      enum intr_level old_level;
+      unsigned j, cnt;
+
+      old_level = spinlock_acquire_irqsave (&c->thread_cache_lock);
+      cnt = c->thread_cache_cnt;
+      memcpy (pages, c->thread_cache, cnt * sizeof *pages);
+      c->thread_cache_cnt = 0;
+      spinlock_release_irqrestore (&c->thread_cache_lock, old_level);
+
+      for (j = 0; j < cnt; j++)
+        release_thread_page (pages[j]);
+      if (cnt > 0)
+        drained = true;
+    }
+  return drained;
+}
+
+/* Returns the number of pages that each thread takes. */
+static size_t
+thread_page_cnt (void)
+{
+  return thread_stack_guard ? 2 : 1;
+}
+
+/* Returns the start of T's pages, which with thread_stack_guard
+   is the guard page below T. */
+static uint8_t *
+thread_page_base (struct thread *t)
+{
+  return thread_stack_guard ? (uint8_t *) t - PGSIZE : (uint8_t *) t;
+}
+
+/* Maps or unmaps the kernel page KPAGE, by changing its entry in
+   the kernel page table that all page directories share.  Only
+   the running CPU's TLB is flushed.  Another CPU may go on using
+   a stale entry for a page just unmapped, which lets an overflow
+   on that CPU into the (otherwise unused) guard page go
+   unnoticed but is harmless.  The TLB never caches not-present
+   entries, so mapping a page again needs no flush at all. */
+static void
+set_page_present (void *kpage, bool present)
+{
+  uint32_t *pt = pde_get_pt (init_page_dir[pd_no (kpage)]);
+  uint32_t *pte = &pt[pt_no (kpage)];
+
+  if (present)
+    *pte |= PTE_P;
+  else
+    *pte &= ~PTE_P;
+  asm volatile ("invlpg (%0)" : : "r" (kpage) : "memory");
+}
+
+/* Returns true if ADDR lies in a page of RAM that is unmapped
+   from the kernel's view of memory, which can only be a thread's
+   stack guard page. */
+bool
+thread_in_stack_guard (const void *addr)
+{
+  uint32_t pde;
+
+  if (!thread_stack_guard || !is_kernel_vaddr (addr)
+      || vtop (addr) >= (uintptr_t) init_ram_pages * PGSIZE)
+    return false;
+  pde = init_page_dir[pd_no (addr)];
+  return (pde & PTE_P) != 0 && (pde_get_pt (pde)[pt_no (addr)] & PTE_P) == 0;
+}
+
 /* Does basic initialization of T as a blocked thread named
    NAME. */
 static void
@@ -590,16 +1436,18 @@ init_thread (struct thread *t, const char *name, int priority)
   t->stack = (uint8_t *) t + PGSIZE;
   t->priority_origin = priority;
   t->priority = priority;
-  t->wake_time = (int64_t)0;
-  t->entry_ord = 0;
   t->magic = THREAD_MAGIC;
 
   t->lock_waiting = NULL;
-  list_init (&t->locks_holding_list);
+  pheap_init (&t->donors, donation_less);
+  timer_setup (&t->dl_timer, deadline_replenish, t);
 
-  old_level = intr_disable ();
+  /* A new thread starts on its creator's CPU. */
+  t->cpu = cpu_current ();
+
+  old_level = spinlock_acquire_irqsave (&all_list_lock);
   list_push_back (&all_list, &t->allelem);
-  intr_set_level (old_level);
+  spinlock_release_irqrestore (&all_list_lock, old_level);
 }
 
 /* Allocates a SIZE-byte frame at the top of thread T's stack and
@@ -615,18 +1463,300 @@ alloc_frame (struct thread *t, size_t size)
   return t->stack;
 }
 
-/* Chooses and returns the next thread to be scheduled.  Should
-   return a thread from the run queue, unless the run queue is
+/* Chooses and returns the next thread for CPU C to run.  Should
+   return a thread from C's run queue, unless that queue is
    empty.  (If the running thread can continue running, then it
-   will be in the run queue.)  If the run queue is empty, return
-   idle_thread. */
+   will be in the run queue.)  If the queue is empty, tries to
+   steal a thread from another CPU, and failing that returns C's
+   idle thread. */
+static struct thread *
+next_thread_to_run (struct cpu *c) 
+{
+  struct ready_queue *rq = &ready_queues[c->id];
+  struct thread *t;
+
+  if (rq->size > 0)
+    return ready_queue_pop (rq);
+  t = steal_thread (c);
+  return t != NULL ? t : c->idle_thread;
+}
+
+/* Takes the highest-priority thread from the run queue of
+   another CPU and moves it to CPU C, whose run queue lock must be
+   held.  Returns the thread, or a null pointer if no other CPU
+   has a ready thread.
+
+   The other queues are scanned without their locks, and we only
+   try once to lock the chosen one, because its CPU might be
+   trying to steal from us at the same time.  If we fail, we'll
+   look again at the next timer tick. */
+static struct thread *
+steal_thread (struct cpu *c)
+{
+  struct ready_queue *victim = NULL;
+  int victim_pri = -1;
+  struct thread *t = NULL;
+  unsigned i;
+
+  ASSERT (spinlock_held_by_current_cpu (&ready_queues[c->id].lock));
+
+  for (i = 0; i < cpu_cnt; i++)
+    if (i != c->id)
+      {
+        int pri = ready_queue_max_priority (&ready_queues[i]);
+        if (pri > victim_pri)
+          {
+            victim = &ready_queues[i];
+            victim_pri = pri;
+          }
+      }
+  if (victim == NULL || !spinlock_try_acquire (&victim->lock))
+    return NULL;
+
+  if (victim->size > 0)
+    {
+      t = ready_queue_pop (victim);
+      t->cpu = c;
+    }
+  spinlock_release (&victim->lock);
+  return t;
+}
+
+/* Initializes RQ as an empty run queue. */
+static void
+ready_queue_init (struct ready_queue *rq)
+{
+  int pri;
+
+  spinlock_init (&rq->lock, "run queue");
+  for (pri = PRI_MIN; pri <= PRI_MAX; pri++)
+    list_init (&rq->levels[pri]);
+  rq->nonempty = 0;
+  pheap_init (&rq->deadlines, deadline_later);
+  rq->earliest = INT64_MAX;
+  rq->size = 0;
+}
+
+/* Adds T to RQ: to its deadlines if T is a deadline thread with
+   budget left, otherwise to the back of the level for T's
+   priority.  Interrupts must be off. */
+static void
+ready_queue_push (struct ready_queue *rq, struct thread *t)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (PRI_MIN <= t->priority && t->priority <= PRI_MAX);
+
+  if (is_deadline_thread (t))
+    {
+      pheap_push (&rq->deadlines, &t->dl_elem);
+      if (t->dl_deadline < rq->earliest)
+        rq->earliest = t->dl_deadline;
+    }
+  else
+    {
+      list_push_back (&rq->levels[t->priority], &t->elem);
+      rq->nonempty |= (uint64_t) 1 << t->priority;
+    }
+  rq->size++;
+  t->ready_tsc = tsc_read ();
+}
+
+/* Removes T, which must be in RQ where ready_queue_push() put
+   it: in its deadlines, or at the level for its current
+   priority.  Interrupts must be off. */
+static void
+ready_queue_remove (struct ready_queue *rq, struct thread *t)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (rq->size > 0);
+
+  if (is_deadline_thread (t))
+    {
+      pheap_remove (&rq->deadlines, &t->dl_elem);
+      rq->earliest = (pheap_empty (&rq->deadlines) ? INT64_MAX
+                      : pheap_entry (pheap_top (&rq->deadlines),
+                                     struct thread, dl_elem)->dl_deadline);
+    }
+  else
+    {
+      list_remove (&t->elem);
+      if (list_empty (&rq->levels[t->priority]))
+        rq->nonempty &= ~((uint64_t) 1 << t->priority);
+    }
+  rq->size--;
+}
+
+/* Removes and returns the deadline thread in RQ with the
+   earliest deadline, if any, and otherwise the thread at the
+   front of the highest nonempty level of RQ.  RQ must not be
+   empty.  Interrupts must be off. */
 static struct thread *
-next_thread_to_run (void) 
+ready_queue_pop (struct ready_queue *rq)
+{
+  struct thread *t;
+
+  ASSERT (rq->size > 0);
+
+  if (!pheap_empty (&rq->deadlines))
+    t = pheap_entry (pheap_top (&rq->deadlines), struct thread, dl_elem);
+  else
+    t = list_entry (list_front (&rq->levels[ready_queue_max_priority (rq)]),
+                    struct thread, elem);
+  ready_queue_remove (rq, t);
+  return t;
+}
+
+/* Returns the highest priority of any thread in RQ, counting
+   deadline threads as PRI_MAX + 1, or -1 if RQ is empty.  The
+   bitmap is scanned one 32-bit half at a time, each with a
+   single BSR instruction. */
+static int
+ready_queue_max_priority (struct ready_queue *rq)
 {
-  if (heap_empty (&ready_heap))
-    return idle_thread;
+  uint32_t hi = rq->nonempty >> 32;
+  uint32_t lo = rq->nonempty;
+
+  if (!pheap_empty (&rq->deadlines))
+    return PRI_MAX + 1;
+  else if (hi != 0)
+    return 63 - __builtin_clz (hi);
+  else if (lo != 0)
+    return 31 - __builtin_clz (lo);
   else
-    return heap_pop (&ready_heap);
+    return -1;
+}
+
+/* Returns true if some thread in RQ outranks T, which is not in
+   RQ.  May be called without RQ's lock, in which case the answer
+   may be stale, or even wrong if a deadline is read while it is
+   being changed. */
+static bool
+ready_queue_outranks (struct ready_queue *rq, const struct thread *t)
+{
+  if (is_deadline_thread (t))
+    return rq->earliest < t->dl_deadline;
+  return ready_queue_max_priority (rq) > t->priority;
+}
+
+/* Returns true if T is a deadline thread with budget left, which
+   makes it outrank every priority thread. */
+static bool
+is_deadline_thread (const struct thread *t)
+{
+  return t->dl_runtime > 0 && !t->dl_throttled;
+}
+
+/* Returns true if A should run in preference to B: A is a
+   deadline thread and B is not or has a later deadline, or
+   neither is one and A has the higher priority. */
+static bool
+thread_outranks (const struct thread *a, const struct thread *b)
+{
+  if (is_deadline_thread (a))
+    return !is_deadline_thread (b) || a->dl_deadline < b->dl_deadline;
+  return !is_deadline_thread (b) && a->priority > b->priority;
+}
+
+/* Returns the bandwidth of RUNTIME ticks in every PERIOD ticks,
+   with 1.0 being 1 << DL_BW_SHIFT. */
+static int64_t
+deadline_bw (int64_t runtime, int64_t period)
+{
+  return (runtime << DL_BW_SHIFT) / period;
+}
+
+/* Makes the running thread T an ordinary priority thread, if it
+   is a deadline thread, without giving back its bandwidth.  If
+   T is throttled, its replenishment timer might be running on
+   the bootstrap processor right now, so wait for it to finish
+   before T may go away.  Interrupts must be off. */
+static void
+deadline_stop (struct thread *t)
+{
+  struct ready_queue *rq = &ready_queues[t->cpu->id];
+  bool cancelled;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (t == thread_current ());
+
+  if (t->dl_runtime == 0)
+    return;
+
+  cancelled = timer_cancel (&t->dl_timer);
+  for (;;)
+    {
+      spinlock_acquire (&rq->lock);
+      if (cancelled || !t->dl_throttled)
+        break;
+      spinlock_release (&rq->lock);
+      asm volatile ("pause" : : : "memory");
+    }
+  t->dl_runtime = t->dl_period = 0;
+  t->dl_throttled = false;
+  spinlock_release (&rq->lock);
+}
+
+/* Applies the CBS wakeup rule to deadline thread T, which is
+   being made ready: T keeps its deadline and budget only if the
+   budget, used up by the deadline, would not exceed T's
+   bandwidth.  Otherwise T starts a new period now.  T's run
+   queue lock must be held. */
+static void
+deadline_wakeup (struct thread *t)
+{
+  int64_t now = timer_ticks ();
+
+  if (now >= t->dl_deadline
+      || t->dl_budget * t->dl_period > t->dl_runtime * (t->dl_deadline - now))
+    {
+      t->dl_deadline = now + t->dl_period;
+      t->dl_budget = t->dl_runtime;
+    }
+}
+
+/* Timer function that ends the throttling of the deadline
+   thread in TIMER's auxiliary data at its deadline: refills its
+   budget and moves its deadline one period on, or to a period
+   from now if it fell that far behind. */
+static void
+deadline_replenish (struct timer *timer)
+{
+  struct thread *t = timer->aux;
+  struct ready_queue *rq = lock_thread_queue (t);
+  bool ready = t->status == THREAD_READY;
+  int64_t now = timer_ticks ();
+
+  ASSERT (t->dl_throttled);
+
+  if (ready)
+    ready_queue_remove (rq, t);
+  t->dl_deadline += t->dl_period;
+  if (t->dl_deadline <= now)
+    t->dl_deadline = now + t->dl_period;
+  t->dl_budget = t->dl_runtime;
+  t->dl_throttled = false;
+  if (ready)
+    {
+      struct cpu *c = t->cpu;
+
+      ready_queue_push (rq, t);
+      if (c != cpu_current ()
+          && (is_idle_thread (c->running) || thread_outranks (t, c->running)))
+        lapic_send_ipi (c->lapic_id, LAPIC_VEC_RESCHED);
+    }
+  spinlock_release (&rq->lock);
+  thread_preempt ();
+}
+
+/* Orders deadline threads in a run queue, with the earliest
+   deadline on top. */
+static bool
+deadline_later (const struct pheap_elem *a_, const struct pheap_elem *b_)
+{
+  const struct thread *a = pheap_entry (a_, struct thread, dl_elem);
+  const struct thread *b = pheap_entry (b_, struct thread, dl_elem);
+
+  return a->dl_deadline > b->dl_deadline;
 }
 
 /* Completes a thread switch by activating the new thread's page
@@ -655,8 +1785,11 @@ thread_schedule_tail (struct thread *prev)
   /* Mark us as running. */
   cur->status = THREAD_RUNNING;
 
-  /* Start new time slice. */
-  thread_ticks = 0;
+  /* Start new time slice, and let other CPUs at our run queue
+     now that PREV is no longer running. */
+  trace_switch_in (cur);
+  cpu_current ()->thread_ticks = 0;
+  spinlock_release (&ready_queues[cur->cpu->id].lock);
 
 #ifdef USERPROG
   /* Activate the new address space. */
@@ -671,7 +1804,7 @@ thread_schedule_tail (struct thread *prev)
   if (prev != NULL && prev->status == THREAD_DYING && prev != initial_thread) 
     {
       ASSERT (prev != cur);
-      palloc_free_page (prev);
+      free_thread_page (prev);
     }
 }
 
@@ -686,15 +1819,30 @@ static void
 schedule (void) 
 {
   struct thread *cur = running_thread ();
-  struct thread *next = next_thread_to_run ();
+  struct cpu *c = cur->cpu;
+  struct thread *next;
   struct thread *prev = NULL;
 
   ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (spinlock_held_by_current_cpu (&ready_queues[c->id].lock));
   ASSERT (cur->status != THREAD_RUNNING);
+
+  next = next_thread_to_run (c);
   ASSERT (is_thread (next));
+  ASSERT (next->cpu == c);
+  c->running = next;
 
+  c->schedule_cnt++;
   if (cur != next)
-    prev = switch_threads (cur, next);
+    {
+      c->switch_cnt++;
+      if (cur->status == THREAD_READY)
+        cur->rusage.ru_nivcsw++;
+      else if (cur->status == THREAD_BLOCKED)
+        cur->rusage.ru_nvcsw++;
+      trace_switch_out (cur, next);
+      prev = switch_threads (cur, next);
+    }
   thread_schedule_tail (prev);
 }
 
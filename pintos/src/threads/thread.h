@@ -4,8 +4,12 @@
 #include <debug.h>
 #include <heap.h>
 #include <list.h>
+#include <pheap.h>
+#include <rusage.h>
 #include <stdint.h>
+#include "devices/timer.h"
 #include "threads/fixed-point.h"
+#include "threads/synch.h"
 
 /* States in a thread's life cycle. */
 enum thread_status
@@ -78,13 +82,18 @@ typedef int tid_t;
    an assertion failure in thread_current(), which checks that
    the `magic' member of the running thread's `struct thread' is
    set to THREAD_MAGIC.  Stack overflow will normally change this
-   value, triggering the assertion. */
-/* The `elem' member has a dual purpose.  It can be an element in
-   the run queue (thread.c), or it can be an element in a
-   semaphore wait list (synch.c).  It can be used these two ways
-   only because they are mutually exclusive: only a thread in the
-   ready state is on the run queue, whereas only a thread in the
-   blocked state is on a semaphore wait list. */
+   value, triggering the assertion.  An overflow that runs past
+   `struct thread' without being caught tramples whatever page
+   lies below, so the "-stack-guard" kernel option leaves that
+   page unmapped: running into it then faults at once, and in
+   builds with user programs the double fault handler reports
+   the overflow. */
+/* The `elem' member is an element in the run queue (thread.c).
+   A thread waiting on a semaphore or condition variable is kept
+   in its waiters through `wait_elem' or `cond_elem' (synch.c),
+   which are ordered by priority, so whenever a waiting thread's
+   priority changes, thread_set_effective_priority() moves it
+   within those waiters too. */
 struct thread
   {
     /* Owned by thread.c. */
@@ -94,18 +103,45 @@ struct thread
     uint8_t *stack;                     /* Saved stack pointer. */
     int priority;                       /* Priority. */
     int priority_origin;                /* Original priority*/
-    int64_t wake_time;                  /* Wake up time (tick). */
-    int entry_ord;                      /* Entry order (priority FIFO) */
+    struct timer sleep_timer;           /* Wakes thread in timer_sleep(). */
+    uint64_t wake_tsc;                  /* Wake up time (TSC), if sleeping
+                                           in timer_sleep_ns(). */
+    struct heap_elem sleep_elem;        /* Element in timer_sleep_ns() heap. */
     struct list_elem allelem;           /* List element for all threads list. */
+    struct cpu *cpu;                    /* CPU running T, or that last did. */
+    uint64_t ready_tsc;                 /* TSC when last made ready. */
+    struct rusage rusage;               /* Resource usage.  Other modules
+                                           add their own counts. */
 
     /* Owned by thread.c, for mlfqs. */
     int nice;
     fixed_point recent_cpu;
+    unsigned recent_cpu_epoch;          /* Epoch recent_cpu is decayed to. */
+    unsigned recalc_ticks;              /* Ticks run since priority update. */
+
+    /* Owned by thread.c, for deadline scheduling. */
+    int64_t dl_runtime;                 /* Budget per period, in ticks, or 0
+                                           if not a deadline thread. */
+    int64_t dl_period;                  /* Period, in ticks. */
+    int64_t dl_deadline;                /* Current absolute deadline. */
+    int64_t dl_budget;                  /* Budget left before deadline. */
+    bool dl_throttled;                  /* Out of budget until deadline? */
+    struct timer dl_timer;              /* Replenishes the budget. */
+    struct pheap_elem dl_elem;          /* Element in run queue deadlines. */
 
     /* Shared between thread.c and synch.c. */
     struct list_elem elem;              /* List element. */
-    struct list locks_holding_list;     /* List of acquired locks */
+    struct pheap donors;                /* Donations, by priority. */
     struct lock *lock_waiting;          /* Lock that this thread is waiting */
+    struct semaphore *sema_waiting;     /* Semaphore waiting on, if any. */
+    struct pheap_elem wait_elem;        /* Element in its waiters. */
+    unsigned wait_seq;                  /* Arrival order in its waiters. */
+    struct condition *cond_waiting;     /* Condition waiting on, if any. */
+    struct semaphore *cond_sema;        /* Signaled by cond_signal(). */
+    struct pheap_elem cond_elem;        /* Element in its waiters. */
+    unsigned cond_seq;                  /* Arrival order in its waiters. */
+    struct rwlock *rwlock_waiting;      /* Rwlock waiting on, if any. */
+    struct rwlock_hold rwlock_holds[RWLOCK_HOLD_MAX]; /* Rwlocks held. */
 
 #ifdef USERPROG
     /* Owned by userprog/process.c. */
@@ -122,16 +158,28 @@ struct thread
 extern bool thread_mlfqs;
 extern fixed_point load_avg;
 
+/* If true, an unmapped guard page lies below each thread's page.
+   Controlled by kernel command-line option "-stack-guard". */
+extern bool thread_stack_guard;
+
 void thread_init (void);
 void thread_start (void);
+struct thread *thread_create_ap_idle (struct cpu *);
+void thread_idle_ap (void) NO_RETURN;
 
 void thread_tick (void);
+void thread_tick_idle (unsigned ticks);
 void thread_print_stats (void);
+void thread_print_rusage (void);
+long long thread_schedule_count (void);
+long long thread_switch_count (void);
 
 typedef void thread_func (void *aux);
 tid_t thread_create (const char *name, int priority, thread_func *, void *);
 
+struct spinlock;
 void thread_block (void);
+void thread_block_and_release (struct spinlock *);
 void thread_unblock (struct thread *);
 
 struct thread *thread_current (void);
@@ -140,6 +188,8 @@ const char *thread_name (void);
 
 void thread_exit (void) NO_RETURN;
 void thread_yield (void);
+void thread_preempt (void);
+bool thread_is_running (const struct thread *);
 
 /* Performs some operation on thread t, given auxiliary data AUX. */
 typedef void thread_action_func (struct thread *t, void *aux);
@@ -147,6 +197,7 @@ void thread_foreach (thread_action_func *, void *);
 
 int thread_get_priority (void);
 void thread_set_priority (int);
+bool thread_set_deadline (int64_t runtime, int64_t period);
 
 list_less_func cmp_thread_priority;
 
@@ -155,9 +206,8 @@ void thread_set_nice (int);
 int thread_get_recent_cpu (void);
 int thread_get_load_avg (void);
 thread_action_func thread_update_priority;
-thread_action_func thread_update_recent_cpu;
-void update_load_avg (void);
+void thread_set_effective_priority (struct thread *, int);
 
-void sort_ready_heap (void);
+bool thread_in_stack_guard (const void *);
 
 #endif /* threads/thread.h */
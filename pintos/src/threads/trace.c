@@ -0,0 +1,260 @@
+#include "threads/trace.h"
+#include <debug.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "threads/interrupt.h"
+#include "threads/smp.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/tsc.h"
+
+/* Scheduler trace.
+
+   Each CPU records scheduling events into a ring of the last
+   TRACE_EVENTS events, which only it writes, and only with
+   interrupts off, so recording takes no lock.  The events are:
+
+     - TRACE_SWITCH_OUT, from schedule(): TID is switching to
+       OTHER.  ARG is TID's new status, an enum thread_status.
+
+     - TRACE_SWITCH_IN, from thread_schedule_tail(): TID is now
+       running.  ARG is the number of TSC cycles that TID spent
+       on a run queue before it got here, saturating at
+       UINT32_MAX, or 0 if it did not come off a run queue, as
+       an idle thread does not.
+
+     - TRACE_WAKEUP, from thread_unblock(): OTHER made TID ready.
+       ARG is the CPU whose run queue TID went on.
+
+     - TRACE_DONATE, from donate_priority(): TID donated priority
+       ARG to OTHER.
+
+   trace_dump() merges the rings by time and prints them, with a
+   summary of run queue wait times.  It runs for the "sched-trace"
+   kernel command-line action, and when Ctrl+T arrives on the
+   serial port.  Printing the whole trace takes far too long for
+   an interrupt handler, so the serial interrupt handler calls
+   trace_request_dump() instead, which wakes a kernel thread to
+   do it. */
+
+/* Events per CPU.  Must be a power of 2. */
+#define TRACE_EVENTS 256
+
+/* A CPU's trace ring. */
+struct trace_ring
+  {
+    struct trace_event events[TRACE_EVENTS];
+    unsigned head;              /* Total events ever recorded. */
+  };
+
+static struct trace_ring rings[CPU_MAX];
+
+/* False while trace_dump() reads the rings. */
+static volatile bool tracing = true;
+
+/* Upped to make dump_thread() print the trace. */
+static struct semaphore dump_sema;
+static bool dump_thread_started;
+
+static thread_func dump_thread NO_RETURN;
+
+/* Starts the thread that prints the trace on request.  Must be
+   called after thread_start(). */
+void
+trace_init (void)
+{
+  sema_init (&dump_sema, 0);
+  thread_create ("trace", PRI_MAX, dump_thread, NULL);
+  dump_thread_started = true;
+}
+
+/* Prints the trace whenever trace_request_dump() asks for it. */
+static void
+dump_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      sema_down (&dump_sema);
+      trace_dump ();
+    }
+}
+
+/* Asks for the trace to be printed from thread context.  May be
+   called from an interrupt handler.  Requests made while a dump
+   is pending are merged into it. */
+void
+trace_request_dump (void)
+{
+  if (dump_thread_started && dump_sema.value == 0)
+    sema_up (&dump_sema);
+}
+
+/* Records an event of TYPE in the running CPU's ring. */
+static void
+record (enum trace_type type, int tid, int other, uint32_t arg)
+{
+  struct cpu *c = cpu_current ();
+  struct trace_ring *r = &rings[c->id];
+  struct trace_event *e;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (!tracing)
+    return;
+  e = &r->events[r->head % TRACE_EVENTS];
+  e->tsc = tsc_read ();
+  e->tid = tid;
+  e->other = other;
+  e->arg = arg;
+  e->type = type;
+  e->cpu = c->id;
+  r->head++;
+}
+
+/* Records that PREV is switching to NEXT. */
+void
+trace_switch_out (const struct thread *prev, const struct thread *next)
+{
+  record (TRACE_SWITCH_OUT, prev->tid, next->tid, prev->status);
+}
+
+/* Records that T started running, and how long it waited.  T's
+   `ready_tsc' is the time it last went on a run queue, which is
+   cleared here so that a thread that runs again without going
+   through a run queue, such as an idle thread, records no
+   wait. */
+void
+trace_switch_in (struct thread *t)
+{
+  uint32_t wait = 0;
+
+  if (t->ready_tsc != 0)
+    {
+      uint64_t cycles = tsc_read () - t->ready_tsc;
+      wait = cycles < UINT32_MAX ? cycles : UINT32_MAX;
+      t->ready_tsc = 0;
+    }
+  record (TRACE_SWITCH_IN, t->tid, 0, wait);
+}
+
+/* Records that the running thread made T ready. */
+void
+trace_wakeup (const struct thread *t)
+{
+  record (TRACE_WAKEUP, t->tid, thread_current ()->tid, t->cpu->id);
+}
+
+/* Records that DONOR donated its priority to HOLDER. */
+void
+trace_donate (const struct thread *donor, const struct thread *holder)
+{
+  record (TRACE_DONATE, donor->tid, holder->tid, donor->priority);
+}
+
+/* Returns TSC cycles CYCLES in microseconds. */
+static int64_t
+cycles_to_us (uint64_t cycles)
+{
+  return timer_cycles_to_ns (cycles) / 1000;
+}
+
+/* Prints event E. */
+static void
+print_event (const struct trace_event *e)
+{
+  static const char *status_names[] =
+    {"running", "ready", "blocked", "dying"};
+  int64_t us = timer_tsc_to_ns (e->tsc) / 1000;
+
+  printf ("%8"PRId64".%06"PRId64" cpu%u ",
+          us / 1000000, us % 1000000, e->cpu);
+  switch (e->type)
+    {
+    case TRACE_SWITCH_OUT:
+      printf ("switch  %d -> %d (%s)\n", e->tid, e->other,
+              e->arg < 4 ? status_names[e->arg] : "?");
+      break;
+    case TRACE_SWITCH_IN:
+      printf ("run     %d after %"PRId64" us ready%s\n", e->tid,
+              cycles_to_us (e->arg), e->arg == UINT32_MAX ? "+" : "");
+      break;
+    case TRACE_WAKEUP:
+      printf ("wakeup  %d by %d onto cpu%"PRIu32"\n",
+              e->tid, e->other, e->arg);
+      break;
+    case TRACE_DONATE:
+      printf ("donate  %d -> %d priority %"PRIu32"\n",
+              e->tid, e->other, e->arg);
+      break;
+    default:
+      printf ("unknown event %u\n", e->type);
+      break;
+    }
+}
+
+/* Prints the scheduler trace of all CPUs, oldest event first,
+   followed by a summary. */
+void
+trace_dump (void)
+{
+  unsigned next[CPU_MAX];
+  unsigned i;
+  long long switch_ins = 0, donations = 0;
+  uint64_t total_wait = 0, max_wait = 0;
+  int max_wait_tid = 0;
+
+  tracing = false;
+  barrier ();
+
+  /* Start each CPU's cursor at its oldest event still in the
+     ring. */
+  for (i = 0; i < cpu_cnt; i++)
+    next[i] = rings[i].head > TRACE_EVENTS ? rings[i].head - TRACE_EVENTS : 0;
+
+  printf ("Scheduler trace (seconds, cpu, event):\n");
+  for (;;)
+    {
+      const struct trace_event *e = NULL;
+      unsigned cpu = 0;
+
+      /* Take the oldest event not yet printed. */
+      for (i = 0; i < cpu_cnt; i++)
+        if (next[i] != rings[i].head)
+          {
+            const struct trace_event *f
+              = &rings[i].events[next[i] % TRACE_EVENTS];
+            if (e == NULL || f->tsc < e->tsc)
+              {
+                e = f;
+                cpu = i;
+              }
+          }
+      if (e == NULL)
+        break;
+      next[cpu]++;
+
+      print_event (e);
+      if (e->type == TRACE_SWITCH_IN && e->arg != 0)
+        {
+          switch_ins++;
+          total_wait += e->arg;
+          if (e->arg > max_wait)
+            {
+              max_wait = e->arg;
+              max_wait_tid = e->tid;
+            }
+        }
+      else if (e->type == TRACE_DONATE)
+        donations++;
+    }
+
+  printf ("Run queue wait: %lld switches, %"PRId64" us average, "
+          "%"PRId64" us max (thread %d); %lld donations\n",
+          switch_ins,
+          switch_ins ? cycles_to_us (total_wait / switch_ins) : 0,
+          cycles_to_us (max_wait), max_wait_tid, donations);
+
+  barrier ();
+  tracing = true;
+}
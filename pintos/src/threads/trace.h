@@ -0,0 +1,36 @@
+#ifndef THREADS_TRACE_H
+#define THREADS_TRACE_H
+
+#include <stdint.h>
+
+struct thread;
+
+/* Scheduler trace events.  See trace.c. */
+enum trace_type
+  {
+    TRACE_SWITCH_OUT,           /* TID stopped running, for OTHER. */
+    TRACE_SWITCH_IN,            /* TID started running. */
+    TRACE_WAKEUP,               /* TID made ready by OTHER. */
+    TRACE_DONATE                /* TID donated priority to OTHER. */
+  };
+
+/* One trace event. */
+struct trace_event
+  {
+    uint64_t tsc;               /* Time-stamp counter when recorded. */
+    int tid;                    /* Thread the event is about. */
+    int other;                  /* Other thread involved, or 0. */
+    uint32_t arg;               /* Depends on type; see trace.c. */
+    uint8_t type;               /* A TRACE_* value. */
+    uint8_t cpu;                /* CPU that recorded the event. */
+  };
+
+void trace_switch_out (const struct thread *prev, const struct thread *next);
+void trace_switch_in (struct thread *);
+void trace_wakeup (const struct thread *);
+void trace_donate (const struct thread *donor, const struct thread *holder);
+void trace_init (void);
+void trace_dump (void);
+void trace_request_dump (void);
+
+#endif /* threads/trace.h */
@@ -58,6 +58,12 @@ exception_init (void)
      We need to disable interrupts for page faults because the
      fault address is stored in CR2 and needs to be preserved. */
   intr_register_int (14, 0, INTR_OFF, page_fault, "#PF Page-Fault Exception");
+
+  /* A double fault in the kernel usually means that the CPU
+     could not push an exception frame onto the kernel stack, so
+     it is handled as a separate task with a stack of its own
+     (see tss.c). */
+  intr_register_task (8, SEL_DFTSS, "#DF Double Fault Exception");
 }
 
 /* Prints exception statistics. */
@@ -142,6 +148,7 @@ page_fault (struct intr_frame *f)
 
   /* Count page faults. */
   page_fault_cnt++;
+  thread_current ()->rusage.ru_faults++;
 
   /* Determine cause. */
   not_present = (f->error_code & PF_P) == 0;
@@ -36,6 +36,7 @@ void
 gdt_init (void)
 {
   uint64_t gdtr_operand;
+  int i;
 
   /* Initialize GDT. */
   gdt[SEL_NULL / sizeof *gdt] = 0;
@@ -43,7 +44,9 @@ gdt_init (void)
   gdt[SEL_KDSEG / sizeof *gdt] = make_data_desc (0);
   gdt[SEL_UCSEG / sizeof *gdt] = make_code_desc (3);
   gdt[SEL_UDSEG / sizeof *gdt] = make_data_desc (3);
-  gdt[SEL_TSS / sizeof *gdt] = make_tss_desc (tss_get ());
+  for (i = 0; i < CPU_MAX; i++)
+    gdt[SEL_TSS_CPU (i) / sizeof *gdt] = make_tss_desc (tss_get (i));
+  gdt[SEL_DFTSS / sizeof *gdt] = make_tss_desc (tss_get_double_fault ());
 
   /* Load GDTR, TR.  See [IA32-v3a] 2.4.1 "Global Descriptor
      Table Register (GDTR)", 2.4.4 "Task Register (TR)", and
@@ -52,6 +55,20 @@ gdt_init (void)
   asm volatile ("lgdt %0" : : "m" (gdtr_operand));
   asm volatile ("ltr %w0" : : "q" (SEL_TSS));
 }
+
+/* Loads the GDT built by gdt_init() into the running application
+   processor, along with the TSS for the CPU with the given ID. */
+void
+gdt_init_ap (unsigned cpu_id)
+{
+  uint64_t gdtr_operand;
+
+  ASSERT (cpu_id < CPU_MAX);
+
+  gdtr_operand = make_gdtr_operand (sizeof gdt - 1, gdt);
+  asm volatile ("lgdt %0" : : "m" (gdtr_operand));
+  asm volatile ("ltr %w0" : : "q" (SEL_TSS_CPU (cpu_id)));
+}
 
 /* System segment or code/data segment? */
 enum seg_class
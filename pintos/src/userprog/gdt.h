@@ -2,14 +2,22 @@
 #define USERPROG_GDT_H
 
 #include "threads/loader.h"
+#include "threads/smp.h"
 
 /* Segment selectors.
    More selectors are defined by the loader in loader.h. */
 #define SEL_UCSEG       0x1B    /* User code selector. */
 #define SEL_UDSEG       0x23    /* User data selector. */
-#define SEL_TSS         0x28    /* Task-state segment. */
-#define SEL_CNT         6       /* Number of segments. */
+#define SEL_TSS         0x28    /* Task-state segment of CPU 0. */
+#define SEL_CNT         (6 + CPU_MAX) /* Number of segments. */
+
+/* Task-state segment selector for the CPU with the given ID. */
+#define SEL_TSS_CPU(ID) (SEL_TSS + 8 * (ID))
+
+/* Task-state segment of the double fault task. */
+#define SEL_DFTSS       SEL_TSS_CPU (CPU_MAX)
 
 void gdt_init (void);
+void gdt_init_ap (unsigned cpu_id);
 
 #endif /* userprog/gdt.h */
@@ -1,20 +1,114 @@
 #include "userprog/syscall.h"
+#include <stdint.h>
 #include <stdio.h>
 #include <syscall-nr.h>
 #include "threads/interrupt.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "userprog/pagedir.h"
 
 static void syscall_handler (struct intr_frame *);
+static bool copy_in (void *, const void *usrc, size_t);
+static bool copy_out (void *udst, const void *, size_t);
+static int *user_futex (int *uaddr);
 
 void
-syscall_init (void) 
+syscall_init (void)
 {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
 }
 
 static void
-syscall_handler (struct intr_frame *f UNUSED) 
+syscall_handler (struct intr_frame *f)
 {
-  printf ("system call!\n");
-  thread_exit ();
+  int args[3];
+  int *futex;
+
+  /* The system call number and its arguments are on the user
+     stack. */
+  if (!copy_in (args, f->esp, sizeof *args))
+    thread_exit ();
+  switch (args[0])
+    {
+    case SYS_FUTEX_WAIT:
+      if (!copy_in (args + 1, (int *) f->esp + 1, 2 * sizeof *args))
+        thread_exit ();
+      futex = user_futex ((int *) args[1]);
+      f->eax = futex != NULL && futex_wait (futex, args[2]) ? 0 : -1;
+      break;
+
+    case SYS_FUTEX_WAKE:
+      if (!copy_in (args + 1, (int *) f->esp + 1, 2 * sizeof *args))
+        thread_exit ();
+      futex = user_futex ((int *) args[1]);
+      f->eax = futex != NULL ? (int) futex_wake (futex, args[2]) : -1;
+      break;
+
+    case SYS_GETRUSAGE:
+      if (!copy_in (args + 1, (int *) f->esp + 1, sizeof *args))
+        thread_exit ();
+      f->eax = copy_out ((void *) args[1], &thread_current ()->rusage,
+                         sizeof (struct rusage)) ? 0 : -1;
+      break;
+
+    default:
+      printf ("system call!\n");
+      thread_exit ();
+    }
+}
+
+/* Copies SIZE bytes from user address USRC to kernel address
+   DST.  Returns true if successful, false if any of the user
+   bytes is not mapped. */
+static bool
+copy_in (void *dst_, const void *usrc_, size_t size)
+{
+  uint8_t *dst = dst_;
+  const uint8_t *usrc = usrc_;
+
+  for (; size > 0; size--, dst++, usrc++)
+    {
+      const uint8_t *src;
+
+      if (!is_user_vaddr (usrc))
+        return false;
+      src = pagedir_get_page (thread_current ()->pagedir, usrc);
+      if (src == NULL)
+        return false;
+      *dst = *src;
+    }
+  return true;
+}
+
+/* Copies SIZE bytes from kernel address SRC to user address
+   UDST.  Returns true if successful, false if any of the user
+   bytes is not mapped writable.  Nothing is copied on failure. */
+static bool
+copy_out (void *udst_, const void *src_, size_t size)
+{
+  uint32_t *pd = thread_current ()->pagedir;
+  uint8_t *udst = udst_;
+  const uint8_t *src = src_;
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    if (!is_user_vaddr (udst + i)
+        || !pagedir_is_writable (pd, udst + i))
+      return false;
+  for (i = 0; i < size; i++)
+    *(uint8_t *) pagedir_get_page (pd, udst + i) = src[i];
+  return true;
+}
+
+/* Returns the kernel address of the futex at user address UADDR,
+   or a null pointer if UADDR is misaligned or not mapped.  The
+   kernel address identifies the futex's physical memory, so
+   processes that share a page would share its futexes too. */
+static int *
+user_futex (int *uaddr)
+{
+  if ((uintptr_t) uaddr % sizeof *uaddr != 0 || !is_user_vaddr (uaddr))
+    return NULL;
+  return pagedir_get_page (thread_current ()->pagedir, uaddr);
 }
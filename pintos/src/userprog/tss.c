@@ -2,8 +2,12 @@
 #include <debug.h>
 #include <stddef.h>
 #include "userprog/gdt.h"
+#include "threads/flags.h"
+#include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/thread.h"
 #include "threads/palloc.h"
+#include "threads/smp.h"
 #include "threads/vaddr.h"
 
 /* The Task-State Segment (TSS).
@@ -72,35 +76,97 @@ struct tss
     uint16_t trace, bitmap;
   };
 
-/* Kernel TSS. */
+/* Kernel TSSes, one per CPU, since each CPU switches to the
+   stack of the thread that it is running, followed by the TSS of
+   the double fault task.  They all fit in a single page. */
 static struct tss *tss;
 
-/* Initializes the kernel TSS. */
+/* The double fault task.
+
+   A CPU that faults while pushing an exception frame, typically
+   because its stack pointer ran off the bottom of a kernel stack
+   into an unmapped guard page (see thread_stack_guard), takes a
+   double fault.  Handling that on the same stack would just
+   fault again and reset the machine, so the double fault gate is
+   a task gate (see exception.c) that switches to a task with its
+   own TSS and stack.  The faulting CPU's state is saved in its
+   own TSS, which the double fault task reports from. */
+static void double_fault (void) NO_RETURN;
+
+/* Initializes the kernel TSSes. */
 void
 tss_init (void) 
 {
+  struct tss *df;
+  int i;
+
+  ASSERT ((CPU_MAX + 1) * sizeof *tss <= PGSIZE);
+
   /* Our TSS is never used in a call gate or task gate, so only a
      few fields of it are ever referenced, and those are the only
      ones we initialize. */
   tss = palloc_get_page (PAL_ASSERT | PAL_ZERO);
-  tss->ss0 = SEL_KDSEG;
-  tss->bitmap = 0xdfff;
+  for (i = 0; i < CPU_MAX; i++)
+    {
+      tss[i].ss0 = SEL_KDSEG;
+      tss[i].bitmap = 0xdfff;
+    }
+
+  /* The double fault task starts out with interrupts off, in the
+     kernel address space, at the top of its own stack. */
+  df = &tss[CPU_MAX];
+  df->cr3 = vtop (init_page_dir);
+  df->eip = double_fault;
+  df->eflags = FLAG_MBS;
+  df->esp = (uint32_t) palloc_get_page (PAL_ASSERT | PAL_ZERO) + PGSIZE;
+  df->cs = SEL_KCSEG;
+  df->ss = df->ds = df->es = df->fs = df->gs = SEL_KDSEG;
+  df->bitmap = 0xdfff;
+
   tss_update ();
 }
 
-/* Returns the kernel TSS. */
+/* Returns the kernel TSS for the CPU with the given ID. */
 struct tss *
-tss_get (void) 
+tss_get (unsigned cpu_id) 
 {
   ASSERT (tss != NULL);
-  return tss;
+  ASSERT (cpu_id < CPU_MAX);
+  return &tss[cpu_id];
 }
 
-/* Sets the ring 0 stack pointer in the TSS to point to the end
-   of the thread stack. */
+/* Returns the TSS of the double fault task. */
+struct tss *
+tss_get_double_fault (void)
+{
+  ASSERT (tss != NULL);
+  return &tss[CPU_MAX];
+}
+
+/* Sets the ring 0 stack pointer in the running CPU's TSS to point
+   to the end of the thread stack. */
 void
 tss_update (void) 
 {
   ASSERT (tss != NULL);
-  tss->esp0 = (uint8_t *) thread_current () + PGSIZE;
+  tss[cpu_current ()->id].esp0 = (uint8_t *) thread_current () + PGSIZE;
+}
+
+/* Entered by a task switch when a CPU double faults, with an
+   error code of 0 pushed where a return address would be.
+   Reports the state the CPU faulted in, as saved in its own
+   TSS, and panics. */
+static void
+double_fault (void)
+{
+  unsigned cpu_id = (tss[CPU_MAX].back_link - SEL_TSS) / 8;
+  const struct tss *prev = &tss[cpu_id];
+  const uint8_t *esp = (const uint8_t *) prev->esp;
+
+  /* The saved stack pointer is the one before the CPU tried to
+     push the frame it could not. */
+  if (thread_in_stack_guard (esp - sizeof (struct intr_frame)))
+    PANIC ("Kernel stack overflow on CPU %u (eip=%p, esp=%p)",
+           cpu_id, prev->eip, esp);
+  PANIC ("Double fault on CPU %u (eip=%p, esp=%p)", cpu_id, prev->eip, esp);
 }
@@ -5,7 +5,8 @@
 
 struct tss;
 void tss_init (void);
-struct tss *tss_get (void);
+struct tss *tss_get (unsigned cpu_id);
+struct tss *tss_get_double_fault (void);
 void tss_update (void);
 
 #endif /* userprog/tss.h */